@@ -0,0 +1,62 @@
+#include "measure-ghmc.hh"
+
+#include <benchmark/benchmark.h>
+
+
+BENCHMARK_DEFINE_F(GHMCBenchmark, FunnelHessian)
+(benchmark::State &state) {
+    funnel_hessian(state);
+}
+
+BENCHMARK_DEFINE_F(GHMCBenchmark, FunnelSoftAbsMetric)
+(benchmark::State &state) {
+    funnel_softabs_metric(state);
+}
+
+BENCHMARK_DEFINE_F(GHMCBenchmark, FunnelEuclideanTrajectory)
+(benchmark::State &state) {
+    funnel_euclidean_trajectory(state);
+}
+
+BENCHMARK_DEFINE_F(GHMCBenchmark, FunnelRiemannianTrajectory)
+(benchmark::State &state) {
+    funnel_riemannian_trajectory(state);
+}
+
+BENCHMARK_DEFINE_F(GHMCBenchmark, FunnelSampler)
+(benchmark::State &state) {
+    funnel_sampler(state);
+}
+
+BENCHMARK_DEFINE_F(BNetBenchmark, BNetHessian)
+(benchmark::State &state) {
+    bnet_hessian(state);
+}
+
+BENCHMARK_DEFINE_F(BNetBenchmark, BNetEuclideanTrajectory)
+(benchmark::State &state) {
+    bnet_euclidean_trajectory(state);
+}
+
+BENCHMARK_DEFINE_F(BNetBenchmark, BNetRiemannianTrajectory)
+(benchmark::State &state) {
+    bnet_riemannian_trajectory(state);
+}
+
+BENCHMARK_DEFINE_F(BNetBenchmark, BNetSampler)
+(benchmark::State &state) {
+    bnet_sampler(state);
+}
+
+#define GHMC_FUNNEL_ARGS ArgsProduct({{8, 32, 128}, {1, 2, 4}})->Unit(benchmark::kMillisecond)
+#define GHMC_BNET_ARGS ArgsProduct({{1, 2, 4}})->Unit(benchmark::kMillisecond)
+
+BENCHMARK_REGISTER_F(GHMCBenchmark, FunnelHessian)->GHMC_FUNNEL_ARGS;
+BENCHMARK_REGISTER_F(GHMCBenchmark, FunnelSoftAbsMetric)->GHMC_FUNNEL_ARGS;
+BENCHMARK_REGISTER_F(GHMCBenchmark, FunnelEuclideanTrajectory)->GHMC_FUNNEL_ARGS;
+BENCHMARK_REGISTER_F(GHMCBenchmark, FunnelRiemannianTrajectory)->GHMC_FUNNEL_ARGS;
+BENCHMARK_REGISTER_F(GHMCBenchmark, FunnelSampler)->GHMC_FUNNEL_ARGS;
+BENCHMARK_REGISTER_F(BNetBenchmark, BNetHessian)->GHMC_BNET_ARGS;
+BENCHMARK_REGISTER_F(BNetBenchmark, BNetEuclideanTrajectory)->GHMC_BNET_ARGS;
+BENCHMARK_REGISTER_F(BNetBenchmark, BNetRiemannianTrajectory)->GHMC_BNET_ARGS;
+BENCHMARK_REGISTER_F(BNetBenchmark, BNetSampler)->GHMC_BNET_ARGS;
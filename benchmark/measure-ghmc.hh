@@ -0,0 +1,123 @@
+#pragma once
+
+#include "../test/test-data.hh"
+
+#include <noa/ghmc.hh>
+#include <noa/utils/common.hh>
+
+#include <benchmark/benchmark.h>
+
+using namespace noa;
+using namespace noa::ghmc;
+using namespace noa::utils;
+
+// Trajectories are timed over all max_flow_steps leapfrog steps.
+inline const auto whole_trajectory = [](const HamiltonianFlow &) { return true; };
+
+// Arguments: dimension of the funnel, number of intra-op threads.
+struct GHMCBenchmark : benchmark::Fixture {
+    Tensor theta;
+    Configuration<float> conf = Configuration<float>{}
+            .set_max_flow_steps(10)
+            .set_step_size(0.01f)
+            .set_binding_const(10.f)
+            .set_jitter(0.00001);
+
+    void SetUp(const benchmark::State &state) override {
+        torch::set_num_threads(static_cast<int>(state.range(1)));
+        torch::manual_seed(utils::SEED);
+        theta = torch::randn(state.range(0)) / 10;
+    }
+
+    inline void funnel_hessian(benchmark::State &state) {
+        for (auto _ : state)
+            benchmark::DoNotOptimize(numerics::hessian(log_funnel(Parameters{theta})));
+    }
+
+    inline void funnel_softabs_metric(benchmark::State &state) {
+        const auto metric = softabs_metric(conf);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(metric(log_funnel(Parameters{theta})));
+    }
+
+    inline void funnel_euclidean_trajectory(benchmark::State &state) {
+        const auto dynamics = euclidean_dynamics(
+                log_funnel, identity_diagonal_metric_like(Parameters{theta}), whole_trajectory, conf);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(dynamics(Parameters{theta}));
+    }
+
+    inline void funnel_riemannian_trajectory(benchmark::State &state) {
+        const auto dynamics = riemannian_dynamics(log_funnel, softabs_metric(conf), whole_trajectory, conf);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(dynamics(Parameters{theta}));
+    }
+
+    inline void funnel_sampler(benchmark::State &state) {
+        const auto dynamics = euclidean_dynamics(
+                log_funnel, identity_diagonal_metric_like(Parameters{theta}), metropolis_criterion, conf);
+        const auto chain_sampler = sampler(dynamics, full_trajectory, conf);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(chain_sampler(Parameters{theta}, 10));
+    }
+};
+
+// Bayesian neural net regression on noisy sine data.
+// Arguments: number of intra-op threads.
+struct BNetBenchmark : benchmark::Fixture {
+    ScriptModuleOpt module;
+    Tensor x_train;
+    Tensor y_train;
+    Configuration<float> conf = Configuration<float>{}
+            .set_max_flow_steps(10)
+            .set_step_size(0.001f)
+            .set_binding_const(10.f)
+            .set_jitter(0.00001);
+
+    void SetUp(const benchmark::State &state) override {
+        torch::set_num_threads(static_cast<int>(state.range(0)));
+        torch::manual_seed(utils::SEED);
+        module = load_module(jit_net_pt);
+        if (!module.has_value())
+            throw std::runtime_error(CORRUPTED_TEST_DATA);
+        module.value().train();
+        x_train = torch::linspace(-3.14f, 3.14f, 6).view({-1, 1});
+        y_train = torch::sin(x_train) + 0.1f * torch::randn_like(x_train);
+    }
+
+    inline auto log_prob_bnet() {
+        auto &net = module.value();
+        return numerics::regression_log_probability(
+                net, 0.01f, zeros_like(parameters(net), true), 1.f)(x_train, y_train);
+    }
+
+    inline void bnet_hessian(benchmark::State &state) {
+        const auto log_prob = log_prob_bnet();
+        const auto params = parameters(module.value());
+        for (auto _ : state)
+            benchmark::DoNotOptimize(numerics::hessian(log_prob(params)));
+    }
+
+    inline void bnet_euclidean_trajectory(benchmark::State &state) {
+        const auto params = parameters(module.value());
+        const auto dynamics = euclidean_dynamics(log_prob_bnet(), identity_diagonal_metric_like(params), whole_trajectory, conf);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(dynamics(params));
+    }
+
+    inline void bnet_riemannian_trajectory(benchmark::State &state) {
+        const auto params = parameters(module.value());
+        const auto dynamics = riemannian_dynamics(log_prob_bnet(), softabs_metric(conf), whole_trajectory, conf);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(dynamics(params));
+    }
+
+    inline void bnet_sampler(benchmark::State &state) {
+        const auto params = parameters(module.value());
+        const auto dynamics = euclidean_dynamics(
+                log_prob_bnet(), identity_diagonal_metric_like(params), metropolis_criterion, conf);
+        const auto chain_sampler = sampler(dynamics, full_trajectory, conf);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(chain_sampler(params, 10));
+    }
+};
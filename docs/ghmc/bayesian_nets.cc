@@ -85,7 +85,7 @@ torch::Tensor sample_jit_module(
 
     const auto net_params = parameters(net);
     const auto ham_dym = euclidean_dynamics(
-            log_prob_bnet, identity_metric_like(net_params), metropolis_criterion, conf_bnet);
+            log_prob_bnet, identity_diagonal_metric_like(net_params), metropolis_criterion, conf_bnet);
     const auto bnet_sampler = sampler(ham_dym, full_trajectory, conf_bnet);
 
     const auto samples = bnet_sampler(net_params, niter);
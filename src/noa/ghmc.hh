@@ -25,8 +25,10 @@
 
 #include "noa/utils/numerics.hh"
 
+#include <atomic>
 #include <iostream>
 #include <chrono>
+#include <memory>
 
 #include <torch/torch.h>
 
@@ -59,6 +61,136 @@ namespace noa::ghmc {
     using Samples = std::vector<Parameters>;
 
 
+    using GeneratorOpt = std::optional<torch::Generator>;
+
+    // Random stream of the chain running on the current thread.
+    // Parallel drivers install one generator per chain, otherwise the LibTorch default generator is used.
+    inline thread_local GeneratorOpt chain_generator = std::nullopt;
+
+    struct ChainGeneratorGuard {
+        GeneratorOpt previous;
+
+        explicit ChainGeneratorGuard(const torch::Generator &generator) : previous{chain_generator} {
+            chain_generator = generator;
+        }
+
+        ChainGeneratorGuard(const ChainGeneratorGuard &) = delete;
+        ChainGeneratorGuard &operator=(const ChainGeneratorGuard &) = delete;
+
+        ~ChainGeneratorGuard() {
+            chain_generator = previous;
+        }
+    };
+
+    inline utils::Tensor chain_randn(at::IntArrayRef sizes, const torch::TensorOptions &options) {
+        if (!chain_generator.has_value())
+            return torch::randn(sizes, options);
+        const auto &generator = chain_generator.value();
+        return torch::randn(sizes, generator, options.device(generator.device())).to(options.device());
+    }
+
+    inline utils::Tensor chain_rand(at::IntArrayRef sizes, const torch::TensorOptions &options) {
+        if (!chain_generator.has_value())
+            return torch::rand(sizes, options);
+        const auto &generator = chain_generator.value();
+        return torch::rand(sizes, generator, options.device(generator.device())).to(options.device());
+    }
+
+    inline utils::Tensor chain_randn_like(const utils::Tensor &tensor) {
+        return chain_randn(tensor.sizes(), tensor.options());
+    }
+
+    inline utils::Tensor chain_rand_like(const utils::Tensor &tensor) {
+        return chain_rand(tensor.sizes(), tensor.options());
+    }
+
+    // Counters and cumulative phase timings of a chain, shared by all copies of a configuration
+    // (see Configuration::set_statistics). Updates are atomic: chains running in parallel may share
+    // one object, while one object per chain gives per chain figures.
+    // Log probability time includes its gradient, metric time the log probability under it,
+    // and integrator time covers whole trajectories.
+    struct SamplerStatistics {
+        using Counter = std::atomic<uint64_t>;
+
+        Counter log_prob_evaluations{0};
+        Counter gradient_evaluations{0};
+        Counter hessian_evaluations{0};
+        Counter metric_evaluations{0};
+
+        Counter trajectories{0};
+        Counter completed{0};
+        Counter rejected{0};
+        Counter early_stopped{0};
+
+        Counter log_prob_failures{0};
+        Counter gradient_failures{0};
+        Counter hessian_failures{0};
+        Counter rotation_failures{0};
+        Counter softabs_failures{0};
+        Counter metric_failures{0};
+        Counter hamiltonian_failures{0};
+
+        Counter log_prob_nanoseconds{0};
+        Counter metric_nanoseconds{0};
+        Counter integrator_nanoseconds{0};
+
+        static inline double seconds(const Counter &nanoseconds) {
+            return static_cast<double>(nanoseconds.load()) / 1E+9;
+        }
+
+        inline void report(std::ostream &stream) const {
+            stream << "GHMC: " << trajectories << " trajectories: "
+                   << completed << " completed, " << rejected << " rejected, " << early_stopped << " early stopped\n"
+                   << "GHMC: evaluations: " << log_prob_evaluations << " log probability, "
+                   << gradient_evaluations << " gradient, " << hessian_evaluations << " hessian, "
+                   << metric_evaluations << " metric\n"
+                   << "GHMC: failures: " << log_prob_failures << " log probability, "
+                   << gradient_failures << " gradient, " << hessian_failures << " hessian, "
+                   << rotation_failures << " rotation, " << softabs_failures << " SoftAbs, "
+                   << metric_failures << " metric, " << hamiltonian_failures << " Hamiltonian\n"
+                   << "GHMC: time: " << seconds(log_prob_nanoseconds) << "s log probability, "
+                   << seconds(metric_nanoseconds) << "s metric, "
+                   << seconds(integrator_nanoseconds) << "s integrator\n";
+        }
+    };
+    using SamplerStatisticsPtr = std::shared_ptr<SamplerStatistics>;
+    using StatisticsCounter = SamplerStatistics::Counter SamplerStatistics::*;
+
+    inline SamplerStatisticsPtr sampler_statistics() {
+        return std::make_shared<SamplerStatistics>();
+    }
+
+    inline void count(const SamplerStatisticsPtr &statistics, const StatisticsCounter counter) {
+        if (statistics)
+            (statistics.get()->*counter).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds its lifetime to a phase of the statistics and, for trajectories, counts their outcome.
+    struct PhaseTimer {
+        SamplerStatisticsPtr statistics;
+        StatisticsCounter phase;
+        std::optional<StatisticsCounter> outcome = std::nullopt;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        PhaseTimer(const SamplerStatisticsPtr &statistics_, const StatisticsCounter phase_)
+                : statistics{statistics_}, phase{phase_} {}
+
+        PhaseTimer(const PhaseTimer &) = delete;
+        PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+        ~PhaseTimer() {
+            if (!statistics)
+                return;
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            (statistics.get()->*phase).fetch_add(static_cast<uint64_t>(elapsed), std::memory_order_relaxed);
+            if (outcome.has_value()) {
+                count(statistics, &SamplerStatistics::trajectories);
+                count(statistics, outcome.value());
+            }
+        }
+    };
+
     template<typename Dtype>
     struct Configuration {
         uint32_t max_flow_steps = 3;
@@ -67,7 +199,17 @@ namespace noa::ghmc {
         Dtype cutoff = 1e-6f;
         Dtype jitter = 1e-6f;
         Dtype softabs_const = 1e6f;
+        uint32_t hessian_chunk_size = 0;
+        Dtype fisher_damping = 1.f;
+        uint32_t metric_rank = 0;
+        uint32_t lanczos_iterations = 0;
+        Dtype metric_floor = 1.f;
+        uint32_t max_tree_depth = 10;
+        Dtype max_energy_error = 1000.f;
+        bool mixed_precision = false;
+        bool host_sync = true;
         bool verbose = false;
+        SamplerStatisticsPtr statistics = nullptr;
 
         inline Configuration &set_max_flow_steps(const Dtype &max_flow_steps_) {
             max_flow_steps = max_flow_steps_;
@@ -99,59 +241,297 @@ namespace noa::ghmc {
             return *this;
         }
 
+        inline Configuration &set_hessian_chunk_size(const uint32_t hessian_chunk_size_) {
+            hessian_chunk_size = hessian_chunk_size_;
+            return *this;
+        }
+
+        inline Configuration &set_fisher_damping(const Dtype &fisher_damping_) {
+            fisher_damping = fisher_damping_;
+            return *this;
+        }
+
+        inline Configuration &set_metric_rank(const uint32_t metric_rank_) {
+            metric_rank = metric_rank_;
+            return *this;
+        }
+
+        inline Configuration &set_lanczos_iterations(const uint32_t lanczos_iterations_) {
+            lanczos_iterations = lanczos_iterations_;
+            return *this;
+        }
+
+        inline Configuration &set_metric_floor(const Dtype &metric_floor_) {
+            metric_floor = metric_floor_;
+            return *this;
+        }
+
+        inline Configuration &set_max_tree_depth(const uint32_t max_tree_depth_) {
+            max_tree_depth = max_tree_depth_;
+            return *this;
+        }
+
+        inline Configuration &set_max_energy_error(const Dtype &max_energy_error_) {
+            max_energy_error = max_energy_error_;
+            return *this;
+        }
+
+        inline Configuration &set_mixed_precision(bool mixed_precision_) {
+            mixed_precision = mixed_precision_;
+            return *this;
+        }
+
+        inline Configuration &set_host_sync(bool host_sync_) {
+            host_sync = host_sync_;
+            return *this;
+        }
+
         inline Configuration &set_verbosity(bool verbose_) {
             verbose = verbose_;
             return *this;
         }
+
+        inline Configuration &set_statistics(const SamplerStatisticsPtr &statistics_) {
+            statistics = statistics_;
+            return *this;
+        }
     };
 
+    // With conf.mixed_precision the terms of the Hamiltonian are reduced and accumulated in float64,
+    // while gradients and metrics stay in the dtype of the parameters. Operands of the reductions
+    // (e.g. the momentum and its product with the inverse metric) pass through it before being summed.
     template<typename Configurations>
-    inline auto softabs_metric(const Configurations &conf) {
-        return [conf](const LogProbabilityGraph &log_prob_graph) {
-            const auto hess_ = utils::numerics::hessian(log_prob_graph);
-            if (!hess_.has_value()) {
-                if (conf.verbose)
-                    std::cerr << "GHMC: failed to compute hessian for log probability\n"
-                              << std::get<LogProbability>(log_prob_graph) << "\n";
-                return MetricDecompositionOpt{};
-            }
+    inline Energy energy_term(const utils::Tensor &term, const Configurations &conf) {
+        return conf.mixed_precision ? term.to(torch::kFloat64) : term;
+    }
 
-            const auto nparam = hess_.value().size();
-            auto spectrum = Spectrum{};
-            spectrum.reserve(nparam);
-            auto rotation = Rotation{};
-            rotation.reserve(nparam);
+    // SoftAbs map of the negative Hessian blocks of the log probability.
+    template<typename Configurations>
+    inline MetricDecompositionOpt softabs_decomposition(const utils::TensorsOpt &hess_,
+                                                        const LogProbabilityGraph &log_prob_graph,
+                                                        const Configurations &conf) {
+        count(conf.statistics, &SamplerStatistics::hessian_evaluations);
+        if (!hess_.has_value()) {
+            count(conf.statistics, &SamplerStatistics::hessian_failures);
+            if (conf.verbose)
+                std::cerr << "GHMC: failed to compute hessian for log probability\n"
+                          << std::get<LogProbability>(log_prob_graph) << "\n";
+            return MetricDecompositionOpt{};
+        }
 
-            for (const auto &hess : hess_.value()) {
-                const auto n = hess.size(0);
-                const auto[eigs, Q] = torch::linalg::eigh(
-                        -hess + conf.jitter * torch::eye(n, hess.options()) * torch::rand(n, hess.options()), "L");
+        const auto nparam = hess_.value().size();
+        auto spectrum = Spectrum{};
+        spectrum.reserve(nparam);
+        auto rotation = Rotation{};
+        rotation.reserve(nparam);
 
-                const utils::Tensor check_Q = Q.detach().sum();
-                if (torch::isnan(check_Q).item<bool>() || torch::isinf(check_Q).item<bool>()) {
-                    std::cerr << "GHMC: failed to compute local rotation matrix for log probability\n"
-                              << std::get<LogProbability>(log_prob_graph) << "\n";
-                    return MetricDecompositionOpt{};
-                }
+        for (const auto &hess_i : hess_.value()) {
+            const auto n = hess_i.size(0);
 
-                const auto reg_eigs = torch::where(eigs.abs() >= conf.cutoff, eigs,
-                                                   torch::tensor(conf.cutoff, hess.options()));
-                const auto softabs = torch::abs((1 / torch::tanh(conf.softabs_const * reg_eigs)) * reg_eigs);
+            // without host synchronisation a broken hessian yields a NaN spectrum instead of a failure
+            const auto finite = conf.host_sync ? utils::Tensor{} : torch::isfinite(hess_i.detach()).all();
+            const auto hess = conf.host_sync ? hess_i : torch::where(finite, hess_i, torch::eye(n, hess_i.options()));
 
-                const utils::Tensor check_softabs = softabs.detach().sum();
-                if (torch::isnan(check_softabs).item<bool>() || torch::isinf(check_softabs).item<bool>()) {
-                    std::cerr << "GHMC: failed to compute SoftAbs map for log probability\n"
-                              << std::get<LogProbability>(log_prob_graph) << "\n";
-                    return MetricDecompositionOpt{};
-                }
+            const auto[eigs, Q] = torch::linalg::eigh(
+                    -hess + conf.jitter * torch::eye(n, hess.options()) * chain_rand({n}, hess.options()), "L");
 
-                spectrum.push_back(softabs);
-                rotation.push_back(Q);
+            const utils::Tensor check_Q = Q.detach().sum();
+            if (conf.host_sync && (torch::isnan(check_Q).item<bool>() || torch::isinf(check_Q).item<bool>())) {
+                count(conf.statistics, &SamplerStatistics::rotation_failures);
+                std::cerr << "GHMC: failed to compute local rotation matrix for log probability\n"
+                          << std::get<LogProbability>(log_prob_graph) << "\n";
+                return MetricDecompositionOpt{};
             }
-            return MetricDecompositionOpt{MetricDecomposition{spectrum, rotation}};
+
+            const auto reg_eigs = torch::where(eigs.abs() >= conf.cutoff, eigs,
+                                               torch::tensor(conf.cutoff, hess.options()));
+            const auto softabs = torch::abs((1 / torch::tanh(conf.softabs_const * reg_eigs)) * reg_eigs);
+
+            const utils::Tensor check_softabs = softabs.detach().sum();
+            if (conf.host_sync &&
+                (torch::isnan(check_softabs).item<bool>() || torch::isinf(check_softabs).item<bool>())) {
+                count(conf.statistics, &SamplerStatistics::softabs_failures);
+                std::cerr << "GHMC: failed to compute SoftAbs map for log probability\n"
+                          << std::get<LogProbability>(log_prob_graph) << "\n";
+                return MetricDecompositionOpt{};
+            }
+
+            spectrum.push_back(conf.host_sync ? softabs : torch::where(finite, softabs, torch::full_like(softabs, NAN)));
+            rotation.push_back(Q);
+        }
+        return MetricDecompositionOpt{MetricDecomposition{spectrum, rotation}};
+    }
+
+    template<typename Configurations>
+    inline auto softabs_metric(const Configurations &conf) {
+        return [conf](const LogProbabilityGraph &log_prob_graph) {
+            return softabs_decomposition(
+                    utils::numerics::hessian(log_prob_graph, conf.hessian_chunk_size, conf.host_sync),
+                    log_prob_graph, conf);
+        };
+    }
+
+    // SoftAbs metric from a Hessian with known sparsity, one colouring per parameter block
+    // (see numerics::hessian_colouring): one Hessian-vector product per colour instead of one per parameter.
+    template<typename Configurations>
+    inline auto softabs_metric(const Configurations &conf, const std::vector<utils::numerics::HessianColouring> &colourings) {
+        return [conf, colourings](const LogProbabilityGraph &log_prob_graph) {
+            const auto sparse_hess = utils::numerics::sparse_hessian(
+                    log_prob_graph, colourings, conf.hessian_chunk_size, conf.host_sync);
+            if (!sparse_hess.has_value())
+                return softabs_decomposition(sparse_hess, log_prob_graph, conf);
+            auto hess = utils::Tensors{};
+            hess.reserve(sparse_hess.value().size());
+            for (const auto &hess_i : sparse_hess.value())
+                hess.push_back(hess_i.to_dense());
+            return softabs_decomposition(utils::TensorsOpt{hess}, log_prob_graph, conf);
         };
     }
 
+    // Constant metrics for the Euclidean dynamics, with the kinetic energy p^T G^{-1} p / 2 per parameter block.
+    // Besides MetricDecomposition, a diagonal metric G = diag(diagonal) is supported at O(n) cost,
+    // and a dense metric G = L L^T given by its lower Cholesky factor L is applied through triangular solves.
+    struct DiagonalMetric {
+        Spectrum diagonal;
+    };
+
+    struct CholeskyMetric {
+        utils::Tensors factor;
+    };
+
+    // A block of a metric decomposition is either a full eigendecomposition with a square rotation,
+    // or low rank plus isotropic: r < n orthonormal columns with r + 1 eigenvalues,
+    // the last of which is shared by the orthogonal complement.
+    inline bool low_rank_block(const utils::Tensor &rotation_i) {
+        return rotation_i.size(1) < rotation_i.size(0);
+    }
+
+    inline utils::Tensor metric_log_determinant(const utils::Tensor &spectrum_i, const utils::Tensor &rotation_i) {
+        if (!low_rank_block(rotation_i))
+            return spectrum_i.log().sum();
+        const auto rank = rotation_i.size(1);
+        return spectrum_i.slice(0, 0, rank).log().sum() + (rotation_i.size(0) - rank) * spectrum_i[rank].log();
+    }
+
+    inline utils::Tensor inverse_metric(const utils::Tensor &spectrum_i, const utils::Tensor &rotation_i) {
+        if (!low_rank_block(rotation_i))
+            return rotation_i.mm(torch::diag(1 / spectrum_i)).mm(rotation_i.t());
+        const auto rank = rotation_i.size(1);
+        const auto floor = spectrum_i[rank];
+        return rotation_i.mm(torch::diag(1 / spectrum_i.slice(0, 0, rank) - 1 / floor)).mm(rotation_i.t()) +
+               torch::eye(rotation_i.size(0), rotation_i.options()) / floor;
+    }
+
+    // Inverse metric applied to a vector. Full blocks use the precomputed inverse metric,
+    // low rank blocks (with an undefined one) are applied without forming an n x n matrix.
+    inline utils::Tensor inverse_metric_mv(const utils::Tensor &spectrum_i,
+                                           const utils::Tensor &rotation_i,
+                                           const utils::Tensor &mass_i,
+                                           const utils::Tensor &vector) {
+        if (mass_i.defined())
+            return mass_i.mv(vector);
+        const auto rank = rotation_i.size(1);
+        const auto floor = spectrum_i[rank];
+        return vector / floor + rotation_i.mv((1 / spectrum_i.slice(0, 0, rank) - 1 / floor) * rotation_i.t().mv(vector));
+    }
+
+    // Square root of the metric applied to a standard normal vector.
+    inline utils::Tensor metric_sqrt_mv(const utils::Tensor &spectrum_i,
+                                        const utils::Tensor &rotation_i,
+                                        const utils::Tensor &noise) {
+        if (!low_rank_block(rotation_i))
+            return rotation_i.mv(torch::sqrt(spectrum_i) * noise);
+        const auto rank = rotation_i.size(1);
+        const auto projection = rotation_i.t().mv(noise);
+        return torch::sqrt(spectrum_i[rank]) * (noise - rotation_i.mv(projection)) +
+               rotation_i.mv(torch::sqrt(spectrum_i.slice(0, 0, rank)) * projection);
+    }
+
+    // Metric decomposition with the inverse metric R diag(1/s) R^T precomputed for full blocks.
+    struct DenseMetric {
+        Spectrum spectrum;
+        Rotation rotation;
+        utils::Tensors mass;
+    };
+
+    inline DenseMetric euclidean_metric(const MetricDecomposition &metric) {
+        const auto &[spectrum, rotation] = metric;
+        const auto nparam = spectrum.size();
+        auto mass = utils::Tensors{};
+        mass.reserve(nparam);
+        for (uint32_t i = 0; i < nparam; i++) {
+            mass.push_back(low_rank_block(rotation.at(i)) ? utils::Tensor{} : inverse_metric(spectrum.at(i), rotation.at(i)));
+        }
+        return DenseMetric{spectrum, rotation, mass};
+    }
+
+    inline DiagonalMetric euclidean_metric(const DiagonalMetric &metric) {
+        return metric;
+    }
+
+    inline CholeskyMetric euclidean_metric(const CholeskyMetric &metric) {
+        return metric;
+    }
+
+    inline utils::Tensor sample_momentum(const DenseMetric &metric, const uint32_t i) {
+        const auto &rotation_i = metric.rotation.at(i);
+        return metric_sqrt_mv(metric.spectrum.at(i), rotation_i,
+                              chain_randn({rotation_i.size(0)}, rotation_i.options()));
+    }
+
+    inline utils::Tensor sample_momentum(const DiagonalMetric &metric, const uint32_t i) {
+        const auto &diagonal_i = metric.diagonal.at(i);
+        return torch::sqrt(diagonal_i) * chain_randn_like(diagonal_i);
+    }
+
+    inline utils::Tensor sample_momentum(const CholeskyMetric &metric, const uint32_t i) {
+        const auto &factor_i = metric.factor.at(i);
+        return factor_i.mv(chain_randn({factor_i.size(0)}, factor_i.options()));
+    }
+
+    // Inverse metric applied to the momentum block, returned in the shape of the momentum.
+    inline utils::Tensor velocity(const DenseMetric &metric, const uint32_t i, const utils::Tensor &momentum_i) {
+        return inverse_metric_mv(metric.spectrum.at(i), metric.rotation.at(i), metric.mass.at(i), momentum_i.flatten())
+                .view_as(momentum_i);
+    }
+
+    inline utils::Tensor velocity(const DiagonalMetric &metric, const uint32_t i, const utils::Tensor &momentum_i) {
+        return (momentum_i.flatten() / metric.diagonal.at(i)).view_as(momentum_i);
+    }
+
+    inline utils::Tensor velocity(const CholeskyMetric &metric, const uint32_t i, const utils::Tensor &momentum_i) {
+        return torch::cholesky_solve(momentum_i.reshape({-1, 1}), metric.factor.at(i)).view_as(momentum_i);
+    }
+
+    inline utils::Tensor kinetic_energy(const DenseMetric &metric, const uint32_t i, const utils::Tensor &momentum_i) {
+        const auto momentum_vec = momentum_i.flatten();
+        return momentum_vec.dot(
+                inverse_metric_mv(metric.spectrum.at(i), metric.rotation.at(i), metric.mass.at(i), momentum_vec)) / 2;
+    }
+
+    inline utils::Tensor kinetic_energy(const DiagonalMetric &metric, const uint32_t i, const utils::Tensor &momentum_i) {
+        return (momentum_i.flatten().pow(2) / metric.diagonal.at(i)).sum() / 2;
+    }
+
+    inline utils::Tensor kinetic_energy(const CholeskyMetric &metric, const uint32_t i, const utils::Tensor &momentum_i) {
+        const auto whitened = torch::linalg_solve_triangular(
+                metric.factor.at(i), momentum_i.reshape({-1, 1}), /*upper=*/false);
+        return whitened.pow(2).sum() / 2;
+    }
+
+    // Kinetic energy of a momentum block, with the dot product of the momentum and the velocity
+    // reduced in float64 for conf.mixed_precision.
+    template<typename ConstantMetric, typename Configurations>
+    inline Energy kinetic_energy_term(const ConstantMetric &metric,
+                                      const uint32_t i,
+                                      const utils::Tensor &momentum_i,
+                                      const Configurations &conf) {
+        if (!conf.mixed_precision)
+            return kinetic_energy(metric, i, momentum_i);
+        return energy_term(momentum_i.flatten(), conf).dot(
+                energy_term(velocity(metric, i, momentum_i).flatten(), conf)) / 2;
+    }
+
     inline MetricDecomposition identity_metric_like(const Parameters &initial_parameters) {
         const auto nparam = initial_parameters.size();
         auto spectrum = Spectrum{};
@@ -166,12 +546,183 @@ namespace noa::ghmc {
         return MetricDecomposition{spectrum, rotation};
     }
 
+    // Identity as a diagonal metric, which avoids the dense products of the Euclidean dynamics.
+    inline DiagonalMetric identity_diagonal_metric_like(const Parameters &initial_parameters) {
+        auto diagonal = Spectrum{};
+        diagonal.reserve(initial_parameters.size());
+        for (const auto &param : initial_parameters)
+            diagonal.push_back(torch::ones(param.numel(), param.options()));
+        return DiagonalMetric{diagonal};
+    }
+
     inline const auto max_steps_flow = [](const HamiltonianFlow &) { return false; };
 
     inline const auto metropolis_criterion = [](const HamiltonianFlow &flow) {
         const auto &energy_level = std::get<EnergyLevel>(flow);
         const auto rho = -torch::relu(energy_level.back() - energy_level.front());
-        return (rho >= torch::log(torch::rand_like(rho))).item<bool>();
+        return (rho >= torch::log(chain_rand_like(rho))).item<bool>();
+    };
+
+    // Same as metropolis_criterion, but the decision stays on the device.
+    inline const auto deferred_metropolis_criterion = [](const HamiltonianFlow &flow) {
+        const auto &energy_level = std::get<EnergyLevel>(flow);
+        const auto rho = -torch::relu(energy_level.back() - energy_level.front());
+        return utils::Tensor{rho >= torch::log(chain_rand_like(rho))};
+    };
+
+    // Points of the flow kept by the dynamics, chosen at compile time (see flow_recording_t).
+    // EndpointFlow keeps only the initial and the latest point instead of O(max_flow_steps) tensors.
+    struct FullFlow {
+    };
+
+    struct EndpointFlow {
+    };
+
+    // Dynamics tagged with the recording of their flow, so that the samplers can check the trajectory sampling.
+    template<typename Recording_, typename Dynamics>
+    struct RecordedDynamics : Dynamics {
+        using Recording = Recording_;
+    };
+
+    template<typename Recording, typename Dynamics>
+    inline RecordedDynamics<Recording, Dynamics> recorded_dynamics(const Dynamics &dynamics) {
+        return RecordedDynamics<Recording, Dynamics>{dynamics};
+    }
+
+    // Recording of dynamics or of a trajectory sampling policy, FullFlow when they do not declare one.
+    template<typename T, typename = void>
+    struct recording {
+        using type = FullFlow;
+    };
+
+    template<typename T>
+    struct recording<T, std::void_t<typename T::Recording>> {
+        using type = typename T::Recording;
+    };
+
+    template<typename T>
+    using recording_t = typename recording<T>::type;
+
+    template<typename Recording>
+    inline uint32_t flow_capacity(const uint32_t max_flow_steps) {
+        return std::is_same_v<Recording, EndpointFlow> ? std::min(max_flow_steps, 1u) : max_flow_steps;
+    }
+
+    // Validity of a trajectory. With conf.host_sync the checks are done by every evaluation and this is a no-op.
+    // Otherwise non-finite values and rejections by the stop flow criterion are folded into device flags,
+    // which are read back once to truncate the flow when the trajectory is complete.
+    struct FlowChecks {
+        bool deferred;
+        bool verbose;
+        utils::Tensor finite;
+        utils::Tensor alive;
+        utils::Tensor num_points;
+        utils::Tensor healthy;
+        int64_t num_recorded = 0;
+
+        template<typename Configurations>
+        FlowChecks(const Configurations &conf, const utils::Tensor &like)
+                : deferred{!conf.host_sync}, verbose{conf.verbose} {
+            if (deferred) {
+                finite = torch::ones({}, like.options().dtype(torch::kBool));
+                alive = torch::ones({}, like.options().dtype(torch::kBool));
+                num_points = torch::zeros({}, like.options().dtype(torch::kLong));
+                healthy = torch::ones({}, like.options().dtype(torch::kBool));
+            }
+        }
+
+        inline void check(const utils::Tensor &tensor) {
+            if (deferred)
+                finite = finite & torch::isfinite(tensor.detach()).all();
+        }
+
+        inline void check(const utils::Tensors &tensors) {
+            for (const auto &tensor : tensors)
+                check(tensor);
+        }
+
+        inline void check(const HamiltonianGradient &gradient) {
+            check(std::get<0>(gradient));
+            check(std::get<1>(gradient));
+        }
+
+        // Closes the checks for the point just pushed to the flow.
+        inline void keep_point() {
+            num_recorded++;
+            if (deferred) {
+                healthy = healthy & (finite | ~alive);
+                alive = alive & finite;
+                num_points = num_points + alive.to(torch::kLong);
+                finite = torch::ones_like(finite);
+            }
+        }
+
+        // Pushes a point to the flow and closes its checks. With EndpointFlow every point after the initial one
+        // overwrites the last, which stays at the latest valid point when the checks are deferred.
+        template<typename Recording>
+        inline void record(HamiltonianFlow &flow, Parameters params, Momentum momentum, Energy energy) {
+            keep_point();
+            auto &[params_flow, momentum_flow, energy_level] = flow;
+            if constexpr (std::is_same_v<Recording, EndpointFlow>) {
+                if (params_flow.size() > 1) {
+                    if (deferred) {
+                        for (uint32_t i = 0; i < params.size(); i++) {
+                            params.at(i) = torch::where(alive, params.at(i), params_flow.back().at(i));
+                            momentum.at(i) = torch::where(alive, momentum.at(i), momentum_flow.back().at(i));
+                        }
+                        energy = torch::where(alive, energy, energy_level.back());
+                    }
+                    params_flow.back() = std::move(params);
+                    momentum_flow.back() = std::move(momentum);
+                    energy_level.back() = std::move(energy);
+                    return;
+                }
+            }
+            params_flow.push_back(std::move(params));
+            momentum_flow.push_back(std::move(momentum));
+            energy_level.push_back(std::move(energy));
+        }
+
+        // The criterion may return a bool or a bool tensor. Without host synchronisation the flow always proceeds.
+        template<typename StopFlowCriterion>
+        inline bool proceed(const StopFlowCriterion &stop_flow_criterion, const HamiltonianFlow &flow) {
+            using Decision = std::decay_t<std::invoke_result_t<const StopFlowCriterion &, const HamiltonianFlow &>>;
+            if constexpr (std::is_same_v<Decision, bool>) {
+                if (!deferred)
+                    return stop_flow_criterion(flow);
+                alive = alive & stop_flow_criterion(flow);
+            } else {
+                const utils::Tensor decision = stop_flow_criterion(flow);
+                if (!deferred)
+                    return decision.item<bool>();
+                alive = alive & decision;
+            }
+            return true;
+        }
+
+        // Deferred checks also set the outcome of the trajectory in the statistics: early stopped on a failure,
+        // rejected when the stop flow criterion cut the flow short, completed otherwise.
+        inline HamiltonianFlow truncate(HamiltonianFlow flow, PhaseTimer &timer) const {
+            if (!deferred)
+                return flow;
+            auto &[params_flow, momentum_flow, energy_level] = flow;
+            const auto flags = torch::stack({num_points, healthy.to(torch::kLong)}).to(torch::kCPU);
+            const auto num_valid = flags[0].item<int64_t>();
+            if (flags[1].item<int64_t>() == 0)
+                timer.outcome = &SamplerStatistics::early_stopped;
+            else if (num_valid < num_recorded)
+                timer.outcome = &SamplerStatistics::rejected;
+            const auto num_points_ = static_cast<size_t>(num_valid);
+            if (num_points_ < params_flow.size()) {
+                if (verbose)
+                    std::cout << "GHMC: truncating flow to "
+                              << num_points_ << "/" << params_flow.size() << " points\n";
+                params_flow.resize(num_points_);
+                momentum_flow.resize(num_points_);
+                energy_level.resize(num_points_);
+            }
+            return flow;
+        }
     };
 
     template<typename LogProbabilityDensity, typename Configurations>
@@ -179,9 +730,13 @@ namespace noa::ghmc {
             const LogProbabilityDensity &log_prob_density,
             const Configurations &conf) {
         return [log_prob_density, conf](const Parameters &parameters) {
+            const auto timer = PhaseTimer{conf.statistics, &SamplerStatistics::log_prob_nanoseconds};
+            count(conf.statistics, &SamplerStatistics::log_prob_evaluations);
             const auto log_prob_graph = log_prob_density(parameters);
             const LogProbability check_log_prob = std::get<LogProbability>(log_prob_graph).detach();
-            if (torch::isnan(check_log_prob).item<bool>() || torch::isinf(check_log_prob).item<bool>()) {
+            if (conf.host_sync &&
+                (torch::isnan(check_log_prob).item<bool>() || torch::isinf(check_log_prob).item<bool>())) {
+                count(conf.statistics, &SamplerStatistics::log_prob_failures);
                 if (conf.verbose)
                     std::cerr << "GHMC: failed to compute log probability.\n";
                 return LogProbabilityGraphOpt{};
@@ -198,13 +753,18 @@ namespace noa::ghmc {
                     std::cerr << "GHMC: no log probability graph provided.\n";
                 return ParametersGradientOpt{};
             }
+            const auto timer = PhaseTimer{conf.statistics, &SamplerStatistics::log_prob_nanoseconds};
+            count(conf.statistics, &SamplerStatistics::gradient_evaluations);
             const auto &[log_prob, params] = log_prob_graph.value();
             const auto params_grad = torch::autograd::grad({log_prob}, params);
+            if (!conf.host_sync)
+                return ParametersGradientOpt{params_grad};
 
             for (const auto &param_grad_ : params_grad) {
                 const auto param_grad = param_grad_.detach();
                 const auto check_params = param_grad.sum();
                 if (torch::isnan(check_params).item<bool>() || torch::isinf(check_params).item<bool>()) {
+                    count(conf.statistics, &SamplerStatistics::gradient_failures);
                     if (conf.verbose)
                         std::cerr << "GHMC: failed to compute parameters gradient for log probability\n"
                                   << log_prob << "\n";
@@ -216,68 +776,119 @@ namespace noa::ghmc {
         };
     }
 
+    // Position dependent part of the Riemannian Hamiltonian: the log probability graph, its local metric,
+    // the potential -log p + log det G / 2 and the inverse metric per parameter block (undefined for low rank blocks).
+    // It is shared by the evaluations of the Hamiltonian at the same position with different momenta.
+    struct RiemannianGeometry {
+        LogProbabilityGraph log_prob_graph;
+        MetricDecomposition metric;
+        Energy potential;
+        utils::Tensors mass;
+    };
+    using RiemannianGeometryOpt = std::optional<RiemannianGeometry>;
+
     template<typename LogProbabilityDensity, typename LocalMetric, typename Configurations>
-    inline auto riemannian_hamiltonian(
+    inline auto riemannian_geometry(
             const LogProbabilityDensity &log_prob_density,
             const LocalMetric &local_metric,
             const Configurations &conf) {
         const auto log_prob_func = log_probability(log_prob_density, conf);
-        return [log_prob_func, local_metric, conf](
-                const Parameters &parameters,
-                const MomentumOpt &momentum_ = std::nullopt) {
+        return [log_prob_func, local_metric, conf](const Parameters &parameters) {
+            const auto timer = PhaseTimer{conf.statistics, &SamplerStatistics::metric_nanoseconds};
 
             const auto log_prob_graph_ = log_prob_func(parameters);
             if (!log_prob_graph_.has_value())
-                return PhaseSpaceFoliationOpt{};
+                return RiemannianGeometryOpt{};
             const auto &log_prob_graph = log_prob_graph_.value();
 
             const auto metric = local_metric(log_prob_graph);
+            count(conf.statistics, &SamplerStatistics::metric_evaluations);
             if (!metric.has_value()) {
+                count(conf.statistics, &SamplerStatistics::metric_failures);
                 if (conf.verbose)
                     std::cerr << "GHMC: failed to compute local metric for log probability\n"
                               << std::get<LogProbability>(log_prob_graph) << "\n";
-                return PhaseSpaceFoliationOpt{};
+                return RiemannianGeometryOpt{};
             }
             const auto&[spectrum, rotation] = metric.value();
 
-            auto energy = -std::get<LogProbability>(log_prob_graph);
+            auto potential = energy_term(-std::get<LogProbability>(log_prob_graph), conf);
 
             const auto nparam = parameters.size();
-            auto momentum = Momentum{};
-            momentum.reserve(nparam);
+            auto mass = utils::Tensors{};
+            mass.reserve(nparam);
 
             for (uint32_t i = 0; i < nparam; i++) {
-
                 const auto &spectrum_i = spectrum.at(i);
                 const auto &rotation_i = rotation.at(i);
+                potential += metric_log_determinant(energy_term(spectrum_i, conf), rotation_i) / 2;
+                mass.push_back(low_rank_block(rotation_i) ? utils::Tensor{} : inverse_metric(spectrum_i, rotation_i));
+            }
 
-                const auto momentum_lift = momentum_.has_value()
-                                           ? momentum_.value().at(i)
-                                           : rotation_i.detach().mv(
-                                torch::sqrt(spectrum_i.detach()) * torch::randn_like(spectrum_i));
+            return RiemannianGeometryOpt{RiemannianGeometry{log_prob_graph, metric.value(), potential, mass}};
+        };
+    }
 
-                const auto momentum_i = momentum_lift.detach().view_as(parameters.at(i)).requires_grad_(true);
+    // Hamiltonian at the position of the geometry. The momentum is drawn from the local metric if not provided.
+    template<typename Configurations>
+    inline PhaseSpaceFoliationOpt riemannian_foliation(
+            const RiemannianGeometry &geometry,
+            const MomentumOpt &momentum_,
+            const Configurations &conf) {
+        const auto &[log_prob_graph, metric, potential, mass] = geometry;
+        const auto &[spectrum, rotation] = metric;
+        const auto &parameters = std::get<Parameters>(log_prob_graph);
 
-                const auto first_order_term = spectrum_i.log().sum() / 2;
-                const auto mass = rotation_i.mm(torch::diag(1 / spectrum_i)).mm(rotation_i.t());
+        auto energy = potential;
 
-                const auto momentum_vec = momentum_i.flatten();
-                const auto second_order_term = momentum_vec.dot(mass.mv(momentum_vec)) / 2;
+        const auto nparam = parameters.size();
+        auto momentum = Momentum{};
+        momentum.reserve(nparam);
 
-                energy += first_order_term + second_order_term;
-                momentum.push_back(momentum_i);
-            }
+        for (uint32_t i = 0; i < nparam; i++) {
 
-            const Energy check_energy = energy.detach();
-            if (torch::isnan(check_energy).item<bool>() || torch::isinf(check_energy).item<bool>()) {
-                if (conf.verbose)
-                    std::cerr << "GHMC: failed to compute Hamiltonian for log probability\n"
-                              << std::get<LogProbability>(log_prob_graph) << "\n";
-                return PhaseSpaceFoliationOpt{};
-            }
+            const auto &spectrum_i = spectrum.at(i);
+            const auto &rotation_i = rotation.at(i);
+
+            const auto momentum_lift = momentum_.has_value()
+                                       ? momentum_.value().at(i)
+                                       : metric_sqrt_mv(spectrum_i.detach(), rotation_i.detach(),
+                                                        chain_randn({rotation_i.size(0)}, spectrum_i.options()));
+
+            const auto momentum_i = momentum_lift.detach().view_as(parameters.at(i)).requires_grad_(true);
+
+            const auto momentum_vec = momentum_i.flatten();
+            energy = energy + energy_term(momentum_vec, conf).dot(
+                    energy_term(inverse_metric_mv(spectrum_i, rotation_i, mass.at(i), momentum_vec), conf)) / 2;
+            momentum.push_back(momentum_i);
+        }
+
+        const Energy check_energy = energy.detach();
+        if (conf.host_sync &&
+            (torch::isnan(check_energy).item<bool>() || torch::isinf(check_energy).item<bool>())) {
+            count(conf.statistics, &SamplerStatistics::hamiltonian_failures);
+            if (conf.verbose)
+                std::cerr << "GHMC: failed to compute Hamiltonian for log probability\n"
+                          << std::get<LogProbability>(log_prob_graph) << "\n";
+            return PhaseSpaceFoliationOpt{};
+        }
 
-            return PhaseSpaceFoliationOpt{
-                    PhaseSpaceFoliation{std::get<Parameters>(log_prob_graph), momentum, energy}};
+        return PhaseSpaceFoliationOpt{PhaseSpaceFoliation{parameters, momentum, energy}};
+    }
+
+    template<typename LogProbabilityDensity, typename LocalMetric, typename Configurations>
+    inline auto riemannian_hamiltonian(
+            const LogProbabilityDensity &log_prob_density,
+            const LocalMetric &local_metric,
+            const Configurations &conf) {
+        const auto geometry_func = riemannian_geometry(log_prob_density, local_metric, conf);
+        return [geometry_func, conf](
+                const Parameters &parameters,
+                const MomentumOpt &momentum_ = std::nullopt) {
+            const auto geometry = geometry_func(parameters);
+            if (!geometry.has_value())
+                return PhaseSpaceFoliationOpt{};
+            return riemannian_foliation(geometry.value(), momentum_, conf);
         };
     }
 
@@ -290,6 +901,7 @@ namespace noa::ghmc {
                 return HamiltonianGradientOpt{};
             }
             const auto &[params, momentum, energy] = foliation.value();
+            count(conf.statistics, &SamplerStatistics::gradient_evaluations);
 
             const auto nparam = params.size();
             auto variables = utils::Tensors{};
@@ -299,6 +911,10 @@ namespace noa::ghmc {
             variables.insert(variables.end(), momentum.begin(), momentum.end());
 
             const auto ham_grad = torch::autograd::grad({energy}, variables);
+            if (!conf.host_sync)
+                return HamiltonianGradientOpt{HamiltonianGradient{
+                        ParametersGradient(ham_grad.begin(), ham_grad.begin() + nparam),
+                        MomentumGradient(ham_grad.begin() + nparam, ham_grad.end())}};
 
             auto params_grad = ParametersGradient{};
             params_grad.reserve(nparam);
@@ -307,6 +923,7 @@ namespace noa::ghmc {
                 const auto params_grad_i = ham_grad.at(i).detach();
                 const auto check_params = params_grad_i.sum();
                 if (torch::isnan(check_params).item<bool>() || torch::isinf(check_params).item<bool>()) {
+                    count(conf.statistics, &SamplerStatistics::gradient_failures);
                     if (conf.verbose)
                         std::cerr << "GHMC: failed to compute parameters gradient for Hamiltonian\n"
                                   << energy << "\n";
@@ -321,6 +938,7 @@ namespace noa::ghmc {
                 const auto momentum_grad_i = ham_grad.at(i).detach();
                 const auto check_momentum = momentum_grad_i.sum();
                 if (torch::isnan(check_momentum).item<bool>() || torch::isinf(check_momentum).item<bool>()) {
+                    count(conf.statistics, &SamplerStatistics::gradient_failures);
                     if (conf.verbose)
                         std::cerr << "GHMC: failed to compute momentum gradient for Hamiltonian\n"
                                   << energy << "\n";
@@ -345,37 +963,75 @@ namespace noa::ghmc {
         return HamiltonianFlow{params_flow, momentum_flow, energy_level};
     }
 
-    template<typename LogProbabilityDensity, typename StopFlowCriterion, typename Configurations>
+    // Point of the Euclidean flow with the log probability and its gradient there.
+    struct LeapfrogState {
+        Parameters params;
+        Momentum momentum;
+        LogProbability log_prob;
+        ParametersGradient gradient;
+    };
+    using LeapfrogStateOpt = std::optional<LeapfrogState>;
+
+    // One kick-drift-kick step for a constant metric (see euclidean_metric), backwards in time for a negative step size.
+    template<typename LogProbabilityFunction, typename LogProbabilityGradient, typename Metric>
+    inline auto euclidean_leapfrog(
+            const LogProbabilityFunction &log_prob_func,
+            const LogProbabilityGradient &log_prob_grad,
+            const Metric &metric) {
+        return [log_prob_func, log_prob_grad, metric](const LeapfrogState &state, const double step_size) {
+            const auto nparam = state.params.size();
+            const auto delta = step_size / 2;
+
+            auto params = Parameters{};
+            params.reserve(nparam);
+            auto momentum = Momentum{};
+            momentum.reserve(nparam);
+
+            for (uint32_t i = 0; i < nparam; i++) {
+                momentum.push_back(state.momentum.at(i) + state.gradient.at(i) * delta);
+                params.push_back(state.params.at(i) + velocity(metric, i, momentum.at(i)) * step_size);
+            }
+
+            const auto log_prob_graph = log_prob_func(params);
+            const auto gradient = log_prob_grad(log_prob_graph);
+            if (!gradient.has_value())
+                return LeapfrogStateOpt{};
+
+            for (uint32_t i = 0; i < nparam; i++)
+                momentum.at(i) = momentum.at(i) + gradient.value().at(i) * delta;
+
+            return LeapfrogStateOpt{LeapfrogState{
+                    params, momentum, std::get<LogProbability>(log_prob_graph.value()).detach(), gradient.value()}};
+        };
+    }
+
+    // The constant metric is a MetricDecomposition, DiagonalMetric or CholeskyMetric.
+    // The recording (FullFlow or EndpointFlow) selects the points of the flow kept.
+    template<typename Recording = FullFlow,
+            typename LogProbabilityDensity, typename ConstantMetric, typename StopFlowCriterion, typename Configurations>
     inline auto euclidean_dynamics(
             const LogProbabilityDensity &log_prob_density,
-            const MetricDecomposition &constant_metric,
+            const ConstantMetric &constant_metric,
             const StopFlowCriterion &stop_flow_criterion,
             const Configurations &conf) {
 
-        const auto &[spectrum, rotation] = constant_metric;
-        const auto nparam = spectrum.size();
-        auto mass = utils::Tensors{};
-        mass.reserve(nparam);
-        for (uint32_t i = 0; i < nparam; i++) {
-            const auto &rotation_i = rotation.at(i);
-            const auto &spectrum_i = spectrum.at(i);
-            mass.push_back(rotation_i.mm(torch::diag(1 / spectrum_i)).mm(rotation_i.t()));
-        }
-
+        const auto metric = euclidean_metric(constant_metric);
         const auto log_prob_func = log_probability(log_prob_density, conf);
         const auto log_prob_grad = log_probability_gradient(conf);
+        const auto leapfrog = euclidean_leapfrog(log_prob_func, log_prob_grad, metric);
 
-        return [log_prob_func, log_prob_grad, stop_flow_criterion, constant_metric, mass, conf](
+        return recorded_dynamics<Recording>([log_prob_func, log_prob_grad, leapfrog, stop_flow_criterion, metric, conf](
                 const Parameters &parameters,
                 const MomentumOpt &momentum_ = std::nullopt) {
+            auto timer = PhaseTimer{conf.statistics, &SamplerStatistics::integrator_nanoseconds};
+            timer.outcome = &SamplerStatistics::completed;
 
-            auto flow = create_flow(conf.max_flow_steps);
-            auto &[params_flow, momentum_flow, energy_level] = flow;
-
-            const auto &[spectrum, rotation] = constant_metric;
+            auto flow = create_flow(flow_capacity<Recording>(conf.max_flow_steps));
+            auto checks = FlowChecks{conf, parameters.at(0)};
 
             auto log_prob_graph = log_prob_func(parameters);
             if (!log_prob_graph.has_value()) {
+                timer.outcome = &SamplerStatistics::early_stopped;
                 if (conf.verbose)
                     std::cerr << "GHMC: failed to initialise Hamiltonian flow.\n";
                 return flow;
@@ -387,84 +1043,65 @@ namespace noa::ghmc {
             params.reserve(nparam);
             auto momentum = Momentum{};
             momentum.reserve(nparam);
-            auto energy = -log_prob.detach();
+            auto energy = energy_term(-log_prob.detach(), conf);
 
             for (uint32_t i = 0; i < nparam; i++) {
 
                 params.push_back(initial_params.at(i).detach());
 
-                const auto &spectrum_i = spectrum.at(i);
-                const auto &rotation_i = rotation.at(i);
-
                 const auto momentum_lift = momentum_.has_value()
                                            ? momentum_.value().at(i)
-                                           : rotation_i.mv(
-                                torch::sqrt(spectrum_i) * torch::randn_like(spectrum_i));
+                                           : sample_momentum(metric, i);
 
                 const auto momentum_i = momentum_lift.detach().view_as(parameters.at(i));
-
-                const auto momentum_vec = momentum_i.flatten();
-                energy += momentum_vec.dot(mass.at(i).mv(momentum_vec)) / 2;
+                energy += kinetic_energy_term(metric, i, momentum_i, conf);
 
                 momentum.push_back(momentum_i);
             }
 
-            params_flow.push_back(params);
-            momentum_flow.push_back(momentum);
-            energy_level.push_back(energy);
+            checks.check(energy);
+            checks.record<Recording>(flow, params, momentum, energy);
 
             uint32_t iter_step = 0;
             if (iter_step >= conf.max_flow_steps)
-                return flow;
+                return checks.truncate(std::move(flow), timer);
 
-            const auto error_msg = [&iter_step, &conf]() {
+            const auto error_msg = [&iter_step, &timer, &conf]() {
+                timer.outcome = &SamplerStatistics::early_stopped;
                 if (conf.verbose)
                     std::cerr << "GHMC: failed to evolve flow at step "
                               << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
             };
 
-            const auto delta = conf.step_size / 2;
-
-            auto dynamics = log_prob_grad(log_prob_graph);
+            const auto dynamics = log_prob_grad(log_prob_graph);
             if (!dynamics.has_value()) {
                 error_msg();
                 return flow;
             }
+            checks.check(dynamics.value());
 
-            for (uint32_t i = 0; i < nparam; i++)
-                momentum.at(i) = momentum.at(i) + dynamics.value().at(i) * delta;
+            auto state = LeapfrogState{params, momentum, log_prob.detach(), dynamics.value()};
 
             for (iter_step = 0; iter_step < conf.max_flow_steps; iter_step++) {
 
-                for (uint32_t i = 0; i < nparam; i++)
-                    params.at(i) = params.at(i) +
-                                   mass.at(i).mv(momentum.at(i).flatten()).view_as(params.at(i)) * conf.step_size;
-
-                log_prob_graph = log_prob_func(params);
-                dynamics = log_prob_grad(log_prob_graph);
-                if (!dynamics.has_value()) {
+                const auto next_state = leapfrog(state, conf.step_size);
+                if (!next_state.has_value()) {
                     error_msg();
                     return flow;
                 }
+                state = next_state.value();
+                checks.check(state.gradient);
 
+                energy = energy_term(-state.log_prob, conf);
                 for (uint32_t i = 0; i < nparam; i++)
-                    momentum.at(i) = momentum.at(i) + dynamics.value().at(i) * delta;
-
-                energy = -std::get<LogProbability>(log_prob_graph.value()).detach();
-                for (uint32_t i = 0; i < nparam; i++) {
-                    const auto momentum_vec = momentum.at(i).flatten();
-                    energy += momentum_vec.dot(mass.at(i).mv(momentum_vec)) / 2;
-                }
+                    energy += kinetic_energy_term(metric, i, state.momentum.at(i), conf);
 
-                params_flow.push_back(params);
-                momentum_flow.push_back(momentum);
-                energy_level.push_back(energy);
+                checks.check(energy);
+                checks.record<Recording>(flow, state.params, state.momentum, energy);
 
                 if (iter_step < conf.max_flow_steps - 1) {
-                    if (stop_flow_criterion(flow))
-                        for (uint32_t i = 0; i < nparam; i++)
-                            momentum.at(i) = momentum.at(i) + dynamics.value().at(i) * delta;
-                    else {
+                    if (!checks.proceed(stop_flow_criterion, flow)) {
+                        timer.outcome = &SamplerStatistics::rejected;
                         if (conf.verbose)
                             std::cout << "GHMC: rejecting sample at iteration "
                                       << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
@@ -473,28 +1110,39 @@ namespace noa::ghmc {
                 }
             }
 
-            return flow;
-        };
+            return checks.truncate(std::move(flow), timer);
+        });
     }
 
-    template<typename LogProbabilityDensity, typename LocalMetric, typename StopFlowCriterion, typename Configurations>
+    template<typename Recording = FullFlow,
+            typename LogProbabilityDensity, typename LocalMetric, typename StopFlowCriterion, typename Configurations>
     inline auto riemannian_dynamics(
             const LogProbabilityDensity &log_prob_density,
             const LocalMetric &local_metric,
             const StopFlowCriterion &stop_flow_criterion,
             const Configurations &conf) {
-        const auto ham = riemannian_hamiltonian(log_prob_density, local_metric, conf);
+        const auto geometry_func = riemannian_geometry(log_prob_density, local_metric, conf);
+        const auto ham = [geometry_func, conf](const Parameters &parameters, const MomentumOpt &momentum_) {
+            const auto geometry = geometry_func(parameters);
+            if (!geometry.has_value())
+                return PhaseSpaceFoliationOpt{};
+            return riemannian_foliation(geometry.value(), momentum_, conf);
+        };
         const auto ham_grad = hamiltonian_gradient(conf);
         const auto theta = 2 * conf.binding_const * conf.step_size;
         const auto rot = std::make_tuple(cos(theta), sin(theta));
-        return [ham, ham_grad, stop_flow_criterion, conf, rot](const Parameters &parameters,
-                                                               const MomentumOpt &momentum_ = std::nullopt) {
+        return recorded_dynamics<Recording>([geometry_func, ham, ham_grad, stop_flow_criterion, conf, rot](
+                const Parameters &parameters,
+                const MomentumOpt &momentum_ = std::nullopt) {
+            auto timer = PhaseTimer{conf.statistics, &SamplerStatistics::integrator_nanoseconds};
+            timer.outcome = &SamplerStatistics::completed;
 
-            auto flow = create_flow(conf.max_flow_steps);
-            auto &[params_flow, momentum_flow, energy_level] = flow;
+            auto flow = create_flow(flow_capacity<Recording>(conf.max_flow_steps));
+            auto checks = FlowChecks{conf, parameters.at(0)};
 
             auto foliation = ham(parameters, momentum_);
             if (!foliation.has_value()) {
+                timer.outcome = &SamplerStatistics::early_stopped;
                 if (conf.verbose)
                     std::cerr << "GHMC: failed to initialise Hamiltonian flow.\n";
                 return flow;
@@ -513,15 +1161,15 @@ namespace noa::ghmc {
                 momentum_copy.push_back(initial_momentum.at(i).detach());
             }
 
-            params_flow.push_back(params);
-            momentum_flow.push_back(momentum_copy);
-            energy_level.push_back(initial_energy.detach());
+            checks.check(initial_energy);
+            checks.record<Recording>(flow, params, momentum_copy, initial_energy.detach());
 
             uint32_t iter_step = 0;
             if (iter_step >= conf.max_flow_steps)
-                return flow;
+                return checks.truncate(std::move(flow), timer);
 
-            const auto error_msg = [&iter_step, &conf]() {
+            const auto error_msg = [&iter_step, &timer, &conf]() {
+                timer.outcome = &SamplerStatistics::early_stopped;
                 if (conf.verbose)
                     std::cerr << "GHMC: failed to evolve flow at step "
                               << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
@@ -532,6 +1180,7 @@ namespace noa::ghmc {
                 error_msg();
                 return flow;
             }
+            checks.check(dynamics.value());
 
             const auto delta = conf.step_size / 2;
             const auto &[c, s] = rot;
@@ -552,6 +1201,7 @@ namespace noa::ghmc {
                     error_msg();
                     break;
                 }
+                checks.check(dynamics.value());
 
                 for (uint32_t i = 0; i < nparam; i++) {
 
@@ -579,41 +1229,50 @@ namespace noa::ghmc {
                     error_msg();
                     break;
                 }
+                checks.check(dynamics.value());
 
                 for (uint32_t i = 0; i < nparam; i++) {
                     params.at(i) = params.at(i) + std::get<1>(dynamics.value()).at(i) * delta;
                     momentum_copy.at(i) = momentum_copy.at(i) - std::get<0>(dynamics.value()).at(i) * delta;
                 }
 
-                foliation = ham(params, momentum_copy);
+                // both remaining evaluations of the step are at params: the geometry is computed once
+                const auto geometry = geometry_func(params);
+                if (!geometry.has_value()) {
+                    error_msg();
+                    break;
+                }
+
+                foliation = riemannian_foliation(geometry.value(), momentum_copy, conf);
                 dynamics = ham_grad(foliation);
                 if (!dynamics.has_value()) {
                     error_msg();
                     break;
                 }
+                checks.check(dynamics.value());
 
                 for (uint32_t i = 0; i < nparam; i++) {
                     params_copy.at(i) = params_copy.at(i) + std::get<1>(dynamics.value()).at(i) * delta;
                     momentum.at(i) = momentum.at(i) - std::get<0>(dynamics.value()).at(i) * delta;
                 }
 
-                foliation = ham(params, momentum);
+                foliation = riemannian_foliation(geometry.value(), momentum, conf);
                 if (!foliation.has_value()) {
                     error_msg();
                     break;
                 }
 
-                params_flow.push_back(params);
-                momentum_flow.push_back(momentum);
-                energy_level.push_back(std::get<Energy>(foliation.value()).detach());
+                checks.check(std::get<Energy>(foliation.value()));
+                checks.record<Recording>(flow, params, momentum, std::get<Energy>(foliation.value()).detach());
 
                 if (iter_step < conf.max_flow_steps - 1) {
-                    if (stop_flow_criterion(flow))
+                    if (checks.proceed(stop_flow_criterion, flow))
                         for (uint32_t i = 0; i < nparam; i++) {
                             params_copy.at(i) = params_copy.at(i) + std::get<1>(dynamics.value()).at(i) * delta;
                             momentum.at(i) = momentum.at(i) - std::get<0>(dynamics.value()).at(i) * delta;
                         }
                     else {
+                        timer.outcome = &SamplerStatistics::rejected;
                         if (conf.verbose)
                             std::cout << "GHMC: rejecting sample at iteration "
                                       << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
@@ -622,27 +1281,81 @@ namespace noa::ghmc {
                 }
             }
 
-            return flow;
-        };
+            return checks.truncate(std::move(flow), timer);
+        });
     }
 
 
-    inline const auto full_trajectory = [](const HamiltonianFlow &hamiltonian_flow) {
-        return std::get<0>(hamiltonian_flow);
+    // Trajectory sampling policies carry the recording the dynamics need, e.g.
+    // euclidean_dynamics<flow_recording_t<EndOfTrajectory>>(...) for end_of_trajectory.
+    // The samplers reject dynamics recording EndpointFlow with a policy expecting the full flow.
+    struct FullTrajectory {
+        using Recording = FullFlow;
+
+        inline ParametersFlow operator()(const HamiltonianFlow &hamiltonian_flow) const {
+            return std::get<0>(hamiltonian_flow);
+        }
     };
 
-    inline const auto end_of_trajectory = [](const HamiltonianFlow &hamiltonian_flow) {
-        const auto flow = std::get<0>(hamiltonian_flow);
-        return (flow.size() > 1) ? ParametersFlow{flow.front(), flow.back()} : flow;
+    struct EndOfTrajectory {
+        using Recording = EndpointFlow;
+
+        inline ParametersFlow operator()(const HamiltonianFlow &hamiltonian_flow) const {
+            const auto &flow = std::get<0>(hamiltonian_flow);
+            return (flow.size() > 1) ? ParametersFlow{flow.front(), flow.back()} : flow;
+        }
     };
 
+    template<typename TrajectorySampling>
+    using flow_recording_t = typename TrajectorySampling::Recording;
+
+    inline const auto full_trajectory = FullTrajectory{};
+    inline const auto end_of_trajectory = EndOfTrajectory{};
+
+    // Pushes the initial parameters and every sample drawn over num_iterations trajectories into the sink:
+    // a callable on Parameters returning false to stop the chain early (see noa/ghmc/sinks.hh).
+    // Returns the last state of the chain, so that it can be resumed.
+    template<typename HamiltonianDynamics, typename TrajectorySampling>
+    inline auto sink_sampler(
+            const HamiltonianDynamics &hamiltonian_dynamics,
+            const TrajectorySampling &trajectory_sampling) {
+        static_assert(!std::is_same_v<recording_t<HamiltonianDynamics>, EndpointFlow> ||
+                      std::is_same_v<recording_t<TrajectorySampling>, EndpointFlow>,
+                      "dynamics recording EndpointFlow keep only the end of the trajectory, "
+                      "sample them with end_of_trajectory");
+        return [hamiltonian_dynamics,
+                trajectory_sampling](const Parameters &initial_parameters,
+                                     const uint32_t num_iterations,
+                                     auto &&sink) {
+            const auto nparam = initial_parameters.size();
+            auto params = Parameters{};
+            params.reserve(nparam);
+            for (const auto &param : initial_parameters)
+                params.push_back(param.detach());
+
+            if (!sink(params))
+                return params;
+
+            for (uint32_t iter = 0; iter < num_iterations; iter++) {
+                const auto flow = hamiltonian_dynamics(params);
+                const auto &params_flow = trajectory_sampling(flow);
+                for (uint32_t i = 1; i < params_flow.size(); i++)
+                    if (!sink(params_flow.at(i)))
+                        return params_flow.at(i);
+                if (params_flow.size() > 1)
+                    params = params_flow.back();
+            }
+
+            return params;
+        };
+    }
+
     template<typename HamiltonianDynamics, typename TrajectorySampling, typename Configurations>
     inline auto sampler(
             const HamiltonianDynamics &hamiltonian_dynamics,
             const TrajectorySampling &trajectory_sampling,
             const Configurations &conf) {
-        return [hamiltonian_dynamics,
-                trajectory_sampling,
+        return [chain_sampler = sink_sampler(hamiltonian_dynamics, trajectory_sampling),
                 conf](const Parameters &initial_parameters, const uint32_t num_iterations) {
             const auto max_num_samples = conf.max_flow_steps * num_iterations;
 
@@ -654,22 +1367,10 @@ namespace noa::ghmc {
                           << "GHMC: generating MCMC chain of maximum length "
                           << max_num_samples << " ...\n";
 
-            const auto nparam = initial_parameters.size();
-            auto params = Parameters{};
-            params.reserve(nparam);
-            for (const auto &param : initial_parameters)
-                params.push_back(param.detach());
-
-            samples.push_back(params);
-            uint32_t iter = 0;
-
-            while (iter < num_iterations) {
-                auto flow = hamiltonian_dynamics(samples.back());
-                const auto &params_flow = trajectory_sampling(flow);
-                if (params_flow.size() > 1)
-                    samples.insert(samples.end(), params_flow.begin() + 1, params_flow.end());
-                iter++;
-            }
+            chain_sampler(initial_parameters, num_iterations, [&samples](const Parameters &sample) {
+                samples.push_back(sample);
+                return true;
+            });
 
             if (conf.verbose)
                 std::cout << "GHMC: generated "
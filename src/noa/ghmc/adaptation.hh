@@ -0,0 +1,289 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file adaptation.hh
+ * Warm-up adaptation of the step size and the constant metric for Euclidean dynamics.
+ *
+ * The step size is tuned by dual averaging towards a target acceptance rate
+ * (Hoffman & Gelman, 2014), while the metric is estimated from running moments
+ * over expanding windows following the schedule of Stan: a fast initial buffer,
+ * slow windows doubling in size and a fast terminal buffer.
+ * The acceptance statistic of a trajectory is min(1, exp(-(H_end - H_start))) from its energy level.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+#include "noa/ghmc/sinks.hh"
+
+#include <cmath>
+
+namespace noa::ghmc {
+
+    struct AdaptationConfiguration {
+        double target_acceptance = 0.8;
+        double gamma = 0.05;
+        double t0 = 10.;
+        double kappa = 0.75;
+        uint32_t initial_buffer = 75;
+        uint32_t terminal_buffer = 50;
+        uint32_t base_window = 25;
+        double regularisation = 1e-3;
+
+        inline AdaptationConfiguration &set_target_acceptance(const double target_acceptance_) {
+            target_acceptance = target_acceptance_;
+            return *this;
+        }
+
+        inline AdaptationConfiguration &set_dual_averaging(const double gamma_, const double t0_, const double kappa_) {
+            gamma = gamma_;
+            t0 = t0_;
+            kappa = kappa_;
+            return *this;
+        }
+
+        inline AdaptationConfiguration &set_windows(const uint32_t initial_buffer_,
+                                                    const uint32_t terminal_buffer_,
+                                                    const uint32_t base_window_) {
+            initial_buffer = initial_buffer_;
+            terminal_buffer = terminal_buffer_;
+            base_window = base_window_;
+            return *this;
+        }
+
+        inline AdaptationConfiguration &set_regularisation(const double regularisation_) {
+            regularisation = regularisation_;
+            return *this;
+        }
+    };
+
+    struct DualAveraging {
+        double mu = 0.;
+        double log_step_size = 0.;
+        double log_step_size_avg = 0.;
+        double h_avg = 0.;
+        uint32_t count = 0;
+
+        explicit DualAveraging(const double step_size) {
+            restart(step_size);
+        }
+
+        inline void restart(const double step_size) {
+            mu = std::log(10 * step_size);
+            log_step_size = std::log(step_size);
+            log_step_size_avg = 0.;
+            h_avg = 0.;
+            count = 0;
+        }
+
+        inline double update(const double acceptance, const AdaptationConfiguration &adapt_conf) {
+            count++;
+            const auto t = static_cast<double>(count);
+            const auto eta = 1. / (t + adapt_conf.t0);
+            h_avg = (1 - eta) * h_avg + eta * (adapt_conf.target_acceptance - acceptance);
+            log_step_size = mu - std::sqrt(t) / adapt_conf.gamma * h_avg;
+            const auto weight = std::pow(t, -adapt_conf.kappa);
+            log_step_size_avg = weight * log_step_size + (1 - weight) * log_step_size_avg;
+            return std::exp(log_step_size);
+        }
+
+        inline double adapted_step_size() const {
+            return std::exp(count > 0 ? log_step_size_avg : log_step_size);
+        }
+    };
+
+    // Fast initial and terminal buffers around the slow windows, with the first slow window.
+    // When they do not fit into the warm-up they shrink to 15%, 10% and the remainder of it.
+    struct AdaptationBuffers {
+        uint32_t initial_buffer;
+        uint32_t terminal_buffer;
+        uint32_t window;
+    };
+
+    inline AdaptationBuffers adaptation_buffers(const uint32_t num_warmup,
+                                                const AdaptationConfiguration &adapt_conf) {
+        auto buffers = AdaptationBuffers{adapt_conf.initial_buffer, adapt_conf.terminal_buffer, adapt_conf.base_window};
+        if (buffers.initial_buffer + buffers.terminal_buffer + buffers.window > num_warmup) {
+            buffers.initial_buffer = static_cast<uint32_t>(0.15 * num_warmup);
+            buffers.terminal_buffer = static_cast<uint32_t>(0.1 * num_warmup);
+            buffers.window = num_warmup - buffers.initial_buffer - buffers.terminal_buffer;
+        }
+        return buffers;
+    }
+
+    // Iterations after which the metric is re-estimated.
+    inline std::vector<uint32_t> adaptation_windows(const uint32_t num_warmup,
+                                                    const AdaptationConfiguration &adapt_conf) {
+        auto windows = std::vector<uint32_t>{};
+        if (num_warmup < 20)
+            return windows;
+
+        const auto buffers = adaptation_buffers(num_warmup, adapt_conf);
+        auto window = buffers.window;
+
+        const auto slow_end = num_warmup - buffers.terminal_buffer;
+        auto start = buffers.initial_buffer;
+        while (start < slow_end) {
+            auto end = start + window;
+            if (end + 2 * window > slow_end)
+                end = slow_end;
+            windows.push_back(end);
+            start = end;
+            window *= 2;
+        }
+        return windows;
+    }
+
+    // Moments collected over a slow window: the element-wise variance for a diagonal metric,
+    // the full covariance only for a dense one.
+    inline RunningVarianceSink metric_moments(const DiagonalMetric &) {
+        return RunningVarianceSink{};
+    }
+
+    inline RunningMomentsSink metric_moments(const CholeskyMetric &) {
+        return RunningMomentsSink{};
+    }
+
+    // Regularised inverse of the sample covariance per parameter block, in the precision of the parameters.
+    inline DiagonalMetric estimate_metric(const std::vector<RunningVarianceSink> &moments,
+                                          const Parameters &parameters,
+                                          const AdaptationConfiguration &adapt_conf,
+                                          const DiagonalMetric &) {
+        auto diagonal = Spectrum{};
+        diagonal.reserve(moments.size());
+        for (uint32_t i = 0; i < moments.size(); i++) {
+            const auto &moments_i = moments.at(i);
+            const auto n = static_cast<double>(moments_i.count);
+            const auto variance = moments_i.variance();
+            const auto regularised = (n / (n + 5)) * variance + adapt_conf.regularisation * (5 / (n + 5));
+            diagonal.push_back((1 / regularised).to(parameters.at(i).dtype()));
+        }
+        return DiagonalMetric{diagonal};
+    }
+
+    inline CholeskyMetric estimate_metric(const std::vector<RunningMomentsSink> &moments,
+                                          const Parameters &parameters,
+                                          const AdaptationConfiguration &adapt_conf,
+                                          const CholeskyMetric &) {
+        auto factor = utils::Tensors{};
+        factor.reserve(moments.size());
+        for (uint32_t i = 0; i < moments.size(); i++) {
+            const auto &moments_i = moments.at(i);
+            const auto n = static_cast<double>(moments_i.count);
+            const auto covariance = moments_i.covariance();
+            const auto identity = torch::eye(covariance.size(0), covariance.options());
+            const auto regularised = (n / (n + 5)) * covariance + adapt_conf.regularisation * (5 / (n + 5)) * identity;
+            const auto precision = torch::cholesky_inverse(torch::linalg_cholesky(regularised));
+            factor.push_back(torch::linalg_cholesky(precision).to(parameters.at(i).dtype()));
+        }
+        return CholeskyMetric{factor};
+    }
+
+    inline DiagonalMetric initial_metric(const Parameters &parameters, const DiagonalMetric &) {
+        return identity_diagonal_metric_like(parameters);
+    }
+
+    inline CholeskyMetric initial_metric(const Parameters &parameters, const CholeskyMetric &) {
+        auto factor = utils::Tensors{};
+        factor.reserve(parameters.size());
+        for (const auto &param : parameters)
+            factor.push_back(torch::eye(param.numel(), param.options()));
+        return CholeskyMetric{factor};
+    }
+
+    template<typename Metric, typename Configurations>
+    struct AdaptedState {
+        Parameters parameters;
+        Configurations conf;
+        Metric metric;
+    };
+
+    // Runs num_warmup trajectories from the initial parameters, rebuilding the dynamics with
+    // make_dynamics(conf, metric) as the step size and the metric are adapted.
+    // Metric is DiagonalMetric or CholeskyMetric (dense). Returns the last state of the chain
+    // together with the configuration carrying the adapted step size and the adapted metric,
+    // to be frozen for sampling.
+    template<typename Metric = DiagonalMetric, typename DynamicsFactory, typename Configurations>
+    inline AdaptedState<Metric, Configurations> warmup(
+            const DynamicsFactory &make_dynamics,
+            const Parameters &initial_parameters,
+            const uint32_t num_warmup,
+            const Configurations &conf,
+            const AdaptationConfiguration &adapt_conf = AdaptationConfiguration{}) {
+
+        auto params = Parameters{};
+        params.reserve(initial_parameters.size());
+        for (const auto &param : initial_parameters)
+            params.push_back(param.detach());
+
+        auto adapted_conf = conf;
+        auto metric = initial_metric(params, Metric{});
+        auto step_size = static_cast<double>(conf.step_size);
+        auto dual_averaging = DualAveraging{step_size};
+
+        const auto windows = adaptation_windows(num_warmup, adapt_conf);
+        auto next_window = windows.begin();
+        const auto slow_start = windows.empty() ? num_warmup : adaptation_buffers(num_warmup, adapt_conf).initial_buffer;
+        using Moments = decltype(metric_moments(Metric{}));
+        auto moments = std::vector<Moments>(params.size());
+
+        if (conf.verbose)
+            std::cout << "GHMC: warm-up over " << num_warmup << " iterations with "
+                      << windows.size() << " metric windows\n";
+
+        for (uint32_t iter = 0; iter < num_warmup; iter++) {
+            adapted_conf.step_size = step_size;
+            const HamiltonianFlow flow = make_dynamics(adapted_conf, metric)(params);
+            const auto &[params_flow, momentum_flow, energy_level] = flow;
+
+            auto acceptance = 0.;
+            if (params_flow.size() > 1) {
+                const auto energy_error = (energy_level.back() - energy_level.front()).item<double>();
+                acceptance = std::isfinite(energy_error) ? std::min(1., std::exp(-energy_error)) : 0.;
+                params = params_flow.back();
+            }
+            step_size = dual_averaging.update(acceptance, adapt_conf);
+
+            if (next_window == windows.end() || iter < slow_start)
+                continue;
+
+            for (uint32_t i = 0; i < params.size(); i++)
+                moments.at(i)(Parameters{params.at(i)});
+
+            if (iter + 1 == *next_window) {
+                metric = estimate_metric(moments, params, adapt_conf, Metric{});
+                moments = std::vector<Moments>(params.size());
+                step_size = dual_averaging.adapted_step_size();
+                dual_averaging.restart(step_size);
+                next_window++;
+                if (conf.verbose)
+                    std::cout << "GHMC: metric adapted at iteration " << iter + 1
+                              << ", step size " << step_size << "\n";
+            }
+        }
+
+        adapted_conf.step_size = dual_averaging.adapted_step_size();
+        if (conf.verbose)
+            std::cout << "GHMC: adapted step size " << adapted_conf.step_size << "\n";
+
+        return AdaptedState<Metric, Configurations>{params, adapted_conf, metric};
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,229 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file advi.hh
+ * Variational warm start: automatic differentiation variational inference (Kucukelbir et al., 2017)
+ * to initialise the position and the constant metric of Euclidean dynamics.
+ *
+ * Every parameter block is approximated by an independent Gaussian N(mu, L L^T), with L diagonal
+ * (mean-field) or lower triangular (full-rank). The evidence lower bound
+ *     E_q[log p(theta)] + log det L + const
+ * is maximised by Adam on reparametrised draws theta = mu + L eps, eps ~ N(0, I).
+ * The log probability density detaches its parameters, so the gradient of the expectation is taken
+ * through the surrogate <grad log p(theta), theta> with the gradient held constant,
+ * which has the same derivative with respect to mu and L.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+#include <cmath>
+
+namespace noa::ghmc {
+
+    struct VariationalConfiguration {
+        uint32_t num_iterations = 1000;
+        uint32_t num_draws = 1;
+        double learning_rate = 1e-2;
+        double initial_scale = 1.;
+        bool full_rank = false;
+
+        inline VariationalConfiguration &set_num_iterations(const uint32_t num_iterations_) {
+            num_iterations = num_iterations_;
+            return *this;
+        }
+
+        inline VariationalConfiguration &set_num_draws(const uint32_t num_draws_) {
+            num_draws = num_draws_;
+            return *this;
+        }
+
+        inline VariationalConfiguration &set_learning_rate(const double learning_rate_) {
+            learning_rate = learning_rate_;
+            return *this;
+        }
+
+        inline VariationalConfiguration &set_initial_scale(const double initial_scale_) {
+            initial_scale = initial_scale_;
+            return *this;
+        }
+
+        inline VariationalConfiguration &set_full_rank(const bool full_rank_) {
+            full_rank = full_rank_;
+            return *this;
+        }
+    };
+
+    // Fitted mean and lower triangular factor of the covariance per parameter block,
+    // with the evidence lower bound (up to a constant) averaged over the last iteration's draws.
+    struct VariationalApproximation {
+        Parameters mean;
+        utils::Tensors scale_factor;
+        double elbo;
+    };
+
+    // Lower triangular factor from the unconstrained variational parameters: the diagonal is exp(log_scale).
+    inline utils::Tensor variational_scale_factor(const utils::Tensor &log_scale, const utils::Tensor &off_diagonal) {
+        const auto diagonal = torch::diag_embed(torch::exp(log_scale));
+        return off_diagonal.defined() ? diagonal + torch::tril(off_diagonal, -1) : diagonal;
+    }
+
+    template<typename LogProbabilityDensity, typename Configurations>
+    inline VariationalApproximation variational_warm_start(
+            const LogProbabilityDensity &log_prob_density,
+            const Parameters &initial_parameters,
+            const Configurations &conf,
+            const VariationalConfiguration &variational_conf = VariationalConfiguration{}) {
+        const auto log_prob_func = log_probability(log_prob_density, conf);
+        const auto log_prob_grad = log_probability_gradient(conf);
+
+        const auto nparam = initial_parameters.size();
+        auto mean = utils::Tensors{};
+        mean.reserve(nparam);
+        auto log_scale = utils::Tensors{};
+        log_scale.reserve(nparam);
+        auto off_diagonal = utils::Tensors{};
+        off_diagonal.reserve(nparam);
+        auto variables = utils::Tensors{};
+        variables.reserve(3 * nparam);
+
+        for (const auto &param : initial_parameters) {
+            const auto flat = param.detach().flatten();
+            mean.push_back(flat.clone().requires_grad_(true));
+            log_scale.push_back(torch::full_like(flat, std::log(variational_conf.initial_scale)).requires_grad_(true));
+            variables.push_back(mean.back());
+            variables.push_back(log_scale.back());
+            if (variational_conf.full_rank) {
+                const auto n = flat.numel();
+                off_diagonal.push_back(torch::zeros({n, n}, flat.options()).requires_grad_(true));
+                variables.push_back(off_diagonal.back());
+            } else off_diagonal.push_back(utils::Tensor{});
+        }
+
+        auto optimizer = torch::optim::Adam(variables, torch::optim::AdamOptions(variational_conf.learning_rate));
+
+        if (conf.verbose)
+            std::cout << "GHMC: " << (variational_conf.full_rank ? "full-rank" : "mean-field")
+                      << " variational warm start over " << variational_conf.num_iterations << " iterations\n";
+
+        auto elbo = 0.;
+        for (uint32_t iter = 0; iter < variational_conf.num_iterations; iter++) {
+            optimizer.zero_grad();
+
+            auto surrogate = utils::Tensor{};
+            auto log_prob_sum = 0.;
+            uint32_t num_draws = 0;
+
+            for (uint32_t draw = 0; draw < variational_conf.num_draws; draw++) {
+                auto theta = utils::Tensors{};
+                theta.reserve(nparam);
+                for (uint32_t i = 0; i < nparam; i++) {
+                    const auto scale_factor = variational_scale_factor(log_scale.at(i), off_diagonal.at(i));
+                    const auto noise = chain_randn_like(mean.at(i)).detach();
+                    theta.push_back((mean.at(i) + scale_factor.mv(noise)).view_as(initial_parameters.at(i)));
+                }
+
+                auto draw_params = Parameters{};
+                draw_params.reserve(nparam);
+                for (const auto &theta_i : theta)
+                    draw_params.push_back(theta_i.detach());
+
+                const LogProbabilityGraphOpt log_prob_graph = log_prob_func(draw_params);
+                const auto gradient = log_prob_grad(log_prob_graph);
+                if (!gradient.has_value())
+                    continue;
+
+                for (uint32_t i = 0; i < nparam; i++) {
+                    const auto term = (gradient.value().at(i).detach() * theta.at(i)).sum();
+                    surrogate = surrogate.defined() ? surrogate + term : term;
+                }
+                log_prob_sum += std::get<LogProbability>(log_prob_graph.value()).item<double>();
+                num_draws++;
+            }
+
+            if (num_draws == 0) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: no valid draw at variational iteration " << iter + 1 << "\n";
+                continue;
+            }
+
+            auto entropy = utils::Tensor{};
+            for (const auto &log_scale_i : log_scale)
+                entropy = entropy.defined() ? entropy + log_scale_i.sum() : log_scale_i.sum();
+
+            const auto loss = -(surrogate / static_cast<double>(num_draws) + entropy);
+            loss.backward();
+            optimizer.step();
+
+            elbo = log_prob_sum / num_draws + entropy.detach().item<double>();
+        }
+
+        if (conf.verbose)
+            std::cout << "GHMC: variational evidence lower bound " << elbo << "\n";
+
+        auto fitted_mean = Parameters{};
+        fitted_mean.reserve(nparam);
+        auto scale_factor = utils::Tensors{};
+        scale_factor.reserve(nparam);
+        for (uint32_t i = 0; i < nparam; i++) {
+            fitted_mean.push_back(mean.at(i).detach().view_as(initial_parameters.at(i)));
+            scale_factor.push_back(variational_scale_factor(
+                    log_scale.at(i).detach(),
+                    off_diagonal.at(i).defined() ? off_diagonal.at(i).detach() : utils::Tensor{}));
+        }
+        return VariationalApproximation{fitted_mean, scale_factor, elbo};
+    }
+
+    // Constant metric for euclidean_dynamics: the precision of the approximation, with eigenvalues
+    // of the covariance floored at min_variance.
+    inline MetricDecomposition variational_metric(const VariationalApproximation &approximation,
+                                                  const double min_variance = 1e-8) {
+        auto spectrum = Spectrum{};
+        spectrum.reserve(approximation.scale_factor.size());
+        auto rotation = Rotation{};
+        rotation.reserve(approximation.scale_factor.size());
+        for (const auto &scale_factor : approximation.scale_factor) {
+            const auto covariance = scale_factor.mm(scale_factor.t());
+            const auto[eigs, Q] = torch::linalg::eigh(covariance, "L");
+            spectrum.push_back(1 / eigs.clamp_min(min_variance));
+            rotation.push_back(Q);
+        }
+        return MetricDecomposition{spectrum, rotation};
+    }
+
+    // Starting points drawn from the approximation, e.g. for independent chains (see ghmc::parallel_sampler).
+    inline Samples variational_draws(const VariationalApproximation &approximation, const uint32_t num_draws) {
+        auto draws = Samples{};
+        draws.reserve(num_draws);
+        for (uint32_t draw = 0; draw < num_draws; draw++) {
+            auto params = Parameters{};
+            params.reserve(approximation.mean.size());
+            for (uint32_t i = 0; i < approximation.mean.size(); i++) {
+                const auto &mean_i = approximation.mean.at(i);
+                const auto noise = chain_randn({mean_i.numel()}, mean_i.options());
+                params.push_back((mean_i.flatten() + approximation.scale_factor.at(i).mv(noise)).view_as(mean_i));
+            }
+            draws.push_back(params);
+        }
+        return draws;
+    }
+
+} // namespace noa::ghmc
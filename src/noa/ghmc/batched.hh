@@ -0,0 +1,604 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file batched.hh
+ * Multi-chain GHMC: N independent chains advanced as one tensor program.
+ *
+ * Every parameter tensor carries the chains along its leading dimension,
+ * the log probability density returns one value per chain,
+ * and energies, momenta and local metrics are batched the same way.
+ * Chains must be independent: the log probability of a chain
+ * can only depend on the parameters of that chain.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+namespace noa::ghmc {
+
+    using ChainMask = utils::Tensor;
+
+    inline utils::Tensor chain_where(const ChainMask &mask,
+                                     const utils::Tensor &update,
+                                     const utils::Tensor &current) {
+        auto shape = std::vector<int64_t>(current.dim(), 1);
+        shape.at(0) = mask.size(0);
+        return torch::where(mask.view(shape), update, current);
+    }
+
+    inline ChainMask chain_isfinite(const utils::Tensor &tensor) {
+        return torch::isfinite(tensor.detach()).reshape({tensor.size(0), -1}).all(1);
+    }
+
+    inline const auto batched_metropolis_criterion = [](const HamiltonianFlow &flow) {
+        const auto &energy_level = std::get<EnergyLevel>(flow);
+        const auto rho = -torch::relu(energy_level.back() - energy_level.front());
+        return ChainMask{rho >= torch::log(chain_rand_like(rho))};
+    };
+
+    template<typename Configurations>
+    inline auto batched_softabs_metric(const Configurations &conf) {
+        return [conf](const LogProbabilityGraph &log_prob_graph) {
+            const auto hess_ = utils::numerics::batched_hessian(log_prob_graph, conf.hessian_chunk_size);
+            if (!hess_.has_value()) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: failed to compute batched hessian for log probability\n";
+                return MetricDecompositionOpt{};
+            }
+
+            const auto nparam = hess_.value().size();
+            auto spectrum = Spectrum{};
+            spectrum.reserve(nparam);
+            auto rotation = Rotation{};
+            rotation.reserve(nparam);
+
+            for (const auto &hess_i : hess_.value()) {
+                const auto nchains = hess_i.size(0);
+                const auto n = hess_i.size(1);
+                const auto identity = torch::eye(n, hess_i.options()).expand({nchains, n, n});
+
+                // chains with a broken hessian get a NaN spectrum and are masked out by the dynamics
+                const auto finite = chain_isfinite(hess_i);
+                const auto hess = chain_where(finite, hess_i, identity);
+
+                const auto[eigs, Q] = torch::linalg::eigh(
+                        -hess + conf.jitter * identity * chain_rand({nchains, 1, n}, hess.options()), "L");
+
+                const auto reg_eigs = torch::where(eigs.abs() >= conf.cutoff, eigs,
+                                                   torch::tensor(conf.cutoff, hess.options()));
+                const auto softabs = torch::abs((1 / torch::tanh(conf.softabs_const * reg_eigs)) * reg_eigs);
+
+                const auto valid = finite & chain_isfinite(Q) & chain_isfinite(softabs);
+                spectrum.push_back(chain_where(valid, softabs, torch::full_like(softabs, NAN)));
+                rotation.push_back(Q);
+            }
+            return MetricDecompositionOpt{MetricDecomposition{spectrum, rotation}};
+        };
+    }
+
+    template<typename LogProbabilityDensity, typename LocalMetric, typename Configurations>
+    inline auto batched_riemannian_hamiltonian(
+            const LogProbabilityDensity &log_prob_density,
+            const LocalMetric &local_metric,
+            const Configurations &conf) {
+        return [log_prob_density, local_metric, conf](
+                const Parameters &parameters,
+                const MomentumOpt &momentum_ = std::nullopt) {
+
+            const LogProbabilityGraph log_prob_graph = log_prob_density(parameters);
+            const auto &log_prob = std::get<LogProbability>(log_prob_graph);
+            if (log_prob.dim() != 1) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: expecting one log probability value per chain\n";
+                return PhaseSpaceFoliationOpt{};
+            }
+
+            const auto metric = local_metric(log_prob_graph);
+            if (!metric.has_value()) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: failed to compute batched local metric for log probability\n";
+                return PhaseSpaceFoliationOpt{};
+            }
+            const auto&[spectrum, rotation] = metric.value();
+
+            auto energy = energy_term(-log_prob, conf);
+
+            const auto nchains = log_prob.size(0);
+            const auto nparam = parameters.size();
+            auto momentum = Momentum{};
+            momentum.reserve(nparam);
+
+            for (uint32_t i = 0; i < nparam; i++) {
+
+                const auto &spectrum_i = spectrum.at(i);
+                const auto &rotation_i = rotation.at(i);
+
+                const auto momentum_lift = momentum_.has_value()
+                                           ? momentum_.value().at(i)
+                                           : rotation_i.detach().matmul(
+                                (torch::sqrt(spectrum_i.detach()) * chain_randn_like(spectrum_i)).unsqueeze(2));
+
+                const auto momentum_i = momentum_lift.detach().view_as(parameters.at(i)).requires_grad_(true);
+
+                const auto first_order_term = energy_term(spectrum_i, conf).log().sum(1) / 2;
+                const auto mass = rotation_i.matmul((1 / spectrum_i).unsqueeze(2) * rotation_i.transpose(1, 2));
+
+                const auto momentum_vec = momentum_i.reshape({nchains, -1});
+                const auto second_order_term =
+                        (energy_term(momentum_vec, conf) *
+                         energy_term(mass.matmul(momentum_vec.unsqueeze(2)).squeeze(2), conf)).sum(1) / 2;
+
+                energy = energy + first_order_term + second_order_term;
+                momentum.push_back(momentum_i);
+            }
+
+            return PhaseSpaceFoliationOpt{
+                    PhaseSpaceFoliation{std::get<Parameters>(log_prob_graph), momentum, energy}};
+        };
+    }
+
+    // Per chain gradients: chains are independent, so differentiating the total energy is enough.
+    // Non-finite values are left in place and detected by the dynamics through chain masks.
+    template<typename Configurations>
+    inline auto batched_hamiltonian_gradient(const Configurations &conf) {
+        return [conf](const PhaseSpaceFoliationOpt &foliation) {
+            if (!foliation.has_value()) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: no phase space foliation provided.\n";
+                return HamiltonianGradientOpt{};
+            }
+            const auto &[params, momentum, energy] = foliation.value();
+
+            const auto nparam = params.size();
+            auto variables = utils::Tensors{};
+            variables.reserve(2 * nparam);
+
+            variables.insert(variables.end(), params.begin(), params.end());
+            variables.insert(variables.end(), momentum.begin(), momentum.end());
+
+            const auto ham_grad = torch::autograd::grad({energy.sum()}, variables);
+
+            auto params_grad = ParametersGradient{};
+            params_grad.reserve(nparam);
+            auto momentum_grad = MomentumGradient{};
+            momentum_grad.reserve(nparam);
+
+            for (uint32_t i = 0; i < nparam; i++) {
+                params_grad.push_back(ham_grad.at(i).detach());
+                momentum_grad.push_back(ham_grad.at(nparam + i).detach());
+            }
+
+            return HamiltonianGradientOpt{HamiltonianGradient{params_grad, momentum_grad}};
+        };
+    }
+
+    inline ChainMask chain_isfinite(const utils::Tensors &tensors, const ChainMask &mask) {
+        auto res = mask;
+        for (const auto &tensor : tensors)
+            res = res & chain_isfinite(tensor);
+        return res;
+    }
+
+    // Flow of batched dynamics with the number of points of every chain's trajectory.
+    // A chain stopped by the criterion or by a failure is frozen: the later entries of the flow
+    // repeat its last state and are not part of its trajectory (see batched_sampler).
+    struct BatchedHamiltonianFlow : HamiltonianFlow {
+        utils::Tensor lengths;
+    };
+
+    template<typename LogProbabilityDensity, typename StopFlowCriterion, typename Configurations>
+    inline auto batched_euclidean_dynamics(
+            const LogProbabilityDensity &log_prob_density,
+            const MetricDecomposition &constant_metric,
+            const StopFlowCriterion &stop_flow_criterion,
+            const Configurations &conf) {
+
+        const auto &[spectrum, rotation] = constant_metric;
+        const auto nparam = spectrum.size();
+        auto mass = utils::Tensors{};
+        mass.reserve(nparam);
+        for (uint32_t i = 0; i < nparam; i++) {
+            const auto &rotation_i = rotation.at(i);
+            const auto &spectrum_i = spectrum.at(i);
+            mass.push_back(rotation_i.mm(torch::diag(1 / spectrum_i)).mm(rotation_i.t()));
+        }
+
+        return [log_prob_density, stop_flow_criterion, constant_metric, mass, conf](
+                const Parameters &parameters,
+                const MomentumOpt &momentum_ = std::nullopt) {
+
+            auto flow = create_flow(conf.max_flow_steps);
+            auto lengths = utils::Tensor{};
+            auto &[params_flow, momentum_flow, energy_level] = flow;
+
+            const auto &[spectrum, rotation] = constant_metric;
+
+            const auto log_prob_grad = [](const LogProbabilityGraph &log_prob_graph) {
+                const auto &[log_prob, params] = log_prob_graph;
+                const auto params_grad = torch::autograd::grad({log_prob.sum()}, params);
+                auto res = ParametersGradient{};
+                res.reserve(params_grad.size());
+                for (const auto &param_grad : params_grad)
+                    res.push_back(param_grad.detach());
+                return res;
+            };
+
+            const auto kinetic_energy = [&mass, &conf](const Momentum &momentum) {
+                auto res = utils::Tensor{};
+                for (uint32_t i = 0; i < momentum.size(); i++) {
+                    const auto momentum_vec = momentum.at(i).reshape({momentum.at(i).size(0), -1});
+                    const auto term = (energy_term(momentum_vec, conf) *
+                                       energy_term(momentum_vec.mm(mass.at(i)), conf)).sum(1) / 2;
+                    res = res.defined() ? res + term : term;
+                }
+                return res;
+            };
+
+            LogProbabilityGraph log_prob_graph = log_prob_density(parameters);
+            const auto &initial_log_prob = std::get<LogProbability>(log_prob_graph);
+            if (initial_log_prob.dim() != 1) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: failed to initialise batched Hamiltonian flow, "
+                              << "expecting one log probability value per chain.\n";
+                return BatchedHamiltonianFlow{{std::move(flow)}, lengths};
+            }
+
+            const auto nchains = initial_log_prob.size(0);
+            const auto nparam = parameters.size();
+            auto params = Parameters{};
+            params.reserve(nparam);
+            auto momentum = Momentum{};
+            momentum.reserve(nparam);
+
+            for (uint32_t i = 0; i < nparam; i++) {
+
+                params.push_back(std::get<Parameters>(log_prob_graph).at(i).detach());
+
+                const auto &spectrum_i = spectrum.at(i);
+                const auto &rotation_i = rotation.at(i);
+
+                const auto momentum_lift = momentum_.has_value()
+                                           ? momentum_.value().at(i)
+                                           : (torch::sqrt(spectrum_i) *
+                                              chain_randn({nchains, spectrum_i.numel()}, spectrum_i.options()))
+                                                   .mm(rotation_i.t());
+
+                momentum.push_back(momentum_lift.detach().view_as(params.at(i)));
+            }
+
+            Energy energy = energy_term(-initial_log_prob.detach(), conf) + kinetic_energy(momentum);
+            ChainMask active = torch::isfinite(energy);
+            lengths = torch::ones_like(active, torch::kInt64);
+
+            params_flow.push_back(params);
+            momentum_flow.push_back(momentum);
+            energy_level.push_back(energy);
+
+            if (conf.max_flow_steps == 0)
+                return BatchedHamiltonianFlow{{std::move(flow)}, lengths};
+
+            const auto delta = conf.step_size / 2;
+
+            auto dynamics = log_prob_grad(log_prob_graph);
+            active = chain_isfinite(dynamics, active);
+
+            for (uint32_t i = 0; i < nparam; i++)
+                momentum.at(i) = chain_where(active, momentum.at(i) + dynamics.at(i) * delta, momentum.at(i));
+
+            for (uint32_t iter_step = 0; iter_step < conf.max_flow_steps; iter_step++) {
+
+                auto params_next = Parameters{};
+                params_next.reserve(nparam);
+                for (uint32_t i = 0; i < nparam; i++) {
+                    const auto &param = params.at(i);
+                    const auto momentum_vec = momentum.at(i).reshape({nchains, -1});
+                    params_next.push_back(
+                            chain_where(active,
+                                        param + momentum_vec.mm(mass.at(i)).view_as(param) * conf.step_size,
+                                        param));
+                }
+
+                log_prob_graph = log_prob_density(params_next);
+                const LogProbability log_prob = std::get<LogProbability>(log_prob_graph).detach();
+                dynamics = log_prob_grad(log_prob_graph);
+                active = chain_isfinite(dynamics, active & torch::isfinite(log_prob));
+
+                for (uint32_t i = 0; i < nparam; i++) {
+                    params.at(i) = chain_where(active, params_next.at(i), params.at(i));
+                    momentum.at(i) = chain_where(active, momentum.at(i) + dynamics.at(i) * delta, momentum.at(i));
+                }
+
+                energy = torch::where(
+                        active, energy_term(-log_prob, conf) + kinetic_energy(momentum), energy);
+                lengths += active;
+
+                params_flow.push_back(params);
+                momentum_flow.push_back(momentum);
+                energy_level.push_back(energy);
+
+                if (iter_step < conf.max_flow_steps - 1) {
+                    active = active & stop_flow_criterion(flow);
+                    for (uint32_t i = 0; i < nparam; i++)
+                        momentum.at(i) = chain_where(active, momentum.at(i) + dynamics.at(i) * delta,
+                                                     momentum.at(i));
+                    if (!active.any().item<bool>()) {
+                        if (conf.verbose)
+                            std::cout << "GHMC: all chains stopped at iteration "
+                                      << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
+                        break;
+                    }
+                }
+            }
+
+            return BatchedHamiltonianFlow{{std::move(flow)}, lengths};
+        };
+    }
+
+    template<typename LogProbabilityDensity, typename LocalMetric, typename StopFlowCriterion, typename Configurations>
+    inline auto batched_riemannian_dynamics(
+            const LogProbabilityDensity &log_prob_density,
+            const LocalMetric &local_metric,
+            const StopFlowCriterion &stop_flow_criterion,
+            const Configurations &conf) {
+        const auto ham = batched_riemannian_hamiltonian(log_prob_density, local_metric, conf);
+        const auto ham_grad = batched_hamiltonian_gradient(conf);
+        const auto theta = 2 * conf.binding_const * conf.step_size;
+        const auto rot = std::make_tuple(cos(theta), sin(theta));
+        return [ham, ham_grad, stop_flow_criterion, conf, rot](const Parameters &parameters,
+                                                               const MomentumOpt &momentum_ = std::nullopt) {
+
+            auto flow = create_flow(conf.max_flow_steps);
+            auto lengths = utils::Tensor{};
+            auto &[params_flow, momentum_flow, energy_level] = flow;
+
+            auto foliation = ham(parameters, momentum_);
+            if (!foliation.has_value()) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: failed to initialise batched Hamiltonian flow.\n";
+                return BatchedHamiltonianFlow{{std::move(flow)}, lengths};
+            }
+
+            const auto &[initial_params, initial_momentum, initial_energy] = foliation.value();
+
+            const auto nparam = parameters.size();
+            auto params = Parameters{};
+            params.reserve(nparam);
+            auto momentum_copy = Momentum{};
+            momentum_copy.reserve(nparam);
+
+            for (uint32_t i = 0; i < nparam; i++) {
+                params.push_back(initial_params.at(i).detach());
+                momentum_copy.push_back(initial_momentum.at(i).detach());
+            }
+
+            Energy energy = initial_energy.detach();
+            ChainMask active = torch::isfinite(energy);
+            lengths = torch::ones_like(active, torch::kInt64);
+
+            params_flow.push_back(params);
+            momentum_flow.push_back(momentum_copy);
+            energy_level.push_back(energy);
+
+            if (conf.max_flow_steps == 0)
+                return BatchedHamiltonianFlow{{std::move(flow)}, lengths};
+
+            const auto error_msg = [&conf](const uint32_t iter_step) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: failed to evolve batched flow at step "
+                              << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
+            };
+
+            auto dynamics = ham_grad(foliation);
+            if (!dynamics.has_value()) {
+                error_msg(0);
+                return BatchedHamiltonianFlow{{std::move(flow)}, lengths};
+            }
+            active = chain_isfinite(std::get<1>(dynamics.value()),
+                                    chain_isfinite(std::get<0>(dynamics.value()), active));
+
+            const auto delta = conf.step_size / 2;
+            const auto &[c, s] = rot;
+
+            auto params_copy = params;
+            auto momentum = momentum_copy;
+
+            for (uint32_t i = 0; i < nparam; i++) {
+                params_copy.at(i) = params_copy.at(i) + std::get<1>(dynamics.value()).at(i) * delta;
+                momentum.at(i) = momentum.at(i) - std::get<0>(dynamics.value()).at(i) * delta;
+            }
+
+            for (uint32_t iter_step = 0; iter_step < conf.max_flow_steps; iter_step++) {
+
+                // the step is evolved for all chains, stopped ones are restored from this state
+                const auto state = std::make_tuple(params, params_copy, momentum, momentum_copy);
+                const auto restore = [&state, &active, &params, &params_copy, &momentum, &momentum_copy, nparam]() {
+                    const auto &[params_, params_copy_, momentum_, momentum_copy_] = state;
+                    for (uint32_t i = 0; i < nparam; i++) {
+                        params.at(i) = chain_where(active, params.at(i), params_.at(i));
+                        params_copy.at(i) = chain_where(active, params_copy.at(i), params_copy_.at(i));
+                        momentum.at(i) = chain_where(active, momentum.at(i), momentum_.at(i));
+                        momentum_copy.at(i) = chain_where(active, momentum_copy.at(i), momentum_copy_.at(i));
+                    }
+                };
+                const auto evolve_active = [&active](const HamiltonianGradientOpt &dynamics_) {
+                    const auto &[params_grad, momentum_grad] = dynamics_.value();
+                    active = chain_isfinite(momentum_grad, chain_isfinite(params_grad, active));
+                };
+
+                foliation = ham(params_copy, momentum);
+                dynamics = ham_grad(foliation);
+                if (!dynamics.has_value()) {
+                    error_msg(iter_step);
+                    break;
+                }
+                evolve_active(dynamics);
+
+                for (uint32_t i = 0; i < nparam; i++) {
+
+                    params.at(i) = params.at(i) + std::get<1>(dynamics.value()).at(i) * delta;
+                    momentum_copy.at(i) = momentum_copy.at(i) - std::get<0>(dynamics.value()).at(i) * delta;
+
+                    params.at(i) = (params.at(i) + params_copy.at(i) +
+                                    c * (params.at(i) - params_copy.at(i)) +
+                                    s * (momentum.at(i) - momentum_copy.at(i))) / 2;
+                    momentum.at(i) = (momentum.at(i) + momentum_copy.at(i) -
+                                      s * (params.at(i) - params_copy.at(i)) +
+                                      c * (momentum.at(i) - momentum_copy.at(i))) / 2;
+                    params_copy.at(i) = (params.at(i) + params_copy.at(i) -
+                                         c * (params.at(i) - params_copy.at(i)) -
+                                         s * (momentum.at(i) - momentum_copy.at(i))) / 2;
+                    momentum_copy.at(i) = (momentum.at(i) + momentum_copy.at(i) +
+                                           s * (params.at(i) - params_copy.at(i)) -
+                                           c * (momentum.at(i) - momentum_copy.at(i))) / 2;
+
+                }
+
+                foliation = ham(params_copy, momentum);
+                dynamics = ham_grad(foliation);
+                if (!dynamics.has_value()) {
+                    error_msg(iter_step);
+                    restore();
+                    break;
+                }
+                evolve_active(dynamics);
+
+                for (uint32_t i = 0; i < nparam; i++) {
+                    params.at(i) = params.at(i) + std::get<1>(dynamics.value()).at(i) * delta;
+                    momentum_copy.at(i) = momentum_copy.at(i) - std::get<0>(dynamics.value()).at(i) * delta;
+                }
+
+                foliation = ham(params, momentum_copy);
+                dynamics = ham_grad(foliation);
+                if (!dynamics.has_value()) {
+                    error_msg(iter_step);
+                    restore();
+                    break;
+                }
+                evolve_active(dynamics);
+
+                for (uint32_t i = 0; i < nparam; i++) {
+                    params_copy.at(i) = params_copy.at(i) + std::get<1>(dynamics.value()).at(i) * delta;
+                    momentum.at(i) = momentum.at(i) - std::get<0>(dynamics.value()).at(i) * delta;
+                }
+
+                foliation = ham(params, momentum);
+                if (!foliation.has_value()) {
+                    error_msg(iter_step);
+                    restore();
+                    break;
+                }
+                const Energy next_energy = std::get<Energy>(foliation.value()).detach();
+                active = active & torch::isfinite(next_energy);
+
+                restore();
+                energy = torch::where(active, next_energy, energy);
+                lengths += active;
+
+                params_flow.push_back(params);
+                momentum_flow.push_back(momentum);
+                energy_level.push_back(energy);
+
+                if (iter_step < conf.max_flow_steps - 1) {
+                    active = active & stop_flow_criterion(flow);
+                    for (uint32_t i = 0; i < nparam; i++) {
+                        params_copy.at(i) = chain_where(
+                                active, params_copy.at(i) + std::get<1>(dynamics.value()).at(i) * delta,
+                                params_copy.at(i));
+                        momentum.at(i) = chain_where(
+                                active, momentum.at(i) - std::get<0>(dynamics.value()).at(i) * delta,
+                                momentum.at(i));
+                    }
+                    if (!active.any().item<bool>()) {
+                        if (conf.verbose)
+                            std::cout << "GHMC: all chains stopped at iteration "
+                                      << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
+                        break;
+                    }
+                }
+            }
+
+            return BatchedHamiltonianFlow{{std::move(flow)}, lengths};
+        };
+    }
+
+    // Samples from batched dynamics stacked per chain: (chains, samples, flattened parameters).
+    // With ghmc::sampler the chains advance in lockstep and stopped chains repeat their last state,
+    // see batched_sampler for the trajectories of the individual chains.
+    inline utils::Tensor stack_chains(const Samples &samples) {
+        auto result = utils::Tensors{};
+        result.reserve(samples.size());
+        for (const auto &sample : samples) {
+            auto sample_flat = utils::Tensors{};
+            sample_flat.reserve(sample.size());
+            for (const auto &tensor : sample)
+                sample_flat.push_back(tensor.reshape({tensor.size(0), -1}));
+            result.push_back(torch::cat(sample_flat, 1));
+        }
+        return torch::stack(result, 1);
+    }
+
+    // One chain of samples per batch element: the points of every trajectory up to the length of the chain,
+    // without the repeated states of stopped chains. The samples drop the chain dimension.
+    template<typename BatchedDynamics, typename Configurations>
+    inline auto batched_sampler(const BatchedDynamics &batched_dynamics, const Configurations &conf) {
+        return [batched_dynamics, conf](const Parameters &initial_parameters, const uint32_t num_iterations) {
+            auto params = Parameters{};
+            params.reserve(initial_parameters.size());
+            for (const auto &param : initial_parameters)
+                params.push_back(param.detach());
+
+            const auto nchains = params.at(0).size(0);
+            auto chains = std::vector<Samples>(nchains);
+            const auto push_sample = [&chains](const Parameters &batch, const int64_t chain) {
+                auto sample = Parameters{};
+                sample.reserve(batch.size());
+                for (const auto &param : batch)
+                    sample.push_back(param.select(0, chain));
+                chains.at(chain).push_back(sample);
+            };
+
+            if (conf.verbose)
+                std::cout << "GHMC: batched sampling of " << nchains << " chains over "
+                          << num_iterations << " trajectories\n";
+
+            for (int64_t chain = 0; chain < nchains; chain++)
+                push_sample(params, chain);
+
+            for (uint32_t iter = 0; iter < num_iterations; iter++) {
+                const BatchedHamiltonianFlow flow = batched_dynamics(params);
+                const auto &params_flow = std::get<0>(flow);
+                if (params_flow.size() < 2)
+                    continue;
+
+                const utils::Tensor lengths = flow.lengths.to(torch::kCPU);
+                for (int64_t chain = 0; chain < nchains; chain++) {
+                    const auto length = lengths[chain].item<int64_t>();
+                    for (int64_t point = 1; point < length; point++)
+                        push_sample(params_flow.at(point), chain);
+                }
+                params = params_flow.back();
+            }
+
+            return chains;
+        };
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,266 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file checkpoint.hh
+ * Checkpoints of long Euclidean chains, to resume sampling after the job is interrupted.
+ *
+ * A checkpoint holds everything a chain needs to continue: the current parameters,
+ * the adapted step size and metric (see noa/ghmc/adaptation.hh), the number of trajectories done
+ * and the state of the random generator the chain draws from (see ghmc::chain_generator).
+ * It is written with torch::serialize into a single binary archive, replacing the previous checkpoint
+ * only once the new one is complete. A chain resumed from a checkpoint produces the same samples,
+ * bit for bit, as the uninterrupted chain.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+#include "noa/ghmc/adaptation.hh"
+
+#include <ATen/CPUGeneratorImpl.h>
+
+namespace noa::ghmc {
+
+    template<typename Metric>
+    struct ChainCheckpoint {
+        Parameters parameters;
+        Metric metric;
+        double step_size;
+        uint64_t iteration;
+        utils::Tensor generator_state;
+    };
+
+    // Metrics are stored as a list of tensors and restored from the list given a metric of their type.
+    inline utils::Tensors metric_tensors(const DiagonalMetric &metric) {
+        return metric.diagonal;
+    }
+
+    inline utils::Tensors metric_tensors(const CholeskyMetric &metric) {
+        return metric.factor;
+    }
+
+    inline utils::Tensors metric_tensors(const MetricDecomposition &metric) {
+        auto tensors = std::get<0>(metric);
+        tensors.insert(tensors.end(), std::get<1>(metric).begin(), std::get<1>(metric).end());
+        return tensors;
+    }
+
+    inline DiagonalMetric restore_metric(const utils::Tensors &tensors, const DiagonalMetric &) {
+        return DiagonalMetric{tensors};
+    }
+
+    inline CholeskyMetric restore_metric(const utils::Tensors &tensors, const CholeskyMetric &) {
+        return CholeskyMetric{tensors};
+    }
+
+    inline MetricDecomposition restore_metric(const utils::Tensors &tensors, const MetricDecomposition &) {
+        const auto nparam = static_cast<int64_t>(tensors.size() / 2);
+        return MetricDecomposition{Spectrum(tensors.begin(), tensors.begin() + nparam),
+                                   Rotation(tensors.begin() + nparam, tensors.end())};
+    }
+
+    // Starts a chain from the parameters with its own generator seeded from seed.
+    template<typename Metric>
+    inline ChainCheckpoint<Metric> initial_checkpoint(const Parameters &parameters,
+                                                      const Metric &metric,
+                                                      const double step_size,
+                                                      const uint64_t seed = utils::SEED) {
+        auto params = Parameters{};
+        params.reserve(parameters.size());
+        for (const auto &param : parameters)
+            params.push_back(param.detach());
+        return ChainCheckpoint<Metric>{params, metric, step_size, 0, at::detail::createCPUGenerator(seed).get_state()};
+    }
+
+    // Starts sampling from the end of the warm-up, with the adapted step size and metric.
+    template<typename Metric, typename Configurations>
+    inline ChainCheckpoint<Metric> initial_checkpoint(const AdaptedState<Metric, Configurations> &adapted_state,
+                                                      const uint64_t seed = utils::SEED) {
+        return initial_checkpoint(adapted_state.parameters, adapted_state.metric,
+                                  static_cast<double>(adapted_state.conf.step_size), seed);
+    }
+
+    inline void write_tensors(torch::serialize::OutputArchive &archive,
+                              const std::string &key,
+                              const utils::Tensors &tensors) {
+        archive.write(key + "/size", torch::tensor(static_cast<int64_t>(tensors.size())));
+        for (uint32_t i = 0; i < tensors.size(); i++)
+            archive.write(key + "/" + std::to_string(i), tensors.at(i));
+    }
+
+    inline utils::Tensors read_tensors(torch::serialize::InputArchive &archive, const std::string &key) {
+        auto size = utils::Tensor{};
+        archive.read(key + "/size", size);
+        const auto num_tensors = size.item<int64_t>();
+        auto tensors = utils::Tensors(num_tensors);
+        for (int64_t i = 0; i < num_tensors; i++)
+            archive.read(key + "/" + std::to_string(i), tensors.at(i));
+        return tensors;
+    }
+
+    template<typename Metric>
+    inline utils::Status save_checkpoint(const ChainCheckpoint<Metric> &checkpoint, const utils::Path &path) {
+        auto partial_path = path;
+        partial_path += ".partial";
+        try {
+            auto archive = torch::serialize::OutputArchive{};
+            write_tensors(archive, "parameters", checkpoint.parameters);
+            write_tensors(archive, "metric", metric_tensors(checkpoint.metric));
+            archive.write("step_size", torch::tensor(checkpoint.step_size, torch::kFloat64));
+            archive.write("iteration", torch::tensor(static_cast<int64_t>(checkpoint.iteration)));
+            archive.write("generator_state", checkpoint.generator_state);
+            archive.save_to(partial_path.string());
+            std::filesystem::rename(partial_path, path);
+        }
+        catch (const std::exception &exc) {
+            std::cerr << "GHMC: failed to save checkpoint to " << path << "\n" << exc.what() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    template<typename Metric = DiagonalMetric>
+    inline std::optional<ChainCheckpoint<Metric>> load_checkpoint(const utils::Path &path) {
+        if (!utils::check_path_exists(path))
+            return std::nullopt;
+        try {
+            auto archive = torch::serialize::InputArchive{};
+            archive.load_from(path.string());
+            auto step_size = utils::Tensor{};
+            archive.read("step_size", step_size);
+            auto iteration = utils::Tensor{};
+            archive.read("iteration", iteration);
+            auto generator_state = utils::Tensor{};
+            archive.read("generator_state", generator_state);
+            return ChainCheckpoint<Metric>{
+                    read_tensors(archive, "parameters"),
+                    restore_metric(read_tensors(archive, "metric"), Metric{}),
+                    step_size.item<double>(),
+                    static_cast<uint64_t>(iteration.item<int64_t>()),
+                    generator_state};
+        }
+        catch (const std::exception &exc) {
+            std::cerr << "GHMC: failed to load checkpoint from " << path << "\n" << exc.what() << "\n";
+            return std::nullopt;
+        }
+    }
+
+    struct CheckpointConfiguration {
+        utils::Path path;
+        uint32_t interval = 100;
+
+        inline CheckpointConfiguration &set_path(const utils::Path &path_) {
+            path = path_;
+            return *this;
+        }
+
+        inline CheckpointConfiguration &set_interval(const uint32_t interval_) {
+            interval = interval_;
+            return *this;
+        }
+    };
+
+    // Runs the chain of the checkpoint with make_dynamics(conf, metric) (as in ghmc::warmup)
+    // until num_iterations trajectories are done in total, saving a checkpoint every
+    // checkpoint_conf.interval trajectories and at the end. The initial parameters go into the sink
+    // (see ghmc::sink_sampler) only for a fresh chain. Returns the last checkpoint of the chain:
+    // when the sink stops the chain, this is the state after the current trajectory.
+    // Resuming from load_checkpoint(checkpoint_conf.path) with the same num_iterations finishes the chain.
+    template<typename Metric = DiagonalMetric,
+            typename DynamicsFactory, typename TrajectorySampling, typename Configurations>
+    inline auto checkpoint_sink_sampler(
+            const DynamicsFactory &make_dynamics,
+            const TrajectorySampling &trajectory_sampling,
+            const Configurations &conf,
+            const CheckpointConfiguration &checkpoint_conf) {
+        return [make_dynamics, trajectory_sampling, conf, checkpoint_conf](
+                const ChainCheckpoint<Metric> &checkpoint,
+                const uint32_t num_iterations,
+                auto &&sink) {
+            auto state = checkpoint;
+
+            auto adapted_conf = conf;
+            adapted_conf.step_size = state.step_size;
+            const auto hamiltonian_dynamics = make_dynamics(adapted_conf, state.metric);
+
+            auto generator = at::detail::createCPUGenerator();
+            generator.set_state(state.generator_state);
+            const auto guard = ChainGeneratorGuard{generator};
+
+            const auto save = [&state, &checkpoint_conf, &conf, &generator]() {
+                state.generator_state = generator.get_state();
+                if (checkpoint_conf.path.empty())
+                    return;
+                if (save_checkpoint(state, checkpoint_conf.path) && conf.verbose)
+                    std::cout << "GHMC: checkpoint saved at iteration " << state.iteration << "\n";
+            };
+
+            if (state.iteration == 0 && !sink(state.parameters)) {
+                save();
+                return state;
+            }
+
+            if (conf.verbose && state.iteration > 0)
+                std::cout << "GHMC: resuming chain at iteration " << state.iteration << "/" << num_iterations << "\n";
+
+            while (state.iteration < num_iterations) {
+                const auto flow = hamiltonian_dynamics(state.parameters);
+                const auto &params_flow = trajectory_sampling(flow);
+                state.iteration++;
+
+                auto proceed = true;
+                for (uint32_t i = 1; i < params_flow.size() && proceed; i++)
+                    proceed = sink(params_flow.at(i));
+                if (params_flow.size() > 1)
+                    state.parameters = params_flow.back();
+
+                if (!proceed)
+                    break;
+                if (checkpoint_conf.interval > 0 && state.iteration % checkpoint_conf.interval == 0 &&
+                    state.iteration < num_iterations)
+                    save();
+            }
+
+            save();
+            return state;
+        };
+    }
+
+    // Collects the samples drawn by checkpoint_sink_sampler, like ghmc::sampler.
+    // A resumed chain returns only the samples drawn after the checkpoint.
+    template<typename Metric = DiagonalMetric,
+            typename DynamicsFactory, typename TrajectorySampling, typename Configurations>
+    inline auto checkpoint_sampler(
+            const DynamicsFactory &make_dynamics,
+            const TrajectorySampling &trajectory_sampling,
+            const Configurations &conf,
+            const CheckpointConfiguration &checkpoint_conf) {
+        return [chain_sampler = checkpoint_sink_sampler<Metric>(make_dynamics, trajectory_sampling, conf, checkpoint_conf)](
+                const ChainCheckpoint<Metric> &checkpoint, const uint32_t num_iterations) {
+            auto samples = Samples{};
+            chain_sampler(checkpoint, num_iterations, [&samples](const Parameters &sample) {
+                samples.push_back(sample);
+                return true;
+            });
+            return samples;
+        };
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,293 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file diagnostics.hh
+ * Online convergence diagnostics for GHMC chains.
+ *
+ * ChainDiagnostics is a sink (see ghmc::sink_sampler) updating in O(max_lag * numel) per sample
+ * the autocovariances up to max_lag, from which the effective sample size is estimated with
+ * Geyer's initial monotone sequence, and moments over blocks of samples for the split R-hat across chains.
+ * Autocorrelations beyond max_lag are truncated, so max_lag should exceed the integrated autocorrelation time.
+ * Next to them sit the wall-clock time since construction and an optional counter of log probability
+ * evaluations (see ghmc::counting_density). The sink stops the chain once the smallest ESS over all
+ * parameters reaches the target, checked every check_interval samples.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+#include "noa/ghmc/sinks.hh"
+
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+
+namespace noa::ghmc {
+
+    using EvaluationCounter = std::shared_ptr<std::atomic<uint64_t>>;
+
+    inline EvaluationCounter evaluation_counter() {
+        return std::make_shared<std::atomic<uint64_t>>(0);
+    }
+
+    // Counts the calls to the log probability density. For gradient based dynamics
+    // every call is followed by one gradient evaluation.
+    template<typename LogProbabilityDensity>
+    inline auto counting_density(const LogProbabilityDensity &log_prob_density, const EvaluationCounter &counter) {
+        return [log_prob_density, counter](const Parameters &parameters) {
+            counter->fetch_add(1, std::memory_order_relaxed);
+            return log_prob_density(parameters);
+        };
+    }
+
+    struct DiagnosticsConfiguration {
+        int64_t max_lag = 100;
+        int64_t block_size = 50;
+        double target_ess = std::numeric_limits<double>::infinity();
+        uint64_t check_interval = 100;
+
+        inline DiagnosticsConfiguration &set_max_lag(const int64_t max_lag_) {
+            max_lag = max_lag_;
+            return *this;
+        }
+
+        inline DiagnosticsConfiguration &set_block_size(const int64_t block_size_) {
+            block_size = block_size_;
+            return *this;
+        }
+
+        inline DiagnosticsConfiguration &set_target_ess(const double target_ess_) {
+            target_ess = target_ess_;
+            return *this;
+        }
+
+        inline DiagnosticsConfiguration &set_check_interval(const uint64_t check_interval_) {
+            check_interval = check_interval_;
+            return *this;
+        }
+    };
+
+    // Count, mean and sum of squared deviations per parameter.
+    struct BlockMoments {
+        double count = 0;
+        utils::Tensor mean;
+        utils::Tensor sum_squares;
+    };
+
+    // Chan et al. pairwise update.
+    inline BlockMoments merge_moments(const BlockMoments &first, const BlockMoments &second) {
+        if (first.count == 0)
+            return second;
+        if (second.count == 0)
+            return first;
+        const auto count = first.count + second.count;
+        const auto delta = second.mean - first.mean;
+        return BlockMoments{count,
+                            first.mean + delta * (second.count / count),
+                            first.sum_squares + second.sum_squares +
+                            delta.pow(2) * (first.count * second.count / count)};
+    }
+
+    struct ChainDiagnostics {
+        DiagnosticsConfiguration diag_conf;
+        std::optional<EvaluationCounter> counter;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t count = 0;
+
+        utils::Tensor sum;
+        utils::Tensor lag_products;
+        utils::Tensor head;
+        utils::Tensor ring;
+
+        BlockMoments block;
+        std::vector<BlockMoments> blocks;
+
+        explicit ChainDiagnostics(const DiagnosticsConfiguration &diag_conf_ = DiagnosticsConfiguration{},
+                                  const std::optional<EvaluationCounter> &counter_ = std::nullopt)
+                : diag_conf{diag_conf_}, counter{counter_} {}
+
+        ChainDiagnostics(const ChainDiagnostics &) = delete;
+        ChainDiagnostics &operator=(const ChainDiagnostics &) = delete;
+        ChainDiagnostics(ChainDiagnostics &&) = default;
+        ChainDiagnostics &operator=(ChainDiagnostics &&) = default;
+
+        inline utils::Status operator()(const Parameters &sample) {
+            const auto lag = diag_conf.max_lag;
+            if (count == 0) {
+                const auto options = sample.at(0).options().dtype(torch::kFloat64);
+                const auto numel = sample_numel(sample);
+                sum = torch::zeros({numel}, options);
+                lag_products = torch::zeros({lag + 1, numel}, options);
+                head = torch::zeros({lag, numel}, options);
+                ring = torch::zeros({lag, numel}, options);
+            }
+
+            const auto value = sum.new_empty(sum.sizes());
+            copy_sample(sample, value);
+
+            const auto n = static_cast<int64_t>(count);
+            lag_products[0].add_(value * value);
+            const auto num_lags = std::min(n, lag);
+            if (num_lags > 0) {
+                const auto lagged = (n - torch::arange(1, num_lags + 1, torch::dtype(torch::kLong))).remainder(lag);
+                lag_products.slice(0, 1, num_lags + 1).add_(value * ring.index_select(0, lagged.to(ring.device())));
+            }
+            if (lag > 0) {
+                ring[n % lag].copy_(value);
+                if (n < lag)
+                    head[n].copy_(value);
+            }
+            sum.add_(value);
+            count++;
+
+            update_block(value);
+
+            if (std::isfinite(diag_conf.target_ess) && diag_conf.check_interval > 0 &&
+                count % diag_conf.check_interval == 0)
+                return min_effective_sample_size() < diag_conf.target_ess;
+            return true;
+        }
+
+        inline void update_block(const utils::Tensor &value) {
+            if (block.count == 0) {
+                block.mean = torch::zeros_like(value);
+                block.sum_squares = torch::zeros_like(value);
+            }
+            block.count += 1;
+            const auto delta = value - block.mean;
+            block.mean = block.mean + delta / block.count;
+            block.sum_squares = block.sum_squares + delta * (value - block.mean);
+            if (block.count >= static_cast<double>(diag_conf.block_size)) {
+                blocks.push_back(block);
+                block = BlockMoments{};
+            }
+        }
+
+        // Autocovariances at lags 0..min(max_lag, count - 1), with the chain mean subtracted.
+        inline utils::Tensor autocovariance() const {
+            const auto n = static_cast<int64_t>(count);
+            const auto num_lags = std::min(diag_conf.max_lag, n - 1);
+            const auto mean = sum / n;
+            const auto zeros = torch::zeros_like(sum).unsqueeze(0);
+
+            // sums over the first and the last k samples, k = 0..num_lags
+            const auto first = torch::cat({zeros, head.slice(0, 0, num_lags).cumsum(0)});
+            const auto latest = (n - 1 - torch::arange(num_lags, torch::dtype(torch::kLong))).remainder(
+                    std::max<int64_t>(diag_conf.max_lag, 1));
+            const auto last = torch::cat({zeros, ring.index_select(0, latest.to(ring.device())).cumsum(0)});
+
+            const auto lags = torch::arange(num_lags + 1, sum.options()).unsqueeze(1);
+            return (lag_products.slice(0, 0, num_lags + 1) - mean * (2 * sum - first - last) +
+                    (n - lags) * mean.pow(2)) / n;
+        }
+
+        // Geyer's initial monotone sequence estimator per parameter.
+        inline utils::Tensor effective_sample_size() const {
+            const auto n = static_cast<double>(count);
+            if (count < 4)
+                return torch::full_like(sum, n);
+
+            const auto autocov = autocovariance();
+            const auto rho = autocov / autocov[0];
+            const auto num_pairs = rho.size(0) / 2;
+            const auto pairs = rho.slice(0, 0, 2 * num_pairs, 2) + rho.slice(0, 1, 2 * num_pairs, 2);
+
+            const auto initial = (pairs > 0).to(pairs.dtype()).cumprod(0);
+            const auto monotone = std::get<0>(torch::cummin(pairs, 0));
+            const auto tau = (-1 + 2 * (monotone * initial).sum(0)).clamp_min(1 / std::log10(n));
+            return n / tau;
+        }
+
+        inline double min_effective_sample_size() const {
+            return count > 0 ? effective_sample_size().min().item<double>() : 0.;
+        }
+
+        inline double elapsed_seconds() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        inline double ess_per_second() const {
+            return min_effective_sample_size() / elapsed_seconds();
+        }
+
+        inline uint64_t evaluations() const {
+            return counter.has_value() ? counter.value()->load(std::memory_order_relaxed) : 0;
+        }
+
+        // Moments of both halves of the completed blocks, the oldest block being dropped for an odd count.
+        inline std::tuple<BlockMoments, BlockMoments> split_moments() const {
+            const auto half = blocks.size() / 2;
+            const auto offset = blocks.size() - 2 * half;
+            auto first = BlockMoments{};
+            auto second = BlockMoments{};
+            for (size_t i = 0; i < half; i++) {
+                first = merge_moments(first, blocks.at(offset + i));
+                second = merge_moments(second, blocks.at(offset + half + i));
+            }
+            return std::make_tuple(first, second);
+        }
+
+        inline void report(std::ostream &stream = std::cout) const {
+            const auto ess = min_effective_sample_size();
+            const auto seconds = elapsed_seconds();
+            stream << "GHMC: " << count << " samples, min ESS " << ess
+                   << ", " << ess / seconds << " ESS/s";
+            if (counter.has_value())
+                stream << ", " << evaluations() << " evaluations, "
+                       << ess / static_cast<double>(std::max<uint64_t>(evaluations(), 1)) << " ESS/evaluation";
+            stream << "\n";
+        }
+    };
+
+    // Split R-hat per parameter across the chains, from the completed blocks of every chain.
+    // NaN until every chain has at least two blocks.
+    template<typename Chains>
+    inline utils::Tensor split_rhat(const Chains &chains) {
+        auto halves = std::vector<BlockMoments>{};
+        for (const auto &chain : chains) {
+            const auto &[first, second] = chain.split_moments();
+            halves.push_back(first);
+            halves.push_back(second);
+        }
+
+        if (halves.empty())
+            return utils::Tensor{};
+
+        auto count = std::numeric_limits<double>::infinity();
+        for (const auto &half : halves)
+            count = std::min(count, half.count);
+        if (count < 2) {
+            const auto &chain = *std::begin(chains);
+            return chain.count > 0 ? torch::full_like(chain.sum, NAN) : utils::Tensor{};
+        }
+
+        auto means = utils::Tensors{};
+        auto variances = utils::Tensors{};
+        for (const auto &half : halves) {
+            means.push_back(half.mean);
+            variances.push_back(half.sum_squares / (half.count - 1));
+        }
+        const auto within = torch::stack(variances).mean(0);
+        const auto between = torch::stack(means).var(0);
+        return torch::sqrt(((count - 1) / count * within + between) / within);
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,107 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file fisher.hh
+ * Empirical Fisher metric for log likelihoods given as sums over data points.
+ *
+ * The metric is the sum of the outer products of the per-sample gradients plus conf.fisher_damping
+ * (e.g. the precision of an isotropic Gaussian prior), positive definite by construction.
+ * All per-sample gradients come from one batched backward pass instead of the n passes of a Hessian
+ * (conf.hessian_chunk_size data points at a time if set, see numerics::jacobian).
+ * With conf.metric_rank = r > 0 only the r leading directions of the per-sample gradients are kept
+ * in a low rank plus isotropic block (see ghmc::low_rank_block). They come from numerics::lanczos
+ * on products with the per-sample gradients (conf.lanczos_iterations steps, by default twice the rank plus ten),
+ * so that neither the n x n nor the data points' Gram matrix is formed.
+ *
+ * The per-sample log likelihood maps the parameters to the vector of the log likelihoods of the data points.
+ * It has to build its graph on the parameters it is given (without detaching them),
+ * for the metric to be differentiated along the Riemannian flow.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+#include <cmath>
+
+namespace noa::ghmc {
+
+    template<typename PerSampleLogLikelihood, typename Configurations>
+    inline auto fisher_metric(const PerSampleLogLikelihood &per_sample_log_likelihood, const Configurations &conf) {
+        return [per_sample_log_likelihood, conf](const LogProbabilityGraph &log_prob_graph) {
+            const LogProbabilityGraph per_sample = per_sample_log_likelihood(std::get<Parameters>(log_prob_graph));
+            const auto terms = std::get<LogProbability>(per_sample).flatten();
+            const auto &params = std::get<Parameters>(per_sample);
+            const auto num_samples = terms.numel();
+
+            const auto jacobians = utils::numerics::jacobian(
+                    utils::ADGraph{terms, params}, conf.hessian_chunk_size, true);
+
+            const auto nparam = params.size();
+            auto spectrum = Spectrum{};
+            spectrum.reserve(nparam);
+            auto rotation = Rotation{};
+            rotation.reserve(nparam);
+
+            for (uint32_t i = 0; i < nparam; i++) {
+                const auto n = params.at(i).numel();
+                const auto &jacobian = jacobians.at(i);
+                const auto rank = std::min<int64_t>(conf.metric_rank, num_samples);
+
+                if (rank > 0 && rank < n) {
+                    // products with the sum of the outer products, without forming either Gram matrix
+                    const auto outer_products = [&jacobian](const utils::Tensor &v) {
+                        return jacobian.t().mv(jacobian.mv(v));
+                    };
+                    const auto num_iterations = conf.lanczos_iterations > 0
+                                                ? static_cast<int64_t>(conf.lanczos_iterations)
+                                                : 2 * rank + 10;
+                    const auto[ritz_eigs, ritz_vectors] = utils::numerics::lanczos(
+                            outer_products, torch::ones({n}, jacobian.options()) / std::sqrt(static_cast<double>(n)),
+                            std::max(num_iterations, rank));
+                    const auto num_ritz = ritz_eigs.numel();
+                    const auto eigs = ritz_eigs.slice(0, num_ritz - rank).clamp_min(conf.cutoff);
+                    const auto V = ritz_vectors.slice(1, num_ritz - rank);
+                    spectrum.push_back(torch::cat({eigs + conf.fisher_damping,
+                                                   torch::full({1}, conf.fisher_damping, eigs.options())}));
+                    rotation.push_back(V);
+                } else {
+                    // the jitter separates the repeated damping eigenvalues for the backward pass of eigh
+                    const auto[eigs, Q] = torch::linalg::eigh(
+                            jacobian.t().mm(jacobian) + torch::eye(n, jacobian.options()) *
+                            (conf.fisher_damping + conf.jitter * chain_rand({n}, jacobian.options())), "L");
+                    spectrum.push_back(eigs);
+                    rotation.push_back(Q);
+                }
+
+                const utils::Tensor check_metric = rotation.back().detach().sum() + spectrum.back().detach().sum();
+                if (conf.host_sync && (torch::isnan(check_metric).item<bool>() || torch::isinf(check_metric).item<bool>())) {
+                    if (conf.verbose)
+                        std::cerr << "GHMC: failed to compute Fisher metric for log probability\n"
+                                  << std::get<LogProbability>(log_prob_graph) << "\n";
+                    return MetricDecompositionOpt{};
+                }
+            }
+
+            return MetricDecompositionOpt{MetricDecomposition{spectrum, rotation}};
+        };
+    }
+
+} // namespace noa::ghmc
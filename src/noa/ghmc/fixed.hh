@@ -0,0 +1,363 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file fixed.hh
+ * Fast path for models with a handful of parameters.
+ *
+ * The Euclidean integrator runs on stack allocated std::array states of compile-time size,
+ * with momenta and Metropolis decisions drawn from a std::mt19937_64 generator, so that no tensor
+ * is allocated and no LibTorch op is dispatched outside of the log probability density.
+ * The density and its gradient are either computed with LibTorch autograd (torch_log_probability)
+ * or, opting in, with forward mode dual numbers on a density templated on its scalar type
+ * (dual_log_probability), which avoids LibTorch altogether.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+#include <array>
+#include <cmath>
+#include <random>
+
+namespace noa::ghmc {
+
+    template<typename Dtype, std::size_t N>
+    using FixedVector = std::array<Dtype, N>;
+
+    using FixedGenerator = std::mt19937_64;
+
+    template<typename Dtype, std::size_t N>
+    struct FixedLogProbability {
+        Dtype log_prob;
+        FixedVector<Dtype, N> gradient;
+    };
+
+    template<typename Dtype, std::size_t N>
+    using FixedLogProbabilityOpt = std::optional<FixedLogProbability<Dtype, N>>;
+
+    template<typename Dtype, std::size_t N>
+    struct FixedFlow {
+        std::vector<FixedVector<Dtype, N>> params;
+        std::vector<FixedVector<Dtype, N>> momentum;
+        std::vector<Dtype> energy;
+    };
+
+    // Forward mode dual number carrying the gradient with respect to N inputs.
+    template<typename Dtype, std::size_t N>
+    struct Dual {
+        using Scalar = Dtype;
+
+        Dtype value = 0;
+        FixedVector<Dtype, N> tangent{};
+
+        Dual() = default;
+
+        Dual(const Dtype value_) : value{value_} {}
+
+        Dual(const Dtype value_, const FixedVector<Dtype, N> &tangent_) : value{value_}, tangent{tangent_} {}
+    };
+
+    // Non-deduced scalar operand of the dual arithmetic, so that literals convert to Dtype.
+    template<typename Dtype, std::size_t N>
+    using Scalar = typename Dual<Dtype, N>::Scalar;
+
+    // Dual with derivative factor applied to the tangent: f(x) + f'(x) dx.
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> chain_dual(const Dual<Dtype, N> &x, const Dtype value, const Dtype derivative) {
+        auto res = Dual<Dtype, N>{value};
+        for (std::size_t i = 0; i < N; i++)
+            res.tangent[i] = derivative * x.tangent[i];
+        return res;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator+(const Dual<Dtype, N> &x, const Dual<Dtype, N> &y) {
+        auto res = Dual<Dtype, N>{x.value + y.value};
+        for (std::size_t i = 0; i < N; i++)
+            res.tangent[i] = x.tangent[i] + y.tangent[i];
+        return res;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator-(const Dual<Dtype, N> &x, const Dual<Dtype, N> &y) {
+        auto res = Dual<Dtype, N>{x.value - y.value};
+        for (std::size_t i = 0; i < N; i++)
+            res.tangent[i] = x.tangent[i] - y.tangent[i];
+        return res;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator*(const Dual<Dtype, N> &x, const Dual<Dtype, N> &y) {
+        auto res = Dual<Dtype, N>{x.value * y.value};
+        for (std::size_t i = 0; i < N; i++)
+            res.tangent[i] = x.tangent[i] * y.value + x.value * y.tangent[i];
+        return res;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator/(const Dual<Dtype, N> &x, const Dual<Dtype, N> &y) {
+        auto res = Dual<Dtype, N>{x.value / y.value};
+        for (std::size_t i = 0; i < N; i++)
+            res.tangent[i] = (x.tangent[i] * y.value - x.value * y.tangent[i]) / (y.value * y.value);
+        return res;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator-(const Dual<Dtype, N> &x) {
+        return chain_dual(x, -x.value, Dtype{-1});
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator+(const Dual<Dtype, N> &x, const Scalar<Dtype, N> y) {
+        return x + Dual<Dtype, N>{y};
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator+(const Scalar<Dtype, N> x, const Dual<Dtype, N> &y) {
+        return Dual<Dtype, N>{x} + y;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator-(const Dual<Dtype, N> &x, const Scalar<Dtype, N> y) {
+        return x - Dual<Dtype, N>{y};
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator-(const Scalar<Dtype, N> x, const Dual<Dtype, N> &y) {
+        return Dual<Dtype, N>{x} - y;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator*(const Dual<Dtype, N> &x, const Scalar<Dtype, N> y) {
+        return chain_dual(x, x.value * y, y);
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator*(const Scalar<Dtype, N> x, const Dual<Dtype, N> &y) {
+        return chain_dual(y, x * y.value, x);
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator/(const Dual<Dtype, N> &x, const Scalar<Dtype, N> y) {
+        return chain_dual(x, x.value / y, 1 / y);
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> operator/(const Scalar<Dtype, N> x, const Dual<Dtype, N> &y) {
+        return Dual<Dtype, N>{x} / y;
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> exp(const Dual<Dtype, N> &x) {
+        const auto value = std::exp(x.value);
+        return chain_dual(x, value, value);
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> log(const Dual<Dtype, N> &x) {
+        return chain_dual(x, std::log(x.value), 1 / x.value);
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> sqrt(const Dual<Dtype, N> &x) {
+        const auto value = std::sqrt(x.value);
+        return chain_dual(x, value, 1 / (2 * value));
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> pow(const Dual<Dtype, N> &x, const Scalar<Dtype, N> exponent) {
+        return chain_dual(x, std::pow(x.value, exponent), exponent * std::pow(x.value, exponent - 1));
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> sin(const Dual<Dtype, N> &x) {
+        return chain_dual(x, std::sin(x.value), std::cos(x.value));
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> cos(const Dual<Dtype, N> &x) {
+        return chain_dual(x, std::cos(x.value), -std::sin(x.value));
+    }
+
+    template<typename Dtype, std::size_t N>
+    inline Dual<Dtype, N> tanh(const Dual<Dtype, N> &x) {
+        const auto value = std::tanh(x.value);
+        return chain_dual(x, value, 1 - value * value);
+    }
+
+    // The density is called with a FixedVector of duals and returns a dual, e.g. a generic lambda
+    // calling exp, log, pow ... unqualified, so that the dual overloads are found by argument dependent lookup.
+    template<typename Dtype, std::size_t N, typename DualDensity>
+    inline auto dual_log_probability(const DualDensity &dual_density) {
+        return [dual_density](const FixedVector<Dtype, N> &params) {
+            auto inputs = FixedVector<Dual<Dtype, N>, N>{};
+            for (std::size_t i = 0; i < N; i++) {
+                inputs[i].value = params[i];
+                inputs[i].tangent[i] = 1;
+            }
+            const Dual<Dtype, N> log_prob = dual_density(inputs);
+            if (!std::isfinite(log_prob.value))
+                return FixedLogProbabilityOpt<Dtype, N>{};
+            for (const auto derivative : log_prob.tangent)
+                if (!std::isfinite(derivative))
+                    return FixedLogProbabilityOpt<Dtype, N>{};
+            return FixedLogProbabilityOpt<Dtype, N>{FixedLogProbability<Dtype, N>{log_prob.value, log_prob.tangent}};
+        };
+    }
+
+    // LogProbabilityDensity on a single parameter tensor of N elements, evaluated with LibTorch autograd.
+    template<typename Dtype, std::size_t N, typename LogProbabilityDensity>
+    inline auto torch_log_probability(const LogProbabilityDensity &log_prob_density,
+                                      const torch::TensorOptions &options = torch::dtype(torch::kFloat64)) {
+        return [log_prob_density, options](const FixedVector<Dtype, N> &params) {
+            const auto theta = torch::tensor(at::ArrayRef<Dtype>(params.data(), N), options);
+            const LogProbabilityGraph log_prob_graph = log_prob_density(Parameters{theta});
+            const auto &[log_prob, graph_params] = log_prob_graph;
+            const utils::Tensor gradient = torch::autograd::grad({log_prob}, graph_params).at(0)
+                    .detach().to(torch::kCPU, c10::CppTypeToScalarType<Dtype>::value).contiguous();
+
+            auto res = FixedLogProbability<Dtype, N>{log_prob.template item<Dtype>()};
+            std::copy(gradient.data_ptr<Dtype>(), gradient.data_ptr<Dtype>() + N, res.gradient.begin());
+            if (!std::isfinite(res.log_prob))
+                return FixedLogProbabilityOpt<Dtype, N>{};
+            for (const auto derivative : res.gradient)
+                if (!std::isfinite(derivative))
+                    return FixedLogProbabilityOpt<Dtype, N>{};
+            return FixedLogProbabilityOpt<Dtype, N>{res};
+        };
+    }
+
+    inline const auto fixed_metropolis_criterion = [](const auto &flow, FixedGenerator &generator) {
+        using Dtype = typename std::decay_t<decltype(flow.energy)>::value_type;
+        const auto rho = -std::max(Dtype{0}, flow.energy.back() - flow.energy.front());
+        return rho >= std::log(std::uniform_real_distribution<Dtype>{}(generator));
+    };
+
+    // Euclidean flow for a diagonal metric, mirroring euclidean_dynamics.
+    template<typename LogProbabilityGradient, typename Dtype, std::size_t N,
+            typename StopFlowCriterion, typename Configurations>
+    inline auto fixed_euclidean_dynamics(
+            const LogProbabilityGradient &log_prob_grad,
+            const FixedVector<Dtype, N> &diagonal,
+            const StopFlowCriterion &stop_flow_criterion,
+            const Configurations &conf) {
+        return [log_prob_grad, diagonal, stop_flow_criterion, conf](
+                const FixedVector<Dtype, N> &parameters,
+                FixedGenerator &generator,
+                const std::optional<FixedVector<Dtype, N>> &momentum_ = std::nullopt) {
+            auto flow = FixedFlow<Dtype, N>{};
+            flow.params.reserve(conf.max_flow_steps + 1);
+            flow.momentum.reserve(conf.max_flow_steps + 1);
+            flow.energy.reserve(conf.max_flow_steps + 1);
+
+            auto log_prob = log_prob_grad(parameters);
+            if (!log_prob.has_value()) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: failed to initialise Hamiltonian flow.\n";
+                return flow;
+            }
+
+            auto params = parameters;
+            auto momentum = FixedVector<Dtype, N>{};
+            if (momentum_.has_value())
+                momentum = momentum_.value();
+            else {
+                auto normal = std::normal_distribution<Dtype>{};
+                for (std::size_t i = 0; i < N; i++)
+                    momentum[i] = std::sqrt(diagonal[i]) * normal(generator);
+            }
+
+            const auto energy = [&diagonal](const Dtype log_prob_, const FixedVector<Dtype, N> &momentum__) {
+                auto res = -log_prob_;
+                for (std::size_t i = 0; i < N; i++)
+                    res += momentum__[i] * momentum__[i] / diagonal[i] / 2;
+                return res;
+            };
+
+            flow.params.push_back(params);
+            flow.momentum.push_back(momentum);
+            flow.energy.push_back(energy(log_prob.value().log_prob, momentum));
+
+            const Dtype step_size = conf.step_size;
+            const auto delta = step_size / 2;
+            for (uint32_t iter_step = 0; iter_step < conf.max_flow_steps; iter_step++) {
+                const auto &gradient = log_prob.value().gradient;
+                for (std::size_t i = 0; i < N; i++) {
+                    momentum[i] += gradient[i] * delta;
+                    params[i] += momentum[i] / diagonal[i] * step_size;
+                }
+
+                log_prob = log_prob_grad(params);
+                if (!log_prob.has_value()) {
+                    if (conf.verbose)
+                        std::cerr << "GHMC: failed to evolve flow at step "
+                                  << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
+                    break;
+                }
+                for (std::size_t i = 0; i < N; i++)
+                    momentum[i] += log_prob.value().gradient[i] * delta;
+
+                flow.params.push_back(params);
+                flow.momentum.push_back(momentum);
+                flow.energy.push_back(energy(log_prob.value().log_prob, momentum));
+
+                if (iter_step < conf.max_flow_steps - 1 && !stop_flow_criterion(flow, generator)) {
+                    if (conf.verbose)
+                        std::cout << "GHMC: rejecting sample at iteration "
+                                  << iter_step + 1 << "/" << conf.max_flow_steps << "\n";
+                    break;
+                }
+            }
+
+            return flow;
+        };
+    }
+
+    // Full trajectories of num_iterations flows, starting with the initial parameters (see ghmc::sampler).
+    template<typename FixedDynamics>
+    inline auto fixed_sampler(const FixedDynamics &fixed_dynamics, const uint64_t seed = utils::SEED) {
+        return [fixed_dynamics, seed](const auto &initial_parameters, const uint32_t num_iterations) {
+            auto generator = FixedGenerator{seed};
+            auto samples = std::vector<std::decay_t<decltype(initial_parameters)>>{initial_parameters};
+            auto params = initial_parameters;
+            for (uint32_t iter = 0; iter < num_iterations; iter++) {
+                const auto flow = fixed_dynamics(params, generator);
+                samples.insert(samples.end(), flow.params.begin() + std::min<std::size_t>(1, flow.params.size()),
+                               flow.params.end());
+                if (flow.params.size() > 1)
+                    params = flow.params.back();
+            }
+            return samples;
+        };
+    }
+
+    // Samples as rows of a tensor, for the diagnostics working on Samples.
+    template<typename Dtype, std::size_t N>
+    inline utils::Tensor fixed_samples_tensor(const std::vector<FixedVector<Dtype, N>> &samples) {
+        utils::Tensor res = torch::empty({static_cast<int64_t>(samples.size()), static_cast<int64_t>(N)},
+                                         torch::dtype(c10::CppTypeToScalarType<Dtype>::value));
+        auto data = res.data_ptr<Dtype>();
+        for (const auto &sample : samples)
+            data = std::copy(sample.begin(), sample.end(), data);
+        return res;
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,86 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file jit.hh
+ * Log probability densities compiled from TorchScript modules.
+ *
+ * The module's forward takes the parameters as positional tensors and returns the scalar log probability.
+ * Its own attributes (e.g. the data or the weights of a regression net) are frozen into constants,
+ * so gradients flow only to the sampled parameters.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+#include <torch/csrc/jit/codegen/fuser/interface.h>
+#include <torch/csrc/jit/passes/freeze_module.h>
+#include <torch/csrc/jit/passes/tensorexpr_fuser.h>
+
+namespace noa::ghmc {
+
+    using utils::ScriptModule;
+
+    // Freezes a clone of the module in eval mode: attributes are inlined and constant folded.
+    inline ScriptModule freeze_log_probability(const ScriptModule &module) {
+        auto frozen = module.clone();
+        frozen.eval();
+        return torch::jit::freeze(frozen);
+    }
+
+    // Fusion switches of the TorchScript runtime on CPU.
+    struct CPUFusion {
+        bool can_fuse_on_cpu = true;
+        bool tensor_expr_fuser_enabled = true;
+    };
+
+    inline CPUFusion cpu_fusion() {
+        return CPUFusion{torch::jit::canFuseOnCPU(), torch::jit::tensorExprFuserEnabled()};
+    }
+
+    // These switches are process wide: they apply to every TorchScript module of the program.
+    // Returns the previous setting so that the caller can restore it.
+    inline CPUFusion set_cpu_fusion(const CPUFusion &fusion = CPUFusion{}) {
+        const auto previous = cpu_fusion();
+        torch::jit::overrideCanFuseOnCPU(fusion.can_fuse_on_cpu);
+        torch::jit::setTensorExprFuserEnabled(fusion.tensor_expr_fuser_enabled);
+        return previous;
+    }
+
+    // Adapter turning a TorchScript log probability into a LogProbabilityDensity.
+    // The graph executor specialises the frozen graph on the first calls and then runs
+    // the forward and its backward as compiled graphs. Fusion on CPU is left to the caller (see set_cpu_fusion).
+    inline auto jit_log_probability(const ScriptModule &module) {
+        return [frozen = freeze_log_probability(module)](const Parameters &parameters_) {
+            auto inputs = std::vector<torch::jit::IValue>{};
+            inputs.reserve(parameters_.size());
+            auto parameters = Parameters{};
+            parameters.reserve(parameters_.size());
+            for (const auto &parameter : parameters_) {
+                parameters.push_back(parameter.detach().requires_grad_(true));
+                inputs.emplace_back(parameters.back());
+            }
+            auto module = frozen;
+            const auto log_prob = module.forward(inputs).toTensor();
+            return LogProbabilityGraph{log_prob, parameters};
+        };
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,101 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file lanczos.hh
+ * Low rank SoftAbs metric for high dimensional models.
+ *
+ * The conf.metric_rank eigenpairs of the Hessian of largest magnitude are extracted by numerics::lanczos
+ * from Hessian-vector products, so the Hessian is never formed. SoftAbs is applied to them,
+ * while the orthogonal complement gets the isotropic eigenvalue conf.metric_floor (see ghmc::low_rank_block).
+ * Kinetic energy and momentum sampling then cost O(n * rank) per parameter block.
+ * conf.lanczos_iterations (by default twice the rank plus ten) bounds the number of products.
+ * The iteration starts from the normalised vector of ones, so that the metric is a deterministic function
+ * of the position and the Riemannian flow stays reversible when the rank is truncated.
+ * Repeated eigenvalues (e.g. exchangeable coordinates) exhaust its Krylov space early,
+ * numerics::lanczos then restarts from fixed generic vectors.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+#include <cmath>
+
+namespace noa::ghmc {
+
+    template<typename Configurations>
+    inline auto lanczos_softabs_metric(const Configurations &conf) {
+        return [conf](const LogProbabilityGraph &log_prob_graph) {
+            const auto &[log_prob, params] = log_prob_graph;
+            const auto gradients = torch::autograd::grad({log_prob}, params, {}, torch::nullopt, true);
+
+            const auto nparam = params.size();
+            auto spectrum = Spectrum{};
+            spectrum.reserve(nparam);
+            auto rotation = Rotation{};
+            rotation.reserve(nparam);
+
+            for (uint32_t i = 0; i < nparam; i++) {
+                const auto &param = params.at(i);
+                const auto n = param.numel();
+                const auto grad = gradients.at(i).flatten();
+                const auto options = grad.options();
+
+                // products with the negative Hessian block, kept on the graph for the Riemannian flow
+                const auto neg_hvp = [&grad, &param](const utils::Tensor &v) {
+                    return -utils::numerics::gradient_vector_product(grad, param, v, true);
+                };
+
+                const auto rank = std::min<int64_t>(std::max<uint32_t>(conf.metric_rank, 1), n);
+                const auto num_iterations = conf.lanczos_iterations > 0
+                                            ? static_cast<int64_t>(conf.lanczos_iterations)
+                                            : 2 * rank + 10;
+                const auto[ritz_eigs, ritz_vectors] = utils::numerics::lanczos(
+                        neg_hvp, torch::ones({n}, options) / std::sqrt(static_cast<double>(n)),
+                        std::max(num_iterations, rank));
+
+                const auto top = std::get<1>(torch::topk(ritz_eigs.detach().abs(), rank));
+                const auto eigs = ritz_eigs.index_select(0, top);
+                const auto V = ritz_vectors.index_select(1, top);
+
+                const auto reg_eigs = torch::where(eigs.abs() >= conf.cutoff, eigs,
+                                                   torch::tensor(conf.cutoff, options));
+                const auto softabs = torch::abs((1 / torch::tanh(conf.softabs_const * reg_eigs)) * reg_eigs);
+
+                const utils::Tensor check_metric = softabs.detach().sum() + V.detach().sum();
+                if (conf.host_sync && (torch::isnan(check_metric).item<bool>() || torch::isinf(check_metric).item<bool>())) {
+                    if (conf.verbose)
+                        std::cerr << "GHMC: failed to compute Lanczos SoftAbs metric for log probability\n"
+                                  << log_prob << "\n";
+                    return MetricDecompositionOpt{};
+                }
+
+                if (rank < n)
+                    spectrum.push_back(torch::cat({softabs, torch::full({1}, conf.metric_floor, options)}));
+                else
+                    spectrum.push_back(softabs);
+                rotation.push_back(V);
+            }
+
+            return MetricDecompositionOpt{MetricDecomposition{spectrum, rotation}};
+        };
+    }
+
+} // namespace noa::ghmc
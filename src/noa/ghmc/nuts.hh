@@ -0,0 +1,241 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file nuts.hh
+ * No-U-Turn sampler on top of the Euclidean leapfrog (see ghmc::euclidean_leapfrog).
+ *
+ * Trajectories are doubled in a random direction until the generalised U-turn criterion
+ * fires or conf.max_tree_depth is reached, and the next state is drawn from the trajectory
+ * by multinomial sampling: biased progressive sampling across doublings, uniform within subtrees.
+ * Doublings stop early on divergence, when the energy error exceeds conf.max_energy_error.
+ *
+ * The dynamics return a HamiltonianFlow made of the initial and the selected point,
+ * so it plugs into ghmc::sampler with ghmc::end_of_trajectory.
+ * Every NUTS transition synchronises with the host, conf.host_sync is ignored.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+#include <cmath>
+#include <limits>
+
+namespace noa::ghmc {
+
+    // Reported for every NUTS transition. Gradient evaluations include the one at the initial point.
+    struct NUTSTransition {
+        uint32_t tree_depth = 0;
+        uint32_t gradient_evaluations = 0;
+        bool divergent = false;
+    };
+
+    inline const auto ignore_transition = [](const NUTSTransition &) {};
+
+    struct NUTSTree {
+        LeapfrogState minus;
+        LeapfrogState plus;
+        LeapfrogState sample;
+        Energy sample_energy;
+        Momentum rho;
+        double log_weight = -std::numeric_limits<double>::infinity();
+        bool valid = false;
+    };
+
+    inline double log_add_exp(const double a, const double b) {
+        if (std::isinf(a) && a < 0)
+            return b;
+        if (std::isinf(b) && b < 0)
+            return a;
+        return std::max(a, b) + std::log1p(std::exp(-std::abs(a - b)));
+    }
+
+    inline double chain_uniform() {
+        return chain_rand({1}, torch::dtype(torch::kFloat64)).item<double>();
+    }
+
+    // Generalised U-turn criterion: the summed momentum of the tree against the velocities at both ends.
+    template<typename Metric>
+    inline bool no_u_turn(const Metric &metric, const NUTSTree &tree) {
+        utils::Tensor forward = tree.rho.at(0).new_zeros({});
+        utils::Tensor backward = tree.rho.at(0).new_zeros({});
+        for (uint32_t i = 0; i < tree.rho.size(); i++) {
+            const auto rho_i = tree.rho.at(i).flatten();
+            forward = forward + rho_i.dot(velocity(metric, i, tree.plus.momentum.at(i)).flatten());
+            backward = backward + rho_i.dot(velocity(metric, i, tree.minus.momentum.at(i)).flatten());
+        }
+        return (forward > 0).item<bool>() && (backward > 0).item<bool>();
+    }
+
+    // The constant metric is a MetricDecomposition, DiagonalMetric or CholeskyMetric.
+    // The observer receives the NUTSTransition statistics after every call.
+    template<typename LogProbabilityDensity, typename ConstantMetric, typename Configurations,
+            typename TransitionObserver = decltype(ignore_transition)>
+    inline auto nuts_dynamics(
+            const LogProbabilityDensity &log_prob_density,
+            const ConstantMetric &constant_metric,
+            const Configurations &conf,
+            const TransitionObserver &observer = ignore_transition) {
+
+        const auto metric = euclidean_metric(constant_metric);
+        const auto log_prob_func = log_probability(log_prob_density, conf);
+        const auto log_prob_grad = log_probability_gradient(conf);
+        const auto leapfrog = euclidean_leapfrog(log_prob_func, log_prob_grad, metric);
+
+        const auto hamiltonian = [metric, conf](const LeapfrogState &state) {
+            auto energy = energy_term(-state.log_prob, conf);
+            for (uint32_t i = 0; i < state.momentum.size(); i++)
+                energy += kinetic_energy_term(metric, i, state.momentum.at(i), conf);
+            return Energy{energy};
+        };
+
+        const auto build_tree = [leapfrog, hamiltonian, metric, conf](
+                const auto &self,
+                const LeapfrogState &start,
+                const int32_t direction,
+                const uint32_t depth,
+                const double initial_energy,
+                NUTSTransition &transition) -> NUTSTree {
+            if (depth == 0) {
+                const auto next = leapfrog(start, direction * conf.step_size);
+                transition.gradient_evaluations++;
+                if (!next.has_value()) {
+                    transition.divergent = true;
+                    return NUTSTree{};
+                }
+                const Energy energy = hamiltonian(next.value());
+                const auto energy_error = energy.item<double>() - initial_energy;
+                if (!(energy_error <= conf.max_energy_error)) {
+                    transition.divergent = true;
+                    return NUTSTree{};
+                }
+                const auto &state = next.value();
+                return NUTSTree{state, state, state, energy, state.momentum, -energy_error, true};
+            }
+
+            auto tree = self(self, start, direction, depth - 1, initial_energy, transition);
+            if (!tree.valid)
+                return tree;
+
+            const auto other = self(self, direction > 0 ? tree.plus : tree.minus,
+                                    direction, depth - 1, initial_energy, transition);
+            if (!other.valid)
+                return other;
+
+            if (direction > 0)
+                tree.plus = other.plus;
+            else
+                tree.minus = other.minus;
+
+            const auto log_weight = log_add_exp(tree.log_weight, other.log_weight);
+            if (std::log(chain_uniform()) < other.log_weight - log_weight) {
+                tree.sample = other.sample;
+                tree.sample_energy = other.sample_energy;
+            }
+            tree.log_weight = log_weight;
+
+            for (uint32_t i = 0; i < tree.rho.size(); i++)
+                tree.rho.at(i) = tree.rho.at(i) + other.rho.at(i);
+            tree.valid = no_u_turn(metric, tree);
+
+            return tree;
+        };
+
+        return [log_prob_func, log_prob_grad, hamiltonian, build_tree, metric, conf, observer](
+                const Parameters &parameters,
+                const MomentumOpt &momentum_ = std::nullopt) {
+
+            auto flow = create_flow(1);
+            auto &[params_flow, momentum_flow, energy_level] = flow;
+            auto transition = NUTSTransition{};
+
+            const auto log_prob_graph = log_prob_func(parameters);
+            const auto gradient = log_prob_grad(log_prob_graph);
+            transition.gradient_evaluations++;
+            if (!gradient.has_value()) {
+                if (conf.verbose)
+                    std::cerr << "GHMC: failed to initialise NUTS trajectory.\n";
+                observer(transition);
+                return flow;
+            }
+            const auto &[log_prob, initial_params] = log_prob_graph.value();
+
+            const auto nparam = parameters.size();
+            auto params = Parameters{};
+            params.reserve(nparam);
+            auto momentum = Momentum{};
+            momentum.reserve(nparam);
+            for (uint32_t i = 0; i < nparam; i++) {
+                params.push_back(initial_params.at(i).detach());
+                const auto momentum_lift = momentum_.has_value()
+                                           ? momentum_.value().at(i)
+                                           : sample_momentum(metric, i);
+                momentum.push_back(momentum_lift.detach().view_as(parameters.at(i)));
+            }
+
+            const auto initial = LeapfrogState{params, momentum, log_prob.detach(), gradient.value()};
+            const Energy initial_energy = hamiltonian(initial);
+
+            params_flow.push_back(params);
+            momentum_flow.push_back(momentum);
+            energy_level.push_back(initial_energy);
+
+            auto tree = NUTSTree{initial, initial, initial, initial_energy, momentum, 0., true};
+            const auto initial_energy_value = initial_energy.item<double>();
+
+            for (uint32_t depth = 0; depth < conf.max_tree_depth; depth++) {
+                const int32_t direction = chain_uniform() < 0.5 ? -1 : 1;
+                const auto subtree = build_tree(build_tree, direction > 0 ? tree.plus : tree.minus,
+                                                direction, depth, initial_energy_value, transition);
+                transition.tree_depth = depth + 1;
+                if (!subtree.valid)
+                    break;
+
+                if (direction > 0)
+                    tree.plus = subtree.plus;
+                else
+                    tree.minus = subtree.minus;
+
+                if (std::log(chain_uniform()) < subtree.log_weight - tree.log_weight) {
+                    tree.sample = subtree.sample;
+                    tree.sample_energy = subtree.sample_energy;
+                }
+                tree.log_weight = log_add_exp(tree.log_weight, subtree.log_weight);
+
+                for (uint32_t i = 0; i < nparam; i++)
+                    tree.rho.at(i) = tree.rho.at(i) + subtree.rho.at(i);
+                if (!no_u_turn(metric, tree))
+                    break;
+            }
+
+            if (conf.verbose && transition.divergent)
+                std::cout << "GHMC: divergent NUTS trajectory at tree depth "
+                          << transition.tree_depth << "\n";
+
+            params_flow.push_back(tree.sample.params);
+            momentum_flow.push_back(tree.sample.momentum);
+            energy_level.push_back(tree.sample_energy);
+
+            observer(transition);
+            return flow;
+        };
+    }
+
+} // namespace noa::ghmc
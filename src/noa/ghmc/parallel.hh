@@ -0,0 +1,196 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file parallel.hh
+ * Independent GHMC chains scheduled onto a thread pool.
+ *
+ * Each chain draws from its own generator seeded from the chain index,
+ * so the samples do not depend on the number of threads.
+ * The log probability density is evaluated concurrently from several threads
+ * and must not share mutable state between chains
+ * (e.g. a network whose parameters are overwritten on every call).
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+#include "noa/3rdparty/async/threadpool.h"
+
+#include <ATen/CPUGeneratorImpl.h>
+
+#include <exception>
+#include <future>
+#include <limits>
+#include <memory>
+
+namespace noa::ghmc {
+
+    using ChainsParameters = std::vector<Parameters>;
+    using ChainsSamples = std::vector<Samples>;
+
+    struct ParallelConfiguration {
+        uint32_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+        int32_t intra_op_threads = 1;
+        uint64_t seed = utils::SEED;
+
+        inline ParallelConfiguration &set_num_threads(const uint32_t num_threads_) {
+            num_threads = num_threads_;
+            return *this;
+        }
+
+        inline ParallelConfiguration &set_intra_op_threads(const int32_t intra_op_threads_) {
+            intra_op_threads = intra_op_threads_;
+            return *this;
+        }
+
+        inline ParallelConfiguration &set_seed(const uint64_t seed_) {
+            seed = seed_;
+            return *this;
+        }
+    };
+
+    inline torch::Generator chain_generator_for(const uint64_t seed, const uint64_t chain) {
+        return at::detail::createCPUGenerator(seed + chain);
+    }
+
+    // Thread pool kept by a sampler across its rounds of chains, with at most max_chains workers.
+    using ChainsPool = std::shared_ptr<async::threadpool>;
+
+    inline ChainsPool chains_pool(const ParallelConfiguration &parallel_conf,
+                                  const uint32_t max_chains = std::numeric_limits<uint32_t>::max()) {
+        return std::make_shared<async::threadpool>(
+                static_cast<int>(std::max(1u, std::min(parallel_conf.num_threads, max_chains))));
+    }
+
+    // Restores the intra-op thread count of the caller when leaving the scope.
+    struct IntraOpThreadsGuard {
+        int32_t intra_op_threads = torch::get_num_threads();
+
+        IntraOpThreadsGuard() = default;
+        IntraOpThreadsGuard(const IntraOpThreadsGuard &) = delete;
+        IntraOpThreadsGuard &operator=(const IntraOpThreadsGuard &) = delete;
+
+        ~IntraOpThreadsGuard() {
+            if (torch::get_num_threads() != intra_op_threads)
+                torch::set_num_threads(intra_op_threads);
+        }
+    };
+
+    // Runs a chain task on the pool with its own random stream and intra-op thread budget.
+    // The task receives the chain index. The intra-op setting of the caller is restored on return.
+    // All the chains are waited for before the first exception thrown by a chain, if any, is rethrown.
+    template<typename ChainTask>
+    inline auto run_chains(const ChainTask &chain_task,
+                           const uint32_t num_chains,
+                           const ParallelConfiguration &parallel_conf,
+                           async::threadpool &pool) {
+        using ChainResult = std::invoke_result_t<ChainTask, uint32_t>;
+
+        const auto intra_op_guard = IntraOpThreadsGuard{};
+
+        auto futures = std::vector<std::future<ChainResult>>{};
+        futures.reserve(num_chains);
+        for (uint32_t chain = 0; chain < num_chains; chain++)
+            futures.push_back(pool.post([&chain_task, &parallel_conf, chain]() {
+                if (parallel_conf.intra_op_threads > 0 &&
+                    torch::get_num_threads() != parallel_conf.intra_op_threads)
+                    torch::set_num_threads(parallel_conf.intra_op_threads);
+                const auto guard = ChainGeneratorGuard{chain_generator_for(parallel_conf.seed, chain)};
+                return chain_task(chain);
+            }));
+
+        // the tasks refer to the arguments, none may be left on the pool
+        for (const auto &future : futures)
+            future.wait();
+
+        auto results = std::vector<ChainResult>{};
+        results.reserve(num_chains);
+        auto error = std::exception_ptr{};
+        for (auto &future : futures) {
+            try {
+                results.push_back(future.get());
+            } catch (...) {
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+
+        return results;
+    }
+
+    template<typename ChainTask>
+    inline auto run_chains(const ChainTask &chain_task,
+                           const uint32_t num_chains,
+                           const ParallelConfiguration &parallel_conf) {
+        const auto pool = chains_pool(parallel_conf, num_chains);
+        return run_chains(chain_task, num_chains, parallel_conf, *pool);
+    }
+
+    // Runs one chain of the provided sampler (see ghmc::sampler) per initial point.
+    template<typename ChainSampler>
+    inline auto parallel_sampler(const ChainSampler &chain_sampler,
+                                 const ParallelConfiguration &parallel_conf = ParallelConfiguration{}) {
+        return [chain_sampler, parallel_conf, pool = chains_pool(parallel_conf)](
+                const ChainsParameters &initial_parameters,
+                const uint32_t num_iterations) {
+            const auto num_chains = static_cast<uint32_t>(initial_parameters.size());
+            return ChainsSamples(run_chains(
+                    [&chain_sampler, &initial_parameters, num_iterations](const uint32_t chain) {
+                        return Samples(chain_sampler(initial_parameters.at(chain), num_iterations));
+                    },
+                    num_chains, parallel_conf, *pool));
+        };
+    }
+
+    // Samples of every chain with the statistics it collected.
+    struct ChainsStatisticsSamples {
+        ChainsSamples samples;
+        std::vector<SamplerStatisticsPtr> statistics;
+    };
+
+    // Runs one chain per initial point, each with statistics of its own: make_chain_sampler takes
+    // the SamplerStatisticsPtr of the chain and builds its sampler, e.g. ghmc::sampler over dynamics
+    // created from a configuration with set_statistics.
+    template<typename ChainSamplerFactory>
+    inline auto parallel_statistics_sampler(const ChainSamplerFactory &make_chain_sampler,
+                                            const ParallelConfiguration &parallel_conf = ParallelConfiguration{}) {
+        return [make_chain_sampler, parallel_conf, pool = chains_pool(parallel_conf)](
+                const ChainsParameters &initial_parameters,
+                const uint32_t num_iterations) {
+            const auto num_chains = static_cast<uint32_t>(initial_parameters.size());
+            auto statistics = std::vector<SamplerStatisticsPtr>{};
+            statistics.reserve(num_chains);
+            for (uint32_t chain = 0; chain < num_chains; chain++)
+                statistics.push_back(sampler_statistics());
+
+            auto samples = ChainsSamples(run_chains(
+                    [&make_chain_sampler, &statistics, &initial_parameters, num_iterations](const uint32_t chain) {
+                        const auto chain_sampler = make_chain_sampler(statistics.at(chain));
+                        return Samples(chain_sampler(initial_parameters.at(chain), num_iterations));
+                    },
+                    num_chains, parallel_conf, *pool));
+
+            return ChainsStatisticsSamples{std::move(samples), std::move(statistics)};
+        };
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,204 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file sghmc.hh
+ * Stochastic gradient HMC over minibatches of the data.
+ *
+ * The log probability is estimated on a minibatch drawn on every evaluation,
+ * so the cost of a step does not depend on the dataset size.
+ * Dynamics follow Chen, Fox & Guestrin (2014) with identity mass and no noise estimate:
+ *     theta += v,  v += -friction * v + step_size * grad log p(theta) + N(0, 2 * friction * step_size),
+ * where step_size is the learning rate. There is no Metropolis correction.
+ * Friction one with momentum resampled every step gives the stochastic gradient Langevin dynamics.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+#include <memory>
+
+namespace noa::ghmc {
+
+    using Minibatch = std::tuple<utils::Tensor, utils::Tensor>;
+
+    inline utils::Tensor chain_randperm(const int64_t n, const torch::TensorOptions &options) {
+        if (!chain_generator.has_value())
+            return torch::randperm(n, options);
+        const auto &generator = chain_generator.value();
+        return torch::randperm(n, generator, options.device(generator.device())).to(options.device());
+    }
+
+    // Shuffled minibatches of inputs and targets, reshuffled after every epoch.
+    // Copies share the position in the epoch, so a density and its caller see the same stream.
+    // The last incomplete batch of an epoch is dropped to keep the likelihood scale constant.
+    class MinibatchStream {
+        struct Epoch {
+            utils::Tensor permutation;
+            int64_t position = 0;
+        };
+
+        utils::Tensor inputs;
+        utils::Tensor targets;
+        int64_t batch_size;
+        std::shared_ptr<Epoch> epoch = std::make_shared<Epoch>();
+
+    public:
+        MinibatchStream(const utils::Tensor &inputs_, const utils::Tensor &targets_, const int64_t batch_size_)
+                : inputs{inputs_}, targets{targets_},
+                  batch_size{std::max<int64_t>(1, std::min(batch_size_, inputs_.size(0)))} {}
+
+        inline int64_t dataset_size() const {
+            return inputs.size(0);
+        }
+
+        inline int64_t minibatch_size() const {
+            return batch_size;
+        }
+
+        // Scale turning the log likelihood of a minibatch into an unbiased estimate over the dataset.
+        inline double likelihood_scale() const {
+            return static_cast<double>(dataset_size()) / static_cast<double>(batch_size);
+        }
+
+        inline Minibatch next() const {
+            if (!epoch->permutation.defined() || epoch->position + batch_size > dataset_size()) {
+                epoch->permutation = chain_randperm(
+                        dataset_size(), torch::dtype(torch::kLong).device(inputs.device()));
+                epoch->position = 0;
+            }
+            const auto indices = epoch->permutation.slice(0, epoch->position, epoch->position + batch_size);
+            epoch->position += batch_size;
+            return Minibatch{inputs.index_select(0, indices), targets.index_select(0, indices)};
+        }
+    };
+
+    // Draws a minibatch on every evaluation. The factory takes the minibatch inputs, targets
+    // and the likelihood scale, e.g. numerics::regression_log_probability(net, ...).
+    template<typename Dtype, typename MinibatchDensity>
+    inline auto minibatch_log_probability(const MinibatchStream &stream, const MinibatchDensity &minibatch_density) {
+        return [stream, minibatch_density](const Parameters &parameters) {
+            const auto[inputs, targets] = stream.next();
+            return minibatch_density(inputs, targets, static_cast<Dtype>(stream.likelihood_scale()))(parameters);
+        };
+    }
+
+    template<typename Dtype>
+    struct SGHMCConfiguration {
+        uint32_t max_flow_steps = 10;
+        Dtype step_size = 1e-4f;
+        Dtype friction = 0.1f;
+        bool host_sync = true;
+        bool verbose = false;
+
+        inline SGHMCConfiguration &set_max_flow_steps(const uint32_t max_flow_steps_) {
+            max_flow_steps = max_flow_steps_;
+            return *this;
+        }
+
+        inline SGHMCConfiguration &set_step_size(const Dtype &step_size_) {
+            step_size = step_size_;
+            return *this;
+        }
+
+        inline SGHMCConfiguration &set_friction(const Dtype &friction_) {
+            friction = friction_;
+            return *this;
+        }
+
+        inline SGHMCConfiguration &set_host_sync(const bool host_sync_) {
+            host_sync = host_sync_;
+            return *this;
+        }
+
+        inline SGHMCConfiguration &set_verbosity(const bool verbose_) {
+            verbose = verbose_;
+            return *this;
+        }
+    };
+
+    // Dynamics for ghmc::sink_sampler and ghmc::sampler. The momentum is resampled at the start
+    // of every trajectory. Without a Metropolis correction the energy level is left empty.
+    // With conf.host_sync the flow stops early on a non finite gradient, checked with one host sync per step.
+    template<typename StochasticDensity, typename Dtype>
+    inline auto sghmc_dynamics(const StochasticDensity &stochastic_density, const SGHMCConfiguration<Dtype> &conf) {
+        return [stochastic_density, conf](const Parameters &parameters) {
+            const auto nparam = parameters.size();
+            const auto noise_scale = std::sqrt(2 * static_cast<double>(conf.friction * conf.step_size));
+
+            auto theta = Parameters{};
+            auto velocity = Momentum{};
+            theta.reserve(nparam);
+            velocity.reserve(nparam);
+            for (const auto &param : parameters) {
+                theta.push_back(param.detach());
+                velocity.push_back(chain_randn_like(param) * std::sqrt(static_cast<double>(conf.step_size)));
+            }
+
+            auto params_flow = ParametersFlow{};
+            auto momentum_flow = MomentumFlow{};
+            params_flow.reserve(conf.max_flow_steps + 1);
+            momentum_flow.reserve(conf.max_flow_steps + 1);
+            params_flow.push_back(theta);
+            momentum_flow.push_back(velocity);
+
+            for (uint32_t step = 0; step < conf.max_flow_steps; step++) {
+                auto next_theta = Parameters{};
+                next_theta.reserve(nparam);
+                for (size_t i = 0; i < nparam; i++)
+                    next_theta.push_back(theta.at(i) + velocity.at(i));
+
+                const LogProbabilityGraph log_prob_graph = stochastic_density(next_theta);
+                const utils::Tensors gradient = torch::autograd::grad(
+                        {std::get<0>(log_prob_graph)}, std::get<1>(log_prob_graph));
+
+                auto next_velocity = Momentum{};
+                next_velocity.reserve(nparam);
+                for (size_t i = 0; i < nparam; i++) {
+                    const auto &v = velocity.at(i);
+                    next_velocity.push_back(
+                            (1 - conf.friction) * v + conf.step_size * gradient.at(i).detach() +
+                            chain_randn_like(v) * noise_scale);
+                }
+
+                if (conf.host_sync) {
+                    auto sums = utils::Tensors{};
+                    sums.reserve(nparam);
+                    for (const auto &grad : gradient)
+                        sums.push_back(grad.detach().sum().to(torch::kFloat64));
+                    if (!torch::isfinite(torch::stack(sums).sum()).item<bool>()) {
+                        if (conf.verbose)
+                            std::cerr << "GHMC: non finite stochastic gradient, stopping the flow at step "
+                                      << step << "\n";
+                        break;
+                    }
+                }
+
+                theta = next_theta;
+                velocity = next_velocity;
+                params_flow.push_back(theta);
+                momentum_flow.push_back(velocity);
+            }
+
+            return HamiltonianFlow{params_flow, momentum_flow, EnergyLevel{}};
+        };
+    }
+
+} // namespace noa::ghmc
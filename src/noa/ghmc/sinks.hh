@@ -0,0 +1,228 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file sinks.hh
+ * Sample sinks for ghmc::sink_sampler keeping memory bounded for chains of any length.
+ *
+ * A sink is a callable on Parameters returning false to stop the chain.
+ * Samples are flattened into rows like utils::stack does.
+ * Wrapping sinks take the inner sink by value: pass std::ref(sink) to keep reading it afterwards.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+
+namespace noa::ghmc {
+
+    inline int64_t sample_numel(const Parameters &sample) {
+        int64_t numel = 0;
+        for (const auto &param : sample)
+            numel += param.numel();
+        return numel;
+    }
+
+    // Copies the flattened sample into a preallocated row without intermediate allocations.
+    inline void copy_sample(const Parameters &sample, const utils::Tensor &row) {
+        int64_t offset = 0;
+        for (const auto &param : sample) {
+            const auto numel = param.numel();
+            row.slice(0, offset, offset + numel).copy_(param.detach().flatten());
+            offset += numel;
+        }
+    }
+
+    // Keeps the most recent capacity samples in a contiguous [capacity, numel] buffer.
+    struct RingBufferSink {
+        utils::Tensor buffer;
+        uint64_t count = 0;
+
+        RingBufferSink(const int64_t capacity, const Parameters &prototype)
+                : buffer{prototype.at(0).new_empty({capacity, sample_numel(prototype)})} {}
+
+        inline utils::Status operator()(const Parameters &sample) {
+            copy_sample(sample, buffer[static_cast<int64_t>(count % buffer.size(0))]);
+            count++;
+            return true;
+        }
+
+        // Retained samples in chronological order.
+        inline utils::Tensor samples() const {
+            const auto capacity = static_cast<uint64_t>(buffer.size(0));
+            if (count <= capacity)
+                return buffer.slice(0, 0, static_cast<int64_t>(count));
+            const auto head = static_cast<int64_t>(count % capacity);
+            return torch::cat({buffer.slice(0, head), buffer.slice(0, 0, head)});
+        }
+    };
+
+    // Drops the first burn_in samples and forwards every thinning-th sample afterwards.
+    template<typename Sink>
+    struct BurnInThinningSink {
+        Sink sink;
+        uint64_t burn_in = 0;
+        uint64_t thinning = 1;
+        uint64_t count = 0;
+
+        inline utils::Status operator()(const Parameters &sample) {
+            const auto index = count++;
+            if (index < burn_in || (index - burn_in) % thinning != 0)
+                return true;
+            return sink(sample);
+        }
+    };
+
+    template<typename Sink>
+    inline auto burn_in_thinning(Sink sink, const uint64_t burn_in, const uint64_t thinning = 1) {
+        return BurnInThinningSink<Sink>{std::move(sink), burn_in, std::max<uint64_t>(thinning, 1)};
+    }
+
+    // Running mean and covariance of the samples (Welford's algorithm), accumulated in double precision.
+    struct RunningMomentsSink {
+        utils::Tensor sum_mean;
+        utils::Tensor sum_squares;
+        uint64_t count = 0;
+
+        inline utils::Status operator()(const Parameters &sample) {
+            if (count == 0) {
+                const auto options = sample.at(0).options().dtype(torch::kFloat64);
+                const auto numel = sample_numel(sample);
+                sum_mean = torch::zeros({numel}, options);
+                sum_squares = torch::zeros({numel, numel}, options);
+            }
+            const auto value = sum_mean.new_empty(sum_mean.sizes());
+            copy_sample(sample, value);
+            count++;
+            const auto delta = value - sum_mean;
+            sum_mean.add_(delta / static_cast<double>(count));
+            sum_squares.add_(torch::outer(delta, value - sum_mean));
+            return true;
+        }
+
+        inline utils::Tensor mean() const {
+            return sum_mean;
+        }
+
+        // Unbiased sample covariance, NaN for fewer than two samples.
+        inline utils::Tensor covariance() const {
+            return count > 1 ? sum_squares / static_cast<double>(count - 1) : torch::full_like(sum_squares, NAN);
+        }
+    };
+
+    // Running mean and variance of every element of the samples (Welford's algorithm), in double precision.
+    // Memory and work are linear in the number of elements, unlike RunningMomentsSink.
+    struct RunningVarianceSink {
+        utils::Tensor sum_mean;
+        utils::Tensor sum_squares;
+        uint64_t count = 0;
+
+        inline utils::Status operator()(const Parameters &sample) {
+            if (count == 0) {
+                const auto options = sample.at(0).options().dtype(torch::kFloat64);
+                const auto numel = sample_numel(sample);
+                sum_mean = torch::zeros({numel}, options);
+                sum_squares = torch::zeros({numel}, options);
+            }
+            const auto value = sum_mean.new_empty(sum_mean.sizes());
+            copy_sample(sample, value);
+            count++;
+            const auto delta = value - sum_mean;
+            sum_mean.add_(delta / static_cast<double>(count));
+            sum_squares.add_(delta * (value - sum_mean));
+            return true;
+        }
+
+        inline utils::Tensor mean() const {
+            return sum_mean;
+        }
+
+        // Unbiased sample variance, NaN for fewer than two samples.
+        inline utils::Tensor variance() const {
+            return count > 1 ? sum_squares / static_cast<double>(count - 1) : torch::full_like(sum_squares, NAN);
+        }
+    };
+
+    // Writes the samples as raw rows in native byte order, chunk_size rows at a time.
+    // Only one chunk is held in memory, the tail is written on flush or destruction.
+    struct ChunkedFileSink {
+        utils::Tensor chunk;
+        int64_t filled = 0;
+        uint64_t count = 0;
+        std::ofstream stream;
+
+        ChunkedFileSink(const utils::Path &path, const int64_t chunk_size, const Parameters &prototype)
+                : chunk{torch::empty({chunk_size, sample_numel(prototype)},
+                                     prototype.at(0).options().device(torch::kCPU))},
+                  stream{path, std::ios::binary | std::ios::trunc} {
+            if (!stream.good())
+                std::cerr << "GHMC: failed to open " << path << " for writing samples\n";
+        }
+
+        ChunkedFileSink(const ChunkedFileSink &) = delete;
+        ChunkedFileSink &operator=(const ChunkedFileSink &) = delete;
+
+        ~ChunkedFileSink() {
+            flush();
+        }
+
+        inline utils::Status operator()(const Parameters &sample) {
+            copy_sample(sample, chunk[filled]);
+            filled++;
+            count++;
+            if (filled == chunk.size(0))
+                flush();
+            return stream.good();
+        }
+
+        inline void flush() {
+            if (filled > 0 && stream.good()) {
+                stream.write(static_cast<const char *>(chunk.data_ptr()),
+                             static_cast<std::streamsize>(filled * chunk.size(1) * chunk.element_size()));
+                stream.flush();
+            }
+            filled = 0;
+        }
+    };
+
+    // Reads back the rows written by ChunkedFileSink.
+    inline utils::TensorOpt load_chunked_samples(const utils::Path &path,
+                                                 const int64_t numel,
+                                                 const torch::Dtype dtype) {
+        if (!utils::check_path_exists(path))
+            return std::nullopt;
+
+        auto stream = std::ifstream{path, std::ios::binary};
+        const auto bytes = static_cast<int64_t>(std::filesystem::file_size(path));
+        const auto row_bytes = numel * torch::empty({0}, torch::dtype(dtype)).element_size();
+        if (bytes % row_bytes != 0) {
+            std::cerr << "GHMC: unexpected size of samples file " << path << "\n";
+            return std::nullopt;
+        }
+
+        const auto samples = torch::empty({bytes / row_bytes, numel}, torch::dtype(dtype));
+        stream.read(static_cast<char *>(samples.data_ptr()), static_cast<std::streamsize>(bytes));
+        if (!stream.good()) {
+            std::cerr << "GHMC: failed to read samples from " << path << "\n";
+            return std::nullopt;
+        }
+        return samples;
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,146 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file speculative.hh
+ * Speculative evaluation of the trajectories of a single chain on a thread pool.
+ *
+ * The chain takes a Metropolis decision at the end of every trajectory: the endpoint is accepted with
+ * probability min(1, exp(-(H_end - H_start))), otherwise the chain stays at its current state.
+ * The trajectories following a rejection start from the same state, so they do not depend on
+ * the pending decisions: a round runs the next depth trajectories concurrently from the current state
+ * and keeps them up to and including the first acceptance, discarding the rest.
+ * With acceptance rate a a round advances (1 - (1 - a)^depth) / a iterations in the wall-clock time
+ * of one trajectory, which pays off for short or poorly mixing trajectories on otherwise idle cores.
+ *
+ * Iteration k draws from a generator seeded from parallel_conf.seed + k (see ghmc::run_chains),
+ * so the samples do not depend on the depth or the number of threads.
+ * The log probability density is evaluated concurrently and must not share mutable state between
+ * trajectories, as for independent chains (see noa/ghmc/parallel.hh).
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+#include "noa/ghmc/parallel.hh"
+
+namespace noa::ghmc {
+
+    using ParametersOpt = std::optional<Parameters>;
+
+    struct SpeculativeConfiguration {
+        uint32_t depth = 2;
+        bool verbose = false;
+
+        inline SpeculativeConfiguration &set_depth(const uint32_t depth_) {
+            depth = depth_;
+            return *this;
+        }
+
+        inline SpeculativeConfiguration &set_verbosity(const bool verbose_) {
+            verbose = verbose_;
+            return *this;
+        }
+    };
+
+    // Pushes the initial parameters and the state of the chain after each of num_iterations trajectories
+    // into the sink (see ghmc::sink_sampler), repeating the current state on rejection.
+    // The dynamics should run whole trajectories with a criterion that never stops the flow, e.g.
+    // euclidean_dynamics<EndpointFlow>(log_prob_density, metric, [](const HamiltonianFlow &) { return true; }, conf).
+    template<typename HamiltonianDynamics>
+    inline auto speculative_sink_sampler(
+            const HamiltonianDynamics &hamiltonian_dynamics,
+            const SpeculativeConfiguration &speculative_conf = SpeculativeConfiguration{},
+            const ParallelConfiguration &parallel_conf = ParallelConfiguration{}) {
+        return [hamiltonian_dynamics, speculative_conf, parallel_conf,
+                pool = chains_pool(parallel_conf, std::max(1u, speculative_conf.depth))](
+                const Parameters &initial_parameters,
+                const uint32_t num_iterations,
+                auto &&sink) {
+            auto params = Parameters{};
+            params.reserve(initial_parameters.size());
+            for (const auto &param : initial_parameters)
+                params.push_back(param.detach());
+
+            if (!sink(params))
+                return params;
+
+            const auto depth = std::max(1u, speculative_conf.depth);
+            uint64_t num_rounds = 0;
+            uint64_t num_accepted = 0;
+            uint64_t num_discarded = 0;
+
+            uint32_t iter = 0;
+            while (iter < num_iterations) {
+                const auto num_trajectories = std::min(depth, num_iterations - iter);
+                auto round_conf = parallel_conf;
+                round_conf.set_seed(parallel_conf.seed + iter);
+
+                const auto proposals = run_chains(
+                        [&hamiltonian_dynamics, &params](const uint32_t) {
+                            const auto flow = hamiltonian_dynamics(params);
+                            const auto &params_flow = std::get<0>(flow);
+                            if (params_flow.size() < 2)
+                                return ParametersOpt{};
+                            return metropolis_criterion(flow) ? ParametersOpt{params_flow.back()} : ParametersOpt{};
+                        },
+                        num_trajectories, round_conf, *pool);
+                num_rounds++;
+
+                for (uint32_t i = 0; i < num_trajectories; i++) {
+                    iter++;
+                    const auto &proposal = proposals.at(i);
+                    if (proposal.has_value()) {
+                        params = proposal.value();
+                        num_accepted++;
+                        num_discarded += num_trajectories - i - 1;
+                    }
+                    if (!sink(params))
+                        return params;
+                    if (proposal.has_value())
+                        break;
+                }
+            }
+
+            if (speculative_conf.verbose)
+                std::cout << "GHMC: " << num_accepted << "/" << num_iterations << " trajectories accepted in "
+                          << num_rounds << " speculative rounds, " << num_discarded << " trajectories discarded\n";
+
+            return params;
+        };
+    }
+
+    template<typename HamiltonianDynamics>
+    inline auto speculative_sampler(
+            const HamiltonianDynamics &hamiltonian_dynamics,
+            const SpeculativeConfiguration &speculative_conf = SpeculativeConfiguration{},
+            const ParallelConfiguration &parallel_conf = ParallelConfiguration{}) {
+        return [chain_sampler = speculative_sink_sampler(hamiltonian_dynamics, speculative_conf, parallel_conf)](
+                const Parameters &initial_parameters, const uint32_t num_iterations) {
+            auto samples = Samples{};
+            samples.reserve(num_iterations + 1);
+            chain_sampler(initial_parameters, num_iterations, [&samples](const Parameters &sample) {
+                samples.push_back(sample);
+                return true;
+            });
+            return samples;
+        };
+    }
+
+} // namespace noa::ghmc
@@ -0,0 +1,213 @@
+/*****************************************************************************
+ *   Copyright (c) 2023, Roland Grinis, GrinisRIT ltd.                       *
+ *   (roland.grinis@grinisrit.com)                                           *
+ *   All rights reserved.                                                    *
+ *   See the file COPYING for full copying permissions.                      *
+ *                                                                           *
+ *   This program is free software: you can redistribute it and/or modify    *
+ *   it under the terms of the GNU General Public License as published by    *
+ *   the Free Software Foundation, either version 3 of the License, or       *
+ *   (at your option) any later version.                                     *
+ *                                                                           *
+ *   This program is distributed in the hope that it will be useful,         *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the            *
+ *   GNU General Public License for more details.                            *
+ *                                                                           *
+ *   You should have received a copy of the GNU General Public License       *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.   *
+ *****************************************************************************/
+/**
+ * \file tempering.hh
+ * Replica exchange (parallel tempering) for multimodal log probability densities.
+ *
+ * Each replica evolves the density raised to its inverse temperature with its own dynamics,
+ * scheduled onto a thread pool like independent chains (see noa/ghmc/parallel.hh).
+ * After every tempering_conf.swap_interval trajectories neighbouring replicas exchange their states,
+ * alternating even and odd pairs, with the Metropolis probability
+ *     min(1, exp((beta_k - beta_{k+1}) * (log p(theta_{k+1}) - log p(theta_k)))).
+ * Only the samples of the cold replica (inverse temperature one, first in the ladder) are exposed.
+ */
+
+#pragma once
+
+#include "noa/ghmc.hh"
+#include "noa/ghmc/parallel.hh"
+
+#include <cmath>
+
+namespace noa::ghmc {
+
+    using InverseTemperatures = std::vector<double>;
+
+    // Geometric ladder from 1 down to 1 / max_temperature.
+    inline InverseTemperatures geometric_inverse_temperatures(const uint32_t num_replicas,
+                                                              const double max_temperature) {
+        auto inverse_temperatures = InverseTemperatures{};
+        inverse_temperatures.reserve(num_replicas);
+        for (uint32_t k = 0; k < num_replicas; k++)
+            inverse_temperatures.push_back(
+                    num_replicas > 1 ? std::pow(max_temperature, -static_cast<double>(k) / (num_replicas - 1)) : 1.);
+        return inverse_temperatures;
+    }
+
+    template<typename LogProbabilityDensity>
+    inline auto tempered_density(const LogProbabilityDensity &log_prob_density, const double inverse_temperature) {
+        return [log_prob_density, inverse_temperature](const Parameters &parameters) {
+            const LogProbabilityGraph log_prob_graph = log_prob_density(parameters);
+            return LogProbabilityGraph{std::get<LogProbability>(log_prob_graph) * inverse_temperature,
+                                       std::get<Parameters>(log_prob_graph)};
+        };
+    }
+
+    struct TemperingConfiguration {
+        uint32_t swap_interval = 1;
+        bool verbose = false;
+
+        inline TemperingConfiguration &set_swap_interval(const uint32_t swap_interval_) {
+            swap_interval = swap_interval_;
+            return *this;
+        }
+
+        inline TemperingConfiguration &set_verbosity(const bool verbose_) {
+            verbose = verbose_;
+            return *this;
+        }
+    };
+
+    // States of the replicas, ordered as the ladder, and swap counts between neighbours k and k + 1.
+    struct ReplicaExchangeState {
+        ChainsParameters replicas;
+        std::vector<uint64_t> swaps_attempted;
+        std::vector<uint64_t> swaps_accepted;
+    };
+
+    // Replica k runs make_dynamics(tempered_density(log_prob_density, inverse_temperatures.at(k))).
+    // Pushes the initial parameters and the samples of the cold replica into the sink (see ghmc::sink_sampler)
+    // and returns the state of all replicas. Every round of trajectories draws from generators seeded from
+    // the round and the replica, the swaps from a generator of their own, so that the samples
+    // do not depend on the number of threads.
+    template<typename DynamicsFactory, typename LogProbabilityDensity, typename TrajectorySampling>
+    inline auto replica_exchange_sink_sampler(
+            const DynamicsFactory &make_dynamics,
+            const LogProbabilityDensity &log_prob_density,
+            const TrajectorySampling &trajectory_sampling,
+            const InverseTemperatures &inverse_temperatures,
+            const TemperingConfiguration &tempering_conf = TemperingConfiguration{},
+            const ParallelConfiguration &parallel_conf = ParallelConfiguration{}) {
+        using ReplicaDynamics = std::invoke_result_t<
+                DynamicsFactory, decltype(tempered_density(log_prob_density, 1.))>;
+
+        auto replicas = std::vector<ReplicaDynamics>{};
+        replicas.reserve(inverse_temperatures.size());
+        for (const auto inverse_temperature : inverse_temperatures)
+            replicas.push_back(make_dynamics(tempered_density(log_prob_density, inverse_temperature)));
+
+        return [replicas, log_prob_density, trajectory_sampling, inverse_temperatures, tempering_conf, parallel_conf,
+                pool = chains_pool(parallel_conf, static_cast<uint32_t>(inverse_temperatures.size()))](
+                const Parameters &initial_parameters,
+                const uint32_t num_iterations,
+                auto &&sink) {
+            const auto num_replicas = static_cast<uint32_t>(replicas.size());
+            const auto num_pairs = num_replicas > 0 ? num_replicas - 1 : 0;
+
+            auto params = Parameters{};
+            params.reserve(initial_parameters.size());
+            for (const auto &param : initial_parameters)
+                params.push_back(param.detach());
+
+            auto state = ReplicaExchangeState{
+                    ChainsParameters(num_replicas, params),
+                    std::vector<uint64_t>(num_pairs, 0),
+                    std::vector<uint64_t>(num_pairs, 0)};
+
+            if (num_replicas == 0 || !sink(params))
+                return state;
+
+            const auto swap_interval = std::max(1u, tempering_conf.swap_interval);
+            const auto num_rounds = (num_iterations + swap_interval - 1) / swap_interval;
+            const auto swap_guard = ChainGeneratorGuard{
+                    chain_generator_for(parallel_conf.seed, uint64_t{num_rounds} * num_replicas)};
+
+            for (uint32_t round = 0; round < num_rounds; round++) {
+                const auto iterations = std::min(swap_interval, num_iterations - round * swap_interval);
+                auto round_conf = parallel_conf;
+                round_conf.set_seed(parallel_conf.seed + uint64_t{round} * num_replicas);
+
+                const auto results = run_chains(
+                        [&replicas, &trajectory_sampling, &state, iterations](const uint32_t replica) {
+                            auto cold_samples = Samples{};
+                            const auto last = sink_sampler(replicas.at(replica), trajectory_sampling)(
+                                    state.replicas.at(replica), iterations,
+                                    [&cold_samples, replica](const Parameters &sample) {
+                                        if (replica == 0)
+                                            cold_samples.push_back(sample);
+                                        return true;
+                                    });
+                            return std::make_tuple(last, cold_samples);
+                        },
+                        num_replicas, round_conf, *pool);
+
+                for (uint32_t replica = 0; replica < num_replicas; replica++)
+                    state.replicas.at(replica) = std::get<0>(results.at(replica));
+
+                // the first sample is the starting point, already pushed
+                const auto &cold_samples = std::get<1>(results.front());
+                for (size_t i = 1; i < cold_samples.size(); i++)
+                    if (!sink(cold_samples.at(i))) {
+                        state.replicas.front() = cold_samples.at(i);
+                        return state;
+                    }
+
+                auto log_probs = std::vector<double>{};
+                log_probs.reserve(num_replicas);
+                for (const auto &replica_params : state.replicas)
+                    log_probs.push_back(
+                            std::get<LogProbability>(log_prob_density(replica_params)).detach().template item<double>());
+
+                for (uint32_t k = round % 2; k + 1 < num_replicas; k += 2) {
+                    state.swaps_attempted.at(k)++;
+                    const auto log_ratio = (inverse_temperatures.at(k) - inverse_temperatures.at(k + 1)) *
+                                           (log_probs.at(k + 1) - log_probs.at(k));
+                    const auto log_uniform = std::log(
+                            chain_rand({}, torch::dtype(torch::kFloat64)).item<double>());
+                    if (log_uniform < log_ratio) {
+                        std::swap(state.replicas.at(k), state.replicas.at(k + 1));
+                        std::swap(log_probs.at(k), log_probs.at(k + 1));
+                        state.swaps_accepted.at(k)++;
+                    }
+                }
+            }
+
+            if (tempering_conf.verbose)
+                for (uint32_t k = 0; k < num_pairs; k++)
+                    std::cout << "GHMC: replicas " << k << " <-> " << k + 1 << " swapped "
+                              << state.swaps_accepted.at(k) << "/" << state.swaps_attempted.at(k) << " times\n";
+
+            return state;
+        };
+    }
+
+    // Samples of the cold replica, starting with the initial parameters.
+    template<typename DynamicsFactory, typename LogProbabilityDensity, typename TrajectorySampling>
+    inline auto replica_exchange_sampler(
+            const DynamicsFactory &make_dynamics,
+            const LogProbabilityDensity &log_prob_density,
+            const TrajectorySampling &trajectory_sampling,
+            const InverseTemperatures &inverse_temperatures,
+            const TemperingConfiguration &tempering_conf = TemperingConfiguration{},
+            const ParallelConfiguration &parallel_conf = ParallelConfiguration{}) {
+        return [chain_sampler = replica_exchange_sink_sampler(
+                make_dynamics, log_prob_density, trajectory_sampling,
+                inverse_temperatures, tempering_conf, parallel_conf)](
+                const Parameters &initial_parameters, const uint32_t num_iterations) {
+            auto samples = Samples{};
+            chain_sampler(initial_parameters, num_iterations, [&samples](const Parameters &sample) {
+                samples.push_back(sample);
+                return true;
+            });
+            return samples;
+        };
+    }
+
+} // namespace noa::ghmc
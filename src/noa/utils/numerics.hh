@@ -25,9 +25,120 @@
 
 #include "noa/utils/common.hh"
 
+#if __has_include(<ATen/LegacyVmapMode.h>)
+#include <ATen/LegacyVmapMode.h>
+#else
+#include <ATen/VmapMode.h>
+#endif
+
+#include <cmath>
+#include <limits>
+
 namespace noa::utils::numerics {
 
-    inline TensorsOpt hessian(const ADGraph &ad_graph) {
+    // Keeps a vmap level open while batched cotangents are propagated through the graph.
+    struct VmapLevel {
+        const int64_t level = at::impl::VmapMode::increment_nesting();
+
+        VmapLevel() = default;
+        VmapLevel(const VmapLevel &) = delete;
+        VmapLevel &operator=(const VmapLevel &) = delete;
+
+        ~VmapLevel() {
+            at::impl::VmapMode::decrement_nesting();
+        }
+    };
+
+    // Vector-Jacobian products for a batch of cotangents stacked along their leading dimension,
+    // computed in a single backward pass (the LibTorch counterpart of is_grads_batched in PyTorch).
+    // Results carry the batch along the leading dimension, unused inputs get zeros.
+    inline Tensors batched_vjp(const Tensors &outputs,
+                               const Tensors &inputs,
+                               const Tensors &batched_grad_outputs,
+                               const bool create_graph = false) {
+        const auto batch_size = batched_grad_outputs.at(0).size(0);
+        const auto vmap = VmapLevel{};
+
+        auto grad_outputs = Tensors{};
+        grad_outputs.reserve(batched_grad_outputs.size());
+        for (const auto &grad_output: batched_grad_outputs)
+            grad_outputs.push_back(at::_add_batch_dim(grad_output, 0, vmap.level));
+
+        const auto grads = torch::autograd::grad(outputs, inputs, grad_outputs, true, create_graph, true);
+
+        auto res = Tensors{};
+        res.reserve(inputs.size());
+        for (uint32_t i = 0; i < inputs.size(); i++) {
+            const auto &input = inputs.at(i);
+            if (grads.at(i).defined())
+                res.push_back(at::_remove_batch_dim(grads.at(i), vmap.level, batch_size, 0));
+            else {
+                auto shape = input.sizes().vec();
+                shape.insert(shape.begin(), batch_size);
+                res.push_back(input.new_zeros(shape));
+            }
+        }
+        return res;
+    }
+
+    // Rows [begin, end) of the n x n identity, without forming the rest of it.
+    inline Tensor identity_rows(const int64_t begin,
+                                const int64_t end,
+                                const int64_t n,
+                                const torch::TensorOptions &options) {
+        auto rows = torch::zeros({end - begin, n}, options);
+        rows.diagonal(begin).fill_(1);
+        return rows;
+    }
+
+    // Rows [begin, end) of the Jacobian of the flat gradient w.r.t. the variable.
+    // The gradient may carry a batch in front: the result is then [nbatch, end - begin, n].
+    inline Tensor gradient_jacobian_rows(const Tensor &flat_grad,
+                                         const Tensor &variable,
+                                         const int64_t begin,
+                                         const int64_t end) {
+        const auto n = flat_grad.size(-1);
+        const auto k = end - begin;
+        if (!flat_grad.requires_grad()) {
+            auto shape = flat_grad.sizes().vec();
+            shape.insert(shape.end() - 1, k);
+            return flat_grad.new_zeros(shape);
+        }
+
+        auto basis = identity_rows(begin, end, n, flat_grad.options());
+        if (flat_grad.dim() > 1)
+            basis = basis.unsqueeze(1).expand({k, flat_grad.size(0), n});
+
+        const auto rows = batched_vjp({flat_grad}, {variable}, {basis}, true).at(0);
+        return flat_grad.dim() == 1
+               ? rows.reshape({k, n})
+               : rows.reshape({k, flat_grad.size(0), n}).transpose(0, 1);
+    }
+
+    // Upper triangle of the Jacobian of the flat gradient (with its batch in front, if any),
+    // chunk rows per batched backward pass. Empty when batching fails, e.g. on an operator without a batching rule.
+    inline TensorOpt gradient_jacobian_triu(const Tensor &flat_grad, const Tensor &variable, const int64_t chunk) {
+        const auto n = flat_grad.size(-1);
+        auto rows = Tensors{};
+        try {
+            for (int64_t begin = 0; begin < n; begin += chunk) {
+                const auto end = std::min(begin + chunk, n);
+                rows.push_back(torch::triu(gradient_jacobian_rows(flat_grad, variable, begin, end), begin));
+            }
+        }
+        catch (const std::exception &) {
+            return std::nullopt;
+        }
+        if (rows.empty())
+            return std::nullopt;
+        return torch::cat(rows, -2);
+    }
+
+    // By default (chunk_size = 0 or 1) one backward pass per row of a Hessian block is made.
+    // With chunk_size > 1 the rows come chunk_size at a time from batched backward passes,
+    // falling back to one pass per row if the graph cannot be batched.
+    // Without check_finite non-finite blocks are returned as is and the host is not synchronised.
+    inline TensorsOpt hessian(const ADGraph &ad_graph, const uint32_t chunk_size = 0, const bool check_finite = true) {
         const auto &value = std::get<OutputLeaf>(ad_graph);
         if ((value.dim() > 0)) {
             std::cerr << "Invalid arguments to noa::utils::numerics::hessian : "
@@ -48,26 +159,377 @@ namespace noa::utils::numerics {
             const auto res = value.new_zeros({n, n});
             const auto grad = gradients.at(ivar).flatten();
 
-            uint32_t i = 0;
-            for (uint32_t j = 0; j < n; j++) {
-                const auto row = grad[j].requires_grad()
-                                 ? torch::autograd::grad({grad[i]}, {variable}, {}, true, true,
-                                                         true)[0].flatten().slice(0, j, n)
-                                 : grad[j].new_zeros(n - j);
-                res[i].slice(0, i, n).add_(row);
-                i++;
+            const auto rows = chunk_size > 1 ? gradient_jacobian_triu(grad, variable, chunk_size) : TensorOpt{};
+            if (rows.has_value()) {
+                res.add_(rows.value());
+            } else {
+                uint32_t i = 0;
+                for (uint32_t j = 0; j < n; j++) {
+                    const auto row = grad[j].requires_grad()
+                                     ? torch::autograd::grad({grad[i]}, {variable}, {}, true, true,
+                                                             true)[0].flatten().slice(0, j, n)
+                                     : grad[j].new_zeros(n - j);
+                    res[i].slice(0, i, n).add_(row);
+                    i++;
+                }
+            }
+
+            if (check_finite) {
+                const auto check = torch::triu(res.detach()).sum();
+                if (torch::isnan(check).item<bool>() || torch::isinf(check).item<bool>())
+                    return TensorsOpt{};
+            }
+            hess.push_back(res + torch::triu(res, 1).t());
+        }
+
+        return hess;
+    }
+
+    // Hessians for a batch of independent problems: the output leaf holds one value per batch element
+    // and every input leaf carries the batch along its leading dimension.
+    // Non-finite blocks are returned as is, so that the caller can mask them out per batch element.
+    // The chunk_size has the same meaning as for numerics::hessian.
+    inline TensorsOpt batched_hessian(const ADGraph &ad_graph, const uint32_t chunk_size = 0) {
+        const auto &value = std::get<OutputLeaf>(ad_graph);
+        if ((value.dim() != 1)) {
+            std::cerr << "Invalid arguments to noa::utils::numerics::batched_hessian : "
+                      << "expecting 1-dim tensor for output leaf in the AD graph\n";
+            return TensorsOpt{};
+        }
+
+        const auto &variables = std::get<InputLeaves>(ad_graph);
+        const auto gradients = torch::autograd::grad({value.sum()}, variables, {}, torch::nullopt, true);
+
+        auto hess = Tensors{};
+        const auto nvar = variables.size();
+        hess.reserve(nvar);
+
+        const auto nbatch = value.size(0);
+        for (uint32_t ivar = 0; ivar < nvar; ivar++) {
+            const auto variable = variables.at(ivar);
+            const auto n = variable.numel() / nbatch;
+            const auto res = value.new_zeros({nbatch, n, n});
+            const auto grad = gradients.at(ivar).reshape({nbatch, n});
+
+            const auto rows = chunk_size > 1 ? gradient_jacobian_triu(grad, variable, chunk_size) : TensorOpt{};
+            if (rows.has_value()) {
+                res.add_(rows.value());
+            } else {
+                for (int64_t j = 0; j < n; j++) {
+                    const auto grad_j = grad.select(1, j);
+                    const auto row = grad_j.requires_grad()
+                                     ? torch::autograd::grad({grad_j.sum()}, {variable}, {}, true, true,
+                                                             true)[0].reshape({nbatch, n}).slice(1, j, n)
+                                     : grad_j.new_zeros({nbatch, n - j});
+                    res.select(1, j).slice(1, j, n).add_(row);
+                }
+            }
+
+            hess.push_back(res + torch::triu(res, 1).transpose(1, 2));
+        }
+
+        return hess;
+    }
+
+    // Product of the Jacobian of the flat gradient w.r.t. the variable with a flat vector in one backward pass,
+    // i.e. a Hessian-vector product for a block of variables. The gradient is computed once by the caller
+    // (with create_graph), so that products can be taken repeatedly, e.g. by numerics::lanczos.
+    inline Tensor gradient_vector_product(const Tensor &flat_grad,
+                                          const Tensor &variable,
+                                          const Tensor &vector,
+                                          const bool create_graph = false) {
+        if (!flat_grad.requires_grad())
+            return vector.new_zeros({variable.numel()});
+        const auto product = torch::autograd::grad(
+                {flat_grad.dot(vector)}, {variable}, {}, true, create_graph, true).at(0);
+        return product.defined() ? product.flatten() : vector.new_zeros({variable.numel()});
+    }
+
+    // Hessian-vector product of a 0-dim output leaf with vectors shaped as the input leaves,
+    // cross terms between the leaves included, without forming the Hessian.
+    inline TensorsOpt hvp(const ADGraph &ad_graph, const Tensors &vectors, const bool create_graph = false) {
+        const auto &value = std::get<OutputLeaf>(ad_graph);
+        const auto &variables = std::get<InputLeaves>(ad_graph);
+        if (value.dim() > 0 || vectors.size() != variables.size()) {
+            std::cerr << "Invalid arguments to noa::utils::numerics::hvp : "
+                      << "expecting 0-dim tensor for output leaf in the AD graph and a vector per input leaf\n";
+            return TensorsOpt{};
+        }
+
+        const auto gradients = torch::autograd::grad({value}, variables, {}, true, true, true);
+        auto inner = Tensor{};
+        for (uint32_t i = 0; i < variables.size(); i++)
+            if (gradients.at(i).defined() && gradients.at(i).requires_grad()) {
+                const auto term = (gradients.at(i) * vectors.at(i)).sum();
+                inner = inner.defined() ? inner + term : term;
+            }
+
+        auto products = Tensors{};
+        products.reserve(variables.size());
+        if (!inner.defined()) {
+            for (const auto &variable : variables)
+                products.push_back(torch::zeros_like(variable));
+            return products;
+        }
+
+        const auto grads = torch::autograd::grad({inner}, variables, {}, true, create_graph, true);
+        for (uint32_t i = 0; i < variables.size(); i++)
+            products.push_back(grads.at(i).defined() ? grads.at(i) : torch::zeros_like(variables.at(i)));
+        return products;
+    }
+
+    // Jacobian-vector product of the output leaf (of any shape) with tangents shaped as the input leaves.
+    // The graph of an ADGraph is already recorded for reverse mode, so forward mode AD does not apply:
+    // the product is the derivative of the vector-Jacobian product <J^T u, t> w.r.t. the cotangent u
+    // (double backward), at the cost of two backward passes.
+    inline TensorOpt jvp(const ADGraph &ad_graph, const Tensors &tangents, const bool create_graph = false) {
+        const auto &value = std::get<OutputLeaf>(ad_graph);
+        const auto &variables = std::get<InputLeaves>(ad_graph);
+        if (tangents.size() != variables.size()) {
+            std::cerr << "Invalid arguments to noa::utils::numerics::jvp : "
+                      << "expecting a tangent per input leaf in the AD graph\n";
+            return TensorOpt{};
+        }
+        if (!value.requires_grad())
+            return torch::zeros_like(value);
+
+        const auto cotangent = torch::zeros_like(value).requires_grad_(true);
+        const auto vjps = torch::autograd::grad({value}, variables, {cotangent}, true, true, true);
+        auto inner = Tensor{};
+        for (uint32_t i = 0; i < variables.size(); i++)
+            if (vjps.at(i).defined() && vjps.at(i).requires_grad()) {
+                const auto term = (vjps.at(i) * tangents.at(i)).sum();
+                inner = inner.defined() ? inner + term : term;
+            }
+        if (!inner.defined())
+            return torch::zeros_like(value);
+
+        const auto product = torch::autograd::grad({inner}, {cotangent}, {}, true, create_graph, true).at(0);
+        return product.defined() ? product : torch::zeros_like(value);
+    }
+
+    // Jacobian of the flattened output leaf w.r.t. every input leaf, as [output numel, input numel] blocks.
+    // With chunk_size = 0 all rows come from a single batched backward pass, otherwise chunk_size rows at a time
+    // to bound memory, as for numerics::hessian.
+    inline Tensors jacobian(const ADGraph &ad_graph, const uint32_t chunk_size = 0, const bool create_graph = false) {
+        const auto value = std::get<OutputLeaf>(ad_graph).flatten();
+        const auto &variables = std::get<InputLeaves>(ad_graph);
+        const auto m = value.numel();
+
+        auto blocks = std::vector<Tensors>(variables.size());
+        if (value.requires_grad()) {
+            const int64_t chunk = chunk_size == 0 ? std::max<int64_t>(m, 1) : chunk_size;
+            for (int64_t begin = 0; begin < m; begin += chunk) {
+                const auto end = std::min(begin + chunk, m);
+                const auto rows = batched_vjp(
+                        {value}, variables, {identity_rows(begin, end, m, value.options())}, create_graph);
+                for (uint32_t i = 0; i < variables.size(); i++)
+                    blocks.at(i).push_back(rows.at(i).reshape({end - begin, variables.at(i).numel()}));
+            }
+        }
+
+        auto jac = Tensors{};
+        jac.reserve(variables.size());
+        for (uint32_t i = 0; i < variables.size(); i++)
+            jac.push_back(blocks.at(i).empty()
+                          ? value.new_zeros({m, variables.at(i).numel()})
+                          : torch::cat(blocks.at(i)));
+        return jac;
+    }
+
+    // Sparsity pattern of a symmetric n x n Hessian block, given as [2, nnz] COO indices as for torch::sparse_coo_tensor,
+    // with a partition of its columns into colours: columns of the same colour have no nonzero row in common,
+    // so that all of them are recovered from a single Hessian-vector product (Curtis, Powell & Reid, 1974).
+    struct HessianColouring {
+        Tensor indices;
+        Tensor colours;
+        int64_t num_colours;
+    };
+
+    // Greedy colouring of the columns of the pattern, completed to a symmetric pattern with a full diagonal.
+    inline HessianColouring hessian_colouring(const Tensor &pattern, const int64_t n) {
+        const auto pattern_cpu = pattern.to(torch::kCPU, torch::kInt64);
+        const auto diagonal = torch::arange(n, pattern_cpu.options()).unsqueeze(0).expand({2, n});
+        const auto symmetric = torch::cat({pattern_cpu, pattern_cpu.flip(0), diagonal}, 1);
+        const Tensor indices = torch::sparse_coo_tensor(
+                symmetric, torch::ones({symmetric.size(1)}, torch::kFloat32), {n, n}).coalesce().indices();
+
+        // the pattern being symmetric, the rows of column j are the columns of row j
+        const auto nnz = indices.size(1);
+        const auto index = indices.accessor<int64_t, 2>();
+        auto row_columns = std::vector<std::vector<int64_t>>(n);
+        for (int64_t k = 0; k < nnz; k++)
+            row_columns.at(index[0][k]).push_back(index[1][k]);
+
+        auto colours = std::vector<int64_t>(n, -1);
+        auto forbidden = std::vector<int64_t>(n, -1);
+        int64_t num_colours = 0;
+        for (int64_t j = 0; j < n; j++) {
+            for (const auto row : row_columns.at(j))
+                for (const auto column : row_columns.at(row))
+                    if (colours.at(column) >= 0)
+                        forbidden.at(colours.at(column)) = j;
+            int64_t colour = 0;
+            while (forbidden.at(colour) == j)
+                colour++;
+            colours.at(j) = colour;
+            num_colours = std::max(num_colours, colour + 1);
+        }
+
+        return HessianColouring{indices, torch::tensor(colours, torch::kInt64), num_colours};
+    }
+
+    // Pattern of a block diagonal Hessian with the given block sizes.
+    inline Tensor block_diagonal_pattern(const std::vector<int64_t> &block_sizes) {
+        auto blocks = Tensors{};
+        blocks.reserve(block_sizes.size());
+        int64_t offset = 0;
+        for (const auto size : block_sizes) {
+            const auto range = torch::arange(offset, offset + size, torch::kInt64);
+            blocks.push_back(torch::stack({range.repeat_interleave(size), range.repeat({size})}));
+            offset += size;
+        }
+        return torch::cat(blocks, 1);
+    }
+
+    // Pattern of every Hessian block detected from its dense evaluation at a representative point,
+    // entries of magnitude at most tolerance being dropped. The pattern has to hold wherever the
+    // Hessian is evaluated afterwards, structural zeros are safe while accidental ones are not.
+    inline TensorsOpt detect_hessian_pattern(const ADGraph &ad_graph,
+                                             const double tolerance = 0.,
+                                             const uint32_t chunk_size = 0) {
+        const auto hess = hessian(ad_graph, chunk_size);
+        if (!hess.has_value())
+            return TensorsOpt{};
+        auto patterns = Tensors{};
+        patterns.reserve(hess.value().size());
+        for (const auto &hess_i : hess.value())
+            patterns.push_back((hess_i.detach().abs() > tolerance).nonzero().t().to(torch::kCPU));
+        return patterns;
+    }
+
+    // Sparse COO Hessian blocks restricted to the colourings' patterns, from one Hessian-vector product
+    // per colour instead of one backward pass per row: all colours in a single batched backward pass
+    // with chunk_size = 0, otherwise chunk_size colours at a time. The blocks stay on the graph
+    // and check_finite has the same meaning as for numerics::hessian.
+    inline TensorsOpt sparse_hessian(const ADGraph &ad_graph,
+                                     const std::vector<HessianColouring> &colourings,
+                                     const uint32_t chunk_size = 0,
+                                     const bool check_finite = true) {
+        const auto &value = std::get<OutputLeaf>(ad_graph);
+        const auto &variables = std::get<InputLeaves>(ad_graph);
+        if (value.dim() > 0 || colourings.size() != variables.size()) {
+            std::cerr << "Invalid arguments to noa::utils::numerics::sparse_hessian : "
+                      << "expecting 0-dim tensor for output leaf in the AD graph and a colouring per input leaf\n";
+            return TensorsOpt{};
+        }
+
+        const auto gradients = torch::autograd::grad({value}, variables, {}, torch::nullopt, true);
+
+        auto hess = Tensors{};
+        const auto nvar = variables.size();
+        hess.reserve(nvar);
+
+        for (uint32_t ivar = 0; ivar < nvar; ivar++) {
+            const auto &variable = variables.at(ivar);
+            const auto &colouring = colourings.at(ivar);
+            const auto n = variable.numel();
+            const auto grad = gradients.at(ivar).flatten();
+            const auto num_colours = colouring.num_colours;
+
+            const auto colours = colouring.colours.to(grad.device());
+            const auto seeds = (colours.unsqueeze(0) == torch::arange(num_colours, colours.options()).unsqueeze(1))
+                    .to(grad.dtype());
+
+            auto products = grad.new_zeros({num_colours, n});
+            if (grad.requires_grad()) {
+                auto chunks = Tensors{};
+                const int64_t chunk = chunk_size == 0 ? std::max<int64_t>(num_colours, 1) : chunk_size;
+                for (int64_t begin = 0; begin < num_colours; begin += chunk) {
+                    const auto end = std::min(begin + chunk, num_colours);
+                    chunks.push_back(batched_vjp({grad}, {variable}, {seeds.slice(0, begin, end)}, true)
+                                             .at(0).reshape({end - begin, n}));
+                }
+                products = torch::cat(chunks);
             }
 
-            const auto check = torch::triu(res.detach()).sum();
-            if (torch::isnan(check).item<bool>() || torch::isinf(check).item<bool>())
-                return TensorsOpt{};
-            else
-                hess.push_back(res + torch::triu(res, 1).t());
+            // H_ij is the i-th entry of the product of the colour of column j
+            const auto indices = colouring.indices.to(grad.device());
+            const auto rows = indices[0];
+            const auto columns = indices[1];
+            const auto values = products.flatten().index_select(0, colours.index_select(0, columns) * n + rows);
+
+            if (check_finite) {
+                const auto check = values.detach().sum();
+                if (torch::isnan(check).item<bool>() || torch::isinf(check).item<bool>())
+                    return TensorsOpt{};
+            }
+            hess.push_back(torch::sparse_coo_tensor(indices, values, {n, n}));
         }
 
         return hess;
     }
 
+    // Ritz pairs of a symmetric operator, accessed only through matrix-vector products,
+    // from num_iterations Lanczos steps with full reorthogonalisation. Eigenvalues are in ascending order.
+    // When the Krylov space is exhausted (the residual falls below sqrt(epsilon) times the largest diagonal entry,
+    // e.g. for repeated eigenvalues) the iteration restarts from a fixed generic vector orthogonalised against
+    // the basis, so that the pairs stay deterministic and the basis orthonormal without synchronising with the host.
+    // The pairs are differentiable whenever the products are.
+    template<typename MatVec>
+    inline std::tuple<Tensor, Tensor> lanczos(const MatVec &matvec, const Tensor &start, const int64_t num_iterations) {
+        const auto n = start.numel();
+        const auto m = std::max<int64_t>(1, std::min(num_iterations, n));
+        const auto tolerance = std::sqrt(start.scalar_type() == torch::kFloat64
+                                         ? std::numeric_limits<double>::epsilon()
+                                         : static_cast<double>(std::numeric_limits<float>::epsilon()));
+
+        auto basis = Tensors{};
+        basis.reserve(m);
+        auto alphas = Tensors{};
+        alphas.reserve(m);
+        auto betas = Tensors{};
+        betas.reserve(m);
+
+        const auto orthogonalise = [](const Tensor &Q, Tensor v) {
+            // twice is enough to keep the basis orthogonal in floating point
+            v = v - Q.mv(Q.t().mv(v));
+            return v - Q.mv(Q.t().mv(v));
+        };
+
+        auto q = start / start.norm();
+        auto scale = torch::zeros({}, start.options());
+        for (int64_t j = 0; j < m; j++) {
+            basis.push_back(q);
+            const auto w = matvec(q);
+            const auto alpha = w.dot(q);
+            alphas.push_back(alpha);
+            scale = torch::maximum(scale, alpha.detach().abs());
+            if (j + 1 < m) {
+                const auto Q = torch::stack(basis, 1);
+                const auto residual = orthogonalise(Q, w);
+                const auto beta = residual.norm();
+                const auto breakdown = beta.detach() <= tolerance * scale;
+
+                // entries sin(k * sqrt(2) * (j + 1)) do not align with coordinates or their permutations
+                const auto generic = torch::sin(torch::arange(1, n + 1, start.options()) *
+                                                (std::sqrt(2.) * static_cast<double>(j + 1)));
+                const auto restart = orthogonalise(Q.detach(), generic);
+
+                betas.push_back(torch::where(breakdown, torch::zeros_like(beta), beta));
+                q = torch::where(breakdown, restart / restart.norm(), residual / beta.clamp_min(1e-20));
+            }
+        }
+
+        auto tridiagonal = torch::diag(torch::stack(alphas));
+        if (!betas.empty()) {
+            const auto off_diagonal = torch::stack(betas);
+            tridiagonal = tridiagonal + torch::diag(off_diagonal, 1) + torch::diag(off_diagonal, -1);
+        }
+        const auto[eigs, W] = torch::linalg::eigh(tridiagonal, "L");
+        return std::make_tuple(eigs, torch::stack(basis, 1).mm(W));
+    }
+
     // https://pomax.github.io/bezierinfo/legendre-gauss.html
     template<typename Dtype, typename Function>
     inline Dtype legendre_gaussian_quadrature(const Dtype &lower_bound,
@@ -217,6 +679,8 @@ namespace noa::utils::numerics {
         return std::nullopt;
     }
 
+    // The inner factory takes the likelihood scale, e.g. dataset size over batch size
+    // for an unbiased estimate of the log probability over minibatches.
     template<typename Dtype, typename Net>
     inline auto regression_log_probability(
             Net &net,
@@ -226,8 +690,8 @@ namespace noa::utils::numerics {
         const auto tau_out = 1 / model_variance;
         const auto tau_in = 1 / params_variance;
         return [&net, params_mean, tau_out, tau_in](
-                const Tensor &x_train, const Tensor &y_train) {
-            return [&net, params_mean, tau_out, tau_in, x_train, y_train]
+                const Tensor &x_train, const Tensor &y_train, const Dtype &likelihood_scale = 1) {
+            return [&net, params_mean, tau_out, tau_in, x_train, y_train, likelihood_scale]
                     (const Tensors &theta) {
                 uint32_t i = 0;
                 auto log_prob = torch::tensor(0, y_train.options());
@@ -237,7 +701,7 @@ namespace noa::utils::numerics {
                     i++;
                 }
                 const auto output = net({x_train}).toTensor();
-                log_prob = -tau_out * (y_train - output).pow(2).sum() / 2 - tau_in * log_prob / 2;
+                log_prob = -likelihood_scale * tau_out * (y_train - output).pow(2).sum() / 2 - tau_in * log_prob / 2;
                 return ADGraph{log_prob, parameters(net)};
             };
         };
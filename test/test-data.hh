@@ -58,6 +58,17 @@ inline const auto log_funnel = [](const Parameters &theta_)
     return LogProbabilityGraph{log_prob, {theta}};
 };
 
+inline const auto batched_log_funnel = [](const Parameters &theta_)
+{
+    const auto theta = theta_.at(0).detach().requires_grad_(true);
+    const auto dim = theta.size(1) - 1;
+    const auto theta0 = theta.select(1, 0);
+    const auto log_prob = -((torch::exp(theta0) * theta.slice(1, 1, dim + 1).pow(2).sum(1)) +
+                            (theta0.pow(2) / 9) - dim * theta0) /
+                          2;
+    return LogProbabilityGraph{log_prob, {theta}};
+};
+
 inline const auto conf_funnel = Configuration<float>{}
                                     .set_max_flow_steps(1)
                                     .set_step_size(0.14f)
@@ -7,6 +7,18 @@ TEST(GHMC, FunnelHessianCUDA)
     test_funnel_hessian(torch::kCUDA);
 }
 
+TEST(GHMC, FunnelHessianChunksCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_funnel_hessian_chunks(torch::kCUDA);
+}
+
+TEST(GHMC, DerivativeProductsCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_derivative_products(torch::kCUDA);
+}
+
 TEST(GHMC, SoftAbsMetricCUDA)
 {
     ASSERT_TRUE(torch::cuda::is_available());
@@ -24,3 +36,135 @@ TEST(GHMC, HamiltonianFlowCUDA)
     ASSERT_TRUE(torch::cuda::is_available());
     test_hamiltonian_flow(torch::kCUDA);
 }
+
+TEST(GHMC, BatchedHamiltonianCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_batched_hamiltonian(torch::kCUDA);
+}
+
+TEST(GHMC, BatchedHamiltonianFlowCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_batched_hamiltonian_flow(torch::kCUDA);
+}
+
+TEST(GHMC, BatchedSamplerCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_batched_sampler(torch::kCUDA);
+}
+
+TEST(GHMC, SampleSinksCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_sample_sinks(torch::kCUDA);
+}
+
+TEST(GHMC, DeferredHamiltonianFlowCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_deferred_hamiltonian_flow(torch::kCUDA);
+}
+
+TEST(GHMC, EuclideanMetricsCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_euclidean_metrics(torch::kCUDA);
+}
+
+TEST(GHMC, NUTSSamplerCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_nuts_sampler(torch::kCUDA);
+}
+
+TEST(GHMC, WarmupAdaptationCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_warmup_adaptation(torch::kCUDA);
+}
+
+TEST(GHMC, RiemannianGeometryReuseCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_riemannian_geometry_reuse(torch::kCUDA);
+}
+
+TEST(GHMC, OnlineDiagnosticsCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_online_diagnostics(torch::kCUDA);
+}
+
+TEST(GHMC, JitLogProbabilityCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_jit_log_probability(torch::kCUDA);
+}
+
+TEST(GHMC, SGHMCMinibatchesCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_sghmc_minibatches(torch::kCUDA);
+}
+
+TEST(GHMC, EndpointFlowCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_endpoint_flow(torch::kCUDA);
+}
+
+TEST(GHMC, MixedPrecisionCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_mixed_precision(torch::kCUDA);
+}
+
+TEST(GHMC, ReplicaExchangeCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_replica_exchange(torch::kCUDA);
+}
+
+TEST(GHMC, FisherMetricCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_fisher_metric(torch::kCUDA);
+}
+
+TEST(GHMC, LanczosSoftAbsMetricCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_lanczos_softabs_metric(torch::kCUDA);
+}
+
+TEST(GHMC, SamplerStatisticsCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_sampler_statistics(torch::kCUDA);
+}
+
+TEST(GHMC, CheckpointResumeCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_checkpoint_resume(torch::kCUDA);
+}
+
+TEST(GHMC, VariationalWarmStartCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_variational_warm_start(torch::kCUDA);
+}
+
+TEST(GHMC, SpeculativeSamplerCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_speculative_sampler(torch::kCUDA);
+}
+
+TEST(GHMC, SparseHessianCUDA)
+{
+    ASSERT_TRUE(torch::cuda::is_available());
+    test_sparse_hessian(torch::kCUDA);
+}
@@ -6,6 +6,16 @@ TEST(GHMC, FunnelHessian)
     test_funnel_hessian();
 }
 
+TEST(GHMC, FunnelHessianChunks)
+{
+    test_funnel_hessian_chunks();
+}
+
+TEST(GHMC, DerivativeProducts)
+{
+    test_derivative_products();
+}
+
 TEST(GHMC, SoftAbsMetric)
 {
     test_softabs_metric();
@@ -20,3 +30,123 @@ TEST(GHMC, HamiltonianFlow)
 {
     test_hamiltonian_flow();
 }
+
+TEST(GHMC, BatchedHamiltonian)
+{
+    test_batched_hamiltonian();
+}
+
+TEST(GHMC, BatchedHamiltonianFlow)
+{
+    test_batched_hamiltonian_flow();
+}
+
+TEST(GHMC, BatchedSampler)
+{
+    test_batched_sampler();
+}
+
+TEST(GHMC, ParallelSampler)
+{
+    test_parallel_sampler();
+}
+
+TEST(GHMC, SampleSinks)
+{
+    test_sample_sinks();
+}
+
+TEST(GHMC, DeferredHamiltonianFlow)
+{
+    test_deferred_hamiltonian_flow();
+}
+
+TEST(GHMC, EuclideanMetrics)
+{
+    test_euclidean_metrics();
+}
+
+TEST(GHMC, NUTSSampler)
+{
+    test_nuts_sampler();
+}
+
+TEST(GHMC, WarmupAdaptation)
+{
+    test_warmup_adaptation();
+}
+
+TEST(GHMC, RiemannianGeometryReuse)
+{
+    test_riemannian_geometry_reuse();
+}
+
+TEST(GHMC, OnlineDiagnostics)
+{
+    test_online_diagnostics();
+}
+
+TEST(GHMC, JitLogProbability)
+{
+    test_jit_log_probability();
+}
+
+TEST(GHMC, SGHMCMinibatches)
+{
+    test_sghmc_minibatches();
+}
+
+TEST(GHMC, EndpointFlow)
+{
+    test_endpoint_flow();
+}
+
+TEST(GHMC, MixedPrecision)
+{
+    test_mixed_precision();
+}
+
+TEST(GHMC, ReplicaExchange)
+{
+    test_replica_exchange();
+}
+
+TEST(GHMC, FisherMetric)
+{
+    test_fisher_metric();
+}
+
+TEST(GHMC, LanczosSoftAbsMetric)
+{
+    test_lanczos_softabs_metric();
+}
+
+TEST(GHMC, FixedSizeSampler)
+{
+    test_fixed_size_sampler();
+}
+
+TEST(GHMC, SamplerStatistics)
+{
+    test_sampler_statistics();
+}
+
+TEST(GHMC, CheckpointResume)
+{
+    test_checkpoint_resume();
+}
+
+TEST(GHMC, VariationalWarmStart)
+{
+    test_variational_warm_start();
+}
+
+TEST(GHMC, SpeculativeSampler)
+{
+    test_speculative_sampler();
+}
+
+TEST(GHMC, SparseHessian)
+{
+    test_sparse_hessian();
+}
@@ -3,6 +3,21 @@
 #include "test-data.hh"
 
 #include <noa/ghmc.hh>
+#include <noa/ghmc/advi.hh>
+#include <noa/ghmc/adaptation.hh>
+#include <noa/ghmc/batched.hh>
+#include <noa/ghmc/checkpoint.hh>
+#include <noa/ghmc/diagnostics.hh>
+#include <noa/ghmc/fisher.hh>
+#include <noa/ghmc/fixed.hh>
+#include <noa/ghmc/jit.hh>
+#include <noa/ghmc/lanczos.hh>
+#include <noa/ghmc/nuts.hh>
+#include <noa/ghmc/parallel.hh>
+#include <noa/ghmc/sghmc.hh>
+#include <noa/ghmc/sinks.hh>
+#include <noa/ghmc/speculative.hh>
+#include <noa/ghmc/tempering.hh>
 #include <noa/utils/common.hh>
 
 #include <gtest/gtest.h>
@@ -12,10 +27,11 @@ using namespace noa::ghmc;
 using namespace noa::utils;
 
 
-inline TensorsOpt get_funnel_hessian(const torch::Tensor &theta_, torch::DeviceType device) {
+inline TensorsOpt get_funnel_hessian(const torch::Tensor &theta_, torch::DeviceType device,
+                                     const uint32_t chunk_size = 0) {
     torch::manual_seed(utils::SEED);
     const auto log_prob_graph = log_funnel({theta_.to(device, false, true)});
-    return numerics::hessian(log_prob_graph);
+    return numerics::hessian(log_prob_graph, chunk_size);
 }
 
 inline void test_funnel_hessian(torch::DeviceType device = torch::kCPU) {
@@ -31,6 +47,67 @@ inline void test_funnel_hessian(torch::DeviceType device = torch::kCPU) {
     ASSERT_NEAR(err, 0.f, 1e-3f);
 }
 
+inline void test_funnel_hessian_chunks(torch::DeviceType device = torch::kCPU) {
+    for (const uint32_t chunk_size: {1, 2, 0, 64}) {
+        const auto hess_ = get_funnel_hessian(GHMCData::get_theta(), device, chunk_size);
+
+        ASSERT_TRUE(hess_.has_value());
+        const auto res = hess_.value().at(0).detach().to(torch::kCPU);
+
+        const auto err = (res + GHMCData::get_neg_hessian_funnel()).abs().sum().item<float>();
+        ASSERT_NEAR(err, 0.f, 1e-3f);
+    }
+}
+
+inline void test_derivative_products(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto neg_hessian = GHMCData::get_neg_hessian_funnel().to(device);
+    const auto v = torch::randn_like(theta);
+
+    const auto hvp = numerics::hvp(log_funnel(Parameters{theta}), {v});
+    ASSERT_TRUE(hvp.has_value());
+    ASSERT_TRUE(torch::allclose(hvp.value().at(0), -neg_hessian.mv(v), 1e-3, 1e-3));
+
+    const auto funnel_graph = log_funnel(Parameters{theta});
+    const auto &params = std::get<Parameters>(funnel_graph);
+    const auto grad = torch::autograd::grad({std::get<LogProbability>(funnel_graph)}, params, {}, true, true).at(0);
+    ASSERT_TRUE(torch::allclose(numerics::gradient_vector_product(grad, params.at(0), v), -neg_hessian.mv(v), 1e-3, 1e-3));
+
+    // chunks are seeded by rows of the identity
+    ASSERT_TRUE(torch::equal(numerics::identity_rows(2, 5, 7, theta.options()),
+                             torch::eye(7, theta.options()).slice(0, 2, 5)));
+
+    // the Jacobian of the gradient is the Hessian
+    const auto gradient_graph = ADGraph{grad, params};
+    for (const uint32_t chunk_size : {1, 3, 0}) {
+        const auto jacobian = numerics::jacobian(gradient_graph, chunk_size);
+        ASSERT_EQ(jacobian.size(), 1);
+        ASSERT_TRUE(torch::allclose(jacobian.at(0), -neg_hessian, 1e-3, 1e-3));
+    }
+    const auto jvp = numerics::jvp(gradient_graph, {v});
+    ASSERT_TRUE(jvp.has_value());
+    ASSERT_TRUE(torch::allclose(jvp.value(), -neg_hessian.mv(v), 1e-3, 1e-3));
+
+    // cross terms between input leaves
+    const auto a = torch::randn(3, theta.options()).requires_grad_(true);
+    const auto b = torch::randn(4, theta.options()).requires_grad_(true);
+    const auto value = (a.sum() * b.pow(2).sum()).pow(2);
+    const auto grads = torch::autograd::grad({value}, {a, b}, {}, true, true);
+    const auto blocks = numerics::jacobian(ADGraph{torch::cat({grads.at(0), grads.at(1)}), {a, b}});
+    const auto hessian = torch::cat({blocks.at(0), blocks.at(1)}, 1);
+    const auto va = torch::randn_like(a);
+    const auto vb = torch::randn_like(b);
+    const auto products = numerics::hvp(ADGraph{value, {a, b}}, {va, vb});
+    ASSERT_TRUE(products.has_value());
+    ASSERT_TRUE(torch::allclose(torch::cat(products.value()), hessian.mv(torch::cat({va, vb})), 1e-3, 1e-3));
+    const auto tangent_product = numerics::jvp(ADGraph{value, {a, b}}, {va, vb});
+    ASSERT_TRUE(tangent_product.has_value());
+    ASSERT_TRUE(torch::allclose(tangent_product.value(), torch::cat(grads).dot(torch::cat({va, vb})), 1e-3, 1e-3));
+
+    ASSERT_FALSE(numerics::hvp(gradient_graph, {v}).has_value());
+}
+
 inline MetricDecompositionOpt get_softabs_metric(const torch::Tensor &theta_, torch::DeviceType device) {
     torch::manual_seed(utils::SEED);
     const auto log_prob_graph = log_funnel(Parameters{theta_.to(device, false, true)});
@@ -79,21 +156,23 @@ inline void test_hamiltonian(torch::DeviceType device = torch::kCPU) {
 inline HamiltonianFlow get_hamiltonian_flow(
         const torch::Tensor &theta_,
         const torch::Tensor &momentum_,
-        torch::DeviceType device) {
+        torch::DeviceType device,
+        const Configuration<float> &conf = conf_funnel) {
     torch::manual_seed(utils::SEED);
     return riemannian_dynamics(
             log_funnel,
-            softabs_metric(conf_funnel),
+            softabs_metric(conf),
             metropolis_criterion,
-            conf_funnel)(
+            conf)(
             Parameters{theta_.to(device, false, true)},
             Momentum{momentum_.to(device, false, true)});
 }
 
-inline void test_hamiltonian_flow(torch::DeviceType device = torch::kCPU) {
+inline void test_hamiltonian_flow(torch::DeviceType device = torch::kCPU,
+                                  const Configuration<float> &conf = conf_funnel) {
 
     const auto[theta_flow, momentum_flow, energy] =
-    get_hamiltonian_flow(GHMCData::get_theta(), GHMCData::get_momentum(), device);
+    get_hamiltonian_flow(GHMCData::get_theta(), GHMCData::get_momentum(), device, conf);
 
     ASSERT_TRUE(theta_flow.size() == 2);
     ASSERT_TRUE(momentum_flow.size() == 2);
@@ -111,3 +190,1180 @@ inline void test_hamiltonian_flow(torch::DeviceType device = torch::kCPU) {
     err = (momentum_proposal - GHMCData::get_expected_flow_moment()).abs().sum().item<float>();
     ASSERT_NEAR(err, 0., 1e-2);
 }
+
+inline PhaseSpaceFoliationOpt get_batched_hamiltonian(
+        const torch::Tensor &theta_,
+        const torch::Tensor &momentum_,
+        int64_t nchains,
+        torch::DeviceType device) {
+    torch::manual_seed(utils::SEED);
+    const auto theta = theta_.view({1, -1}).repeat({nchains, 1});
+    const auto momentum = momentum_.view({1, -1}).repeat({nchains, 1});
+    return batched_riemannian_hamiltonian(batched_log_funnel,
+                                          batched_softabs_metric(conf_funnel),
+                                          conf_funnel)(Parameters{theta.to(device, false, true)},
+                                                       Momentum{momentum.to(device, false, true)});
+}
+
+inline void test_batched_hamiltonian(torch::DeviceType device = torch::kCPU) {
+    const auto nchains = 3;
+    const auto ham_ = get_batched_hamiltonian(GHMCData::get_theta(), GHMCData::get_momentum(), nchains, device);
+    ASSERT_TRUE(ham_.has_value());
+    const auto &energy_ = std::get<Energy>(ham_.value());
+    ASSERT_TRUE(energy_.device().type() == device);
+    ASSERT_EQ(energy_.size(0), nchains);
+    const auto energy = energy_.detach().to(torch::kCPU, false, true);
+    const auto err = (energy - GHMCData::get_expected_energy()).abs().max().item<float>();
+    ASSERT_NEAR(err, 0., 1e-3);
+}
+
+inline HamiltonianFlow get_batched_hamiltonian_flow(
+        const torch::Tensor &theta_,
+        const torch::Tensor &momentum_,
+        int64_t nchains,
+        torch::DeviceType device) {
+    torch::manual_seed(utils::SEED);
+    const auto theta = theta_.view({1, -1}).repeat({nchains, 1});
+    const auto momentum = momentum_.view({1, -1}).repeat({nchains, 1});
+    return batched_riemannian_dynamics(
+            batched_log_funnel,
+            batched_softabs_metric(conf_funnel),
+            batched_metropolis_criterion,
+            conf_funnel)(
+            Parameters{theta.to(device, false, true)},
+            Momentum{momentum.to(device, false, true)});
+}
+
+inline void test_batched_hamiltonian_flow(torch::DeviceType device = torch::kCPU) {
+    const auto nchains = 3;
+    const auto[theta_flow, momentum_flow, energy] =
+    get_batched_hamiltonian_flow(GHMCData::get_theta(), GHMCData::get_momentum(), nchains, device);
+
+    ASSERT_TRUE(theta_flow.size() == 2);
+    ASSERT_TRUE(momentum_flow.size() == 2);
+    ASSERT_TRUE(energy.size() == 2);
+
+    ASSERT_TRUE(theta_flow.at(1).at(0).device().type() == device);
+    ASSERT_EQ(energy.at(1).size(0), nchains);
+
+    const auto theta_proposal = theta_flow.at(1).at(0).to(torch::kCPU, false, true);
+    const auto expected_theta = GHMCData::get_expected_flow_theta().view({1, -1});
+    auto err = (theta_proposal - expected_theta).abs().sum(1).max().item<float>();
+    ASSERT_NEAR(err, 0., 1e-3);
+
+    const auto momentum_proposal = momentum_flow.at(1).at(0).to(torch::kCPU, false, true);
+    const auto expected_momentum = GHMCData::get_expected_flow_moment().view({1, -1});
+    err = (momentum_proposal - expected_momentum).abs().sum(1).max().item<float>();
+    ASSERT_NEAR(err, 0., 1e-2);
+}
+
+inline void test_batched_sampler(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto nchains = 3;
+    const auto conf = Configuration<float>{}
+            .set_max_flow_steps(5)
+            .set_step_size(0.5f);
+    const auto theta = GHMCData::get_theta().view({1, -1}).repeat({nchains, 1}).to(device, false, true);
+    const auto dynamics = batched_euclidean_dynamics(
+            batched_log_funnel,
+            identity_metric_like(Parameters{GHMCData::get_theta().to(device, false, true)}),
+            batched_metropolis_criterion, conf);
+
+    // the generic sampler drives the chains in lockstep
+    const auto samples = sampler(dynamics, full_trajectory, conf)(Parameters{theta}, 2);
+    ASSERT_TRUE(samples.size() > 1);
+    for (const auto &sample : samples) {
+        ASSERT_EQ(sample.at(0).size(0), nchains);
+        ASSERT_TRUE(sample.at(0).device().type() == device);
+    }
+
+    // every chain follows its own trajectory up to its length
+    torch::manual_seed(utils::SEED);
+    const BatchedHamiltonianFlow flow = dynamics(Parameters{theta});
+    const auto &params_flow = std::get<0>(flow);
+    const utils::Tensor lengths = flow.lengths.to(torch::kCPU);
+    ASSERT_EQ(lengths.size(0), nchains);
+
+    torch::manual_seed(utils::SEED);
+    const auto chains = batched_sampler(dynamics, conf)(Parameters{theta}, 1);
+    ASSERT_EQ(chains.size(), nchains);
+    for (int64_t chain = 0; chain < nchains; chain++) {
+        const auto length = lengths[chain].item<int64_t>();
+        ASSERT_TRUE(length >= 1 && length <= static_cast<int64_t>(params_flow.size()));
+        ASSERT_EQ(static_cast<int64_t>(chains.at(chain).size()), length);
+        for (int64_t point = 0; point < length; point++) {
+            const auto err = (chains.at(chain).at(point).at(0) - params_flow.at(point).at(0).select(0, chain))
+                    .abs().max().item<float>();
+            ASSERT_NEAR(err, 0., 1e-6);
+        }
+        // frozen entries repeat the last state of a stopped chain
+        for (auto point = length; point < static_cast<int64_t>(params_flow.size()); point++) {
+            const auto err = (params_flow.at(point).at(0).select(0, chain) -
+                              params_flow.at(length - 1).at(0).select(0, chain)).abs().max().item<float>();
+            ASSERT_NEAR(err, 0., 1e-6);
+        }
+    }
+}
+
+inline auto get_parallel_sampler(const uint32_t num_threads, torch::DeviceType device) {
+    const auto conf = Configuration<float>{}
+            .set_max_flow_steps(3)
+            .set_step_size(0.05f);
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto ham_dym = euclidean_dynamics(
+            log_funnel, identity_diagonal_metric_like(Parameters{theta}), metropolis_criterion, conf);
+    return parallel_sampler(
+            sampler(ham_dym, full_trajectory, conf),
+            ParallelConfiguration{}.set_num_threads(num_threads).set_intra_op_threads(1));
+}
+
+inline ChainsSamples get_parallel_samples(const uint32_t num_threads, torch::DeviceType device) {
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    return get_parallel_sampler(num_threads, device)(ChainsParameters(3, Parameters{theta}), 5);
+}
+
+inline void test_parallel_sampler(torch::DeviceType device = torch::kCPU) {
+    const auto intra_op_threads = torch::get_num_threads();
+    const auto samples_serial = get_parallel_samples(1, device);
+    const auto samples_parallel = get_parallel_samples(3, device);
+    ASSERT_EQ(torch::get_num_threads(), intra_op_threads);
+
+    ASSERT_EQ(samples_serial.size(), 3);
+    ASSERT_EQ(samples_parallel.size(), 3);
+
+    // the pool of the sampler is reused across calls
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto chains_sampler = get_parallel_sampler(3, device);
+    const auto samples_first = chains_sampler(ChainsParameters(3, Parameters{theta}), 5);
+    const auto samples_second = chains_sampler(ChainsParameters(3, Parameters{theta}), 5);
+
+    for (uint32_t chain = 0; chain < 3; chain++) {
+        ASSERT_TRUE(samples_serial.at(chain).size() > 1);
+        const auto serial = stack(samples_serial.at(chain));
+        const auto parallel = stack(samples_parallel.at(chain));
+        ASSERT_TRUE(serial.device().type() == device);
+        ASSERT_TRUE(torch::equal(serial, parallel));
+        ASSERT_TRUE(torch::equal(stack(samples_first.at(chain)), stack(samples_second.at(chain))));
+    }
+
+    // a failing chain is rethrown once all the chains are done
+    auto num_done = std::atomic<uint32_t>{0};
+    const auto failing_chains = [&num_done](const uint32_t chain) {
+        if (chain == 0)
+            throw std::runtime_error("failing chain");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return ++num_done;
+    };
+    ASSERT_THROW(run_chains(failing_chains, 4, ParallelConfiguration{}.set_num_threads(2)), std::runtime_error);
+    ASSERT_EQ(num_done.load(), 3);
+    ASSERT_EQ(torch::get_num_threads(), intra_op_threads);
+
+    const auto first_chain = stack(samples_serial.at(0));
+    const auto second_chain = stack(samples_serial.at(1));
+    ASSERT_FALSE(torch::equal(first_chain, second_chain));
+}
+
+inline void test_sample_sinks(torch::DeviceType device = torch::kCPU) {
+    const auto conf = Configuration<float>{}
+            .set_max_flow_steps(3)
+            .set_step_size(0.05f);
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto ham_dym = euclidean_dynamics(
+            log_funnel, identity_diagonal_metric_like(Parameters{theta}), metropolis_criterion, conf);
+
+    torch::manual_seed(utils::SEED);
+    const auto expected = stack(sampler(ham_dym, full_trajectory, conf)(Parameters{theta}, 10));
+    const auto num_samples = expected.size(0);
+    ASSERT_TRUE(num_samples > 6);
+
+    const auto samples_path = std::filesystem::temp_directory_path() / "noa-ghmc-samples.bin";
+    auto ring_buffer = RingBufferSink{4, Parameters{theta}};
+    auto moments = RunningMomentsSink{};
+    auto variance = RunningVarianceSink{};
+    {
+        auto file_sink = ChunkedFileSink{samples_path, 3, Parameters{theta}};
+        auto thinned = burn_in_thinning(std::ref(moments), 2, 2);
+
+        torch::manual_seed(utils::SEED);
+        sink_sampler(ham_dym, full_trajectory)(Parameters{theta}, 10, [&](const Parameters &sample) {
+            return ring_buffer(sample) && thinned(sample) && variance(sample) && file_sink(sample);
+        });
+    }
+
+    ASSERT_EQ(ring_buffer.count, num_samples);
+    ASSERT_TRUE(torch::equal(ring_buffer.samples(), expected.slice(0, num_samples - 4)));
+
+    const auto thinned_expected = expected.slice(0, 2, num_samples, 2).to(torch::kFloat64);
+    ASSERT_EQ(moments.count, thinned_expected.size(0));
+    ASSERT_TRUE(torch::allclose(moments.mean(), thinned_expected.mean(0)));
+    const auto centered = thinned_expected - thinned_expected.mean(0);
+    const auto covariance = centered.t().mm(centered) / (thinned_expected.size(0) - 1);
+    ASSERT_TRUE(torch::allclose(moments.covariance(), covariance));
+    const auto all_expected = expected.to(torch::kFloat64);
+    ASSERT_EQ(variance.count, num_samples);
+    ASSERT_TRUE(torch::allclose(variance.mean(), all_expected.mean(0)));
+    ASSERT_TRUE(torch::allclose(variance.variance(), all_expected.var(0)));
+
+    const auto from_file = load_chunked_samples(samples_path, expected.size(1), torch::kFloat32);
+    std::filesystem::remove(samples_path);
+    ASSERT_TRUE(from_file.has_value());
+    ASSERT_TRUE(torch::equal(from_file.value(), expected.to(torch::kCPU)));
+}
+
+inline void test_deferred_hamiltonian_flow(torch::DeviceType device = torch::kCPU) {
+    test_hamiltonian_flow(device, Configuration<float>{conf_funnel}.set_host_sync(false));
+
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(3)
+            .set_host_sync(false);
+    const auto broken_funnel = [](const Parameters &theta) {
+        const auto[log_prob, params] = log_funnel(theta);
+        return LogProbabilityGraph{log_prob * NAN, params};
+    };
+
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto momentum = GHMCData::get_momentum().to(device, false, true);
+    const auto[theta_flow, momentum_flow, energy] = riemannian_dynamics(
+            broken_funnel,
+            softabs_metric(conf),
+            deferred_metropolis_criterion,
+            conf)(Parameters{theta}, Momentum{momentum});
+
+    ASSERT_TRUE(theta_flow.empty());
+    ASSERT_TRUE(momentum_flow.empty());
+    ASSERT_TRUE(energy.empty());
+}
+
+template<typename ConstantMetric>
+inline HamiltonianFlow get_euclidean_flow(const ConstantMetric &metric, torch::DeviceType device) {
+    const auto conf = Configuration<float>{}
+            .set_max_flow_steps(3)
+            .set_step_size(0.05f);
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+    return euclidean_dynamics(log_funnel, metric, accept, conf)(
+            Parameters{GHMCData::get_theta().to(device, false, true)},
+            Momentum{GHMCData::get_momentum().to(device, false, true)});
+}
+
+inline void test_euclidean_metrics(torch::DeviceType device = torch::kCPU) {
+    const auto n = GHMCData::get_theta().numel();
+    const auto diagonal = torch::linspace(0.5, 2., n, torch::dtype(torch::kFloat32).device(device));
+
+    const auto dense_flow = get_euclidean_flow(
+            MetricDecomposition{Spectrum{diagonal}, Rotation{torch::eye(n, diagonal.options())}}, device);
+    const auto diagonal_flow = get_euclidean_flow(DiagonalMetric{Spectrum{diagonal}}, device);
+    const auto cholesky_flow = get_euclidean_flow(CholeskyMetric{utils::Tensors{torch::diag(diagonal.sqrt())}}, device);
+
+    const auto &dense_params = std::get<0>(dense_flow);
+    ASSERT_EQ(dense_params.size(), 4);
+    ASSERT_EQ(std::get<0>(diagonal_flow).size(), 4);
+    ASSERT_EQ(std::get<0>(cholesky_flow).size(), 4);
+
+    const auto expected_params = stack(dense_params);
+    const auto expected_energy = torch::stack(std::get<EnergyLevel>(dense_flow));
+    for (const auto &flow : {diagonal_flow, cholesky_flow}) {
+        const auto params = stack(std::get<0>(flow));
+        ASSERT_TRUE(params.device().type() == device);
+        ASSERT_TRUE(torch::allclose(params, expected_params, 1e-4, 1e-5));
+        ASSERT_TRUE(torch::allclose(torch::stack(std::get<EnergyLevel>(flow)), expected_energy, 1e-4, 1e-5));
+    }
+}
+
+inline void test_nuts_sampler(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto conf = Configuration<float>{}
+            .set_step_size(0.5f)
+            .set_max_tree_depth(6);
+    const auto log_normal = [](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{-theta.pow(2).sum() / 2, {theta}};
+    };
+    const auto initial = Parameters{torch::zeros(2, torch::dtype(torch::kFloat32).device(device))};
+
+    auto transitions = std::vector<NUTSTransition>{};
+    const auto nuts = nuts_dynamics(log_normal, identity_diagonal_metric_like(initial), conf,
+                                    [&transitions](const NUTSTransition &transition) {
+                                        transitions.push_back(transition);
+                                    });
+    const auto num_iterations = 500;
+    const auto samples = stack(sampler(nuts, end_of_trajectory, conf)(initial, num_iterations));
+
+    ASSERT_EQ(samples.size(0), num_iterations + 1);
+    ASSERT_TRUE(samples.device().type() == device);
+    ASSERT_EQ(transitions.size(), num_iterations);
+    for (const auto &transition : transitions) {
+        ASSERT_TRUE(transition.tree_depth >= 1 && transition.tree_depth <= 6);
+        ASSERT_TRUE(transition.gradient_evaluations >= 2);
+        ASSERT_TRUE(transition.gradient_evaluations <= (1u << transition.tree_depth));
+        ASSERT_FALSE(transition.divergent);
+    }
+
+    const auto mean = samples.mean(0).abs().max().item<float>();
+    const auto variance = (samples.var(0) - 1).abs().max().item<float>();
+    ASSERT_NEAR(mean, 0.f, 0.2f);
+    ASSERT_NEAR(variance, 0.f, 0.3f);
+}
+
+inline void test_warmup_adaptation(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto conf = Configuration<float>{}
+            .set_max_flow_steps(10)
+            .set_step_size(1.f);
+    const auto scale = torch::tensor({1.f, 10.f}, torch::dtype(torch::kFloat32).device(device));
+    const auto log_normal = [scale](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{-(theta / scale).pow(2).sum() / 2, {theta}};
+    };
+    const auto make_dynamics = [log_normal](const Configuration<float> &conf_, const DiagonalMetric &metric) {
+        return euclidean_dynamics(log_normal, metric, metropolis_criterion, conf_);
+    };
+
+    const auto adapted = warmup(make_dynamics, Parameters{torch::ones(2, scale.options())}, 400, conf);
+
+    ASSERT_TRUE(std::isfinite(adapted.conf.step_size));
+    ASSERT_TRUE(adapted.conf.step_size > 0.f);
+    ASSERT_EQ(adapted.parameters.size(), 1);
+
+    const auto &diagonal = adapted.metric.diagonal.at(0);
+    ASSERT_TRUE(diagonal.device().type() == device);
+    ASSERT_TRUE(diagonal.dtype() == torch::kFloat32);
+    const auto ratio = (diagonal[1] / diagonal[0]).item<float>();
+    ASSERT_TRUE(ratio > 0.002f && ratio < 0.05f);
+
+    // a short warm-up shrinks the buffers, the slow window starts after the shrunk initial buffer
+    const auto adapt_conf = AdaptationConfiguration{};
+    const auto buffers = adaptation_buffers(100, adapt_conf);
+    ASSERT_EQ(buffers.initial_buffer, 15);
+    ASSERT_EQ(buffers.terminal_buffer, 10);
+    ASSERT_EQ(adaptation_windows(100, adapt_conf), std::vector<uint32_t>{90});
+
+    const auto short_adapted = warmup(make_dynamics, Parameters{torch::ones(2, scale.options())}, 100, conf);
+    const auto &short_diagonal = short_adapted.metric.diagonal.at(0);
+    ASSERT_TRUE(torch::isfinite(short_diagonal).all().item<bool>());
+    const auto short_ratio = (short_diagonal[1] / short_diagonal[0]).item<float>();
+    ASSERT_TRUE(short_ratio > 0.001f && short_ratio < 0.5f);
+}
+
+inline void test_riemannian_geometry_reuse(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(3)
+            .set_verbosity(false);
+    uint32_t evaluations = 0;
+    const auto counting_funnel = [&evaluations](const Parameters &theta) {
+        evaluations++;
+        return log_funnel(theta);
+    };
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+
+    const auto[theta_flow, momentum_flow, energy] = riemannian_dynamics(
+            counting_funnel, softabs_metric(conf), accept, conf)(
+            Parameters{GHMCData::get_theta().to(device, false, true)},
+            Momentum{GHMCData::get_momentum().to(device, false, true)});
+
+    ASSERT_EQ(theta_flow.size(), 4);
+    // one evaluation at the initial point and three per step of the implicit leapfrog
+    ASSERT_EQ(evaluations, 1 + 3 * 3);
+}
+
+inline void test_online_diagnostics(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto num_samples = 4000;
+    const auto options = torch::dtype(torch::kFloat32).device(device);
+
+    // independent draws and an AR(1) process with coefficient 1/2, i.e. integrated autocorrelation time 3
+    const auto noise = torch::randn({num_samples, 2}, options);
+    auto independent = ChainDiagnostics{DiagnosticsConfiguration{}.set_max_lag(50)};
+    auto autoregressive = ChainDiagnostics{DiagnosticsConfiguration{}.set_max_lag(50)};
+    auto state = torch::zeros(2, options);
+    for (int64_t i = 0; i < num_samples; i++) {
+        state = state / 2 + noise[i] * std::sqrt(0.75);
+        ASSERT_TRUE(independent(Parameters{noise[i]}));
+        ASSERT_TRUE(autoregressive(Parameters{state}));
+    }
+
+    ASSERT_EQ(independent.count, num_samples);
+    const auto ess = independent.effective_sample_size();
+    ASSERT_TRUE(ess.device().type() == device);
+    ASSERT_TRUE((ess > 0.7 * num_samples).all().item<bool>());
+    const auto ess_ar = autoregressive.effective_sample_size();
+    ASSERT_TRUE((ess_ar > num_samples / 4.5).all().item<bool>());
+    ASSERT_TRUE((ess_ar < num_samples / 2.).all().item<bool>());
+
+    auto chains = std::vector<ChainDiagnostics>{};
+    chains.push_back(std::move(independent));
+    chains.push_back(std::move(autoregressive));
+    ASSERT_TRUE((split_rhat(chains) < 1.05).all().item<bool>());
+
+    auto shifted = ChainDiagnostics{};
+    for (int64_t i = 0; i < 500; i++)
+        shifted(Parameters{noise[i] + 3});
+    chains.push_back(std::move(shifted));
+    ASSERT_TRUE((split_rhat(chains) > 1.2).all().item<bool>());
+
+    const auto counter = evaluation_counter();
+    const auto counting_funnel = counting_density(log_funnel, counter);
+    const auto conf = Configuration<float>{}
+            .set_max_flow_steps(3)
+            .set_step_size(0.05f);
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto ham_dym = euclidean_dynamics(
+            counting_funnel, identity_diagonal_metric_like(Parameters{theta}), metropolis_criterion, conf);
+
+    auto diagnostics = ChainDiagnostics{
+            DiagnosticsConfiguration{}.set_max_lag(20).set_target_ess(5).set_check_interval(10), counter};
+    sink_sampler(ham_dym, full_trajectory)(Parameters{theta}, 1000, diagnostics);
+    ASSERT_TRUE(diagnostics.count < 3000);
+    ASSERT_TRUE(diagnostics.min_effective_sample_size() >= 5);
+    ASSERT_TRUE(diagnostics.evaluations() > 0);
+    ASSERT_TRUE(diagnostics.elapsed_seconds() > 0);
+}
+
+inline void test_jit_log_probability(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    auto module = ScriptModule{"funnel"};
+    module.define(R"JIT(
+def forward(self, theta):
+    dim = theta.numel() - 1
+    return -((torch.exp(theta[0]) * theta[1:].pow(2).sum()) + (theta[0].pow(2) / 9) - dim * theta[0]) / 2
+)JIT");
+    const auto previous_fusion = set_cpu_fusion();
+    const auto jit_funnel = jit_log_probability(module);
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+
+    // the executor specialises the graph over the first calls
+    for (int i = 0; i < 3; i++) {
+        const auto[expected, expected_params] = log_funnel(Parameters{theta});
+        const auto[result, result_params] = jit_funnel(Parameters{theta});
+        ASSERT_TRUE(result.device().type() == device);
+        ASSERT_NEAR(result.item<float>(), expected.item<float>(), 1e-5);
+        const auto expected_grad = torch::autograd::grad({expected}, expected_params);
+        const auto result_grad = torch::autograd::grad({result}, result_params);
+        ASSERT_TRUE(torch::allclose(result_grad.at(0), expected_grad.at(0)));
+    }
+
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(5)
+            .set_step_size(0.05f)
+            .set_verbosity(false);
+    const auto ham_dym = euclidean_dynamics(
+            jit_funnel, identity_diagonal_metric_like(Parameters{theta}), metropolis_criterion, conf);
+    const auto samples = sampler(ham_dym, full_trajectory, conf)(Parameters{theta}, 5);
+    ASSERT_TRUE(samples.size() > 1);
+
+    set_cpu_fusion(previous_fusion);
+    const auto fusion = cpu_fusion();
+    ASSERT_EQ(fusion.can_fuse_on_cpu, previous_fusion.can_fuse_on_cpu);
+    ASSERT_EQ(fusion.tensor_expr_fuser_enabled, previous_fusion.tensor_expr_fuser_enabled);
+}
+
+inline void test_sghmc_minibatches(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto options = torch::dtype(torch::kFloat32).device(device);
+    const int64_t dataset_size = 1000;
+    const auto inputs = torch::arange(dataset_size, options).view({-1, 1});
+    const auto targets = 2 + torch::randn({dataset_size, 1}, options);
+
+    const auto stream = MinibatchStream{inputs, targets, 50};
+    ASSERT_EQ(stream.likelihood_scale(), 20.);
+    auto seen = Tensors{};
+    for (int i = 0; i < 20; i++)
+        seen.push_back(std::get<0>(stream.next()));
+    ASSERT_TRUE(std::get<0>(stream.next()).device().type() == device);
+    ASSERT_TRUE(torch::equal(std::get<0>(torch::sort(torch::cat(seen).flatten())), inputs.flatten()));
+
+    // Gaussian mean with a flat prior: the posterior concentrates around the sample mean
+    const auto log_prob = minibatch_log_probability<float>(
+            stream, [](const Tensor &, const Tensor &batch_targets, const float &scale) {
+                return [batch_targets, scale](const Parameters &mu_) {
+                    const auto mu = mu_.at(0).detach().requires_grad_(true);
+                    const auto log_lik = -scale * (batch_targets - mu).pow(2).sum() / 2;
+                    return LogProbabilityGraph{log_lik, {mu}};
+                };
+            });
+    const auto conf = SGHMCConfiguration<float>{}
+            .set_max_flow_steps(10)
+            .set_step_size(1e-4f)
+            .set_friction(0.1f);
+    const auto samples = sampler(sghmc_dynamics(log_prob, conf), full_trajectory, conf)(
+            Parameters{torch::zeros(1, options)}, 200);
+    ASSERT_EQ(samples.size(), 2001);
+    const auto posterior = stack(Samples(samples.begin() + 500, samples.end()));
+    ASSERT_TRUE(posterior.device().type() == device);
+    ASSERT_NEAR(posterior.mean().item<float>(), targets.mean().item<float>(), 0.1);
+
+    // a non finite gradient stops the flow only when the host is synchronised
+    const auto log_nan = [](const Parameters &mu_) {
+        const auto mu = mu_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{(mu * NAN).sum(), {mu}};
+    };
+    const auto checked = sghmc_dynamics(log_nan, conf)(Parameters{torch::zeros(1, options)});
+    ASSERT_EQ(std::get<0>(checked).size(), 1);
+    const auto unchecked = sghmc_dynamics(log_nan, SGHMCConfiguration<float>{conf}.set_host_sync(false))(
+            Parameters{torch::zeros(1, options)});
+    ASSERT_EQ(std::get<0>(unchecked).size(), 11);
+}
+
+inline void test_endpoint_flow(torch::DeviceType device = torch::kCPU) {
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(5)
+            .set_step_size(0.05f)
+            .set_verbosity(false);
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+    const auto theta = Parameters{GHMCData::get_theta().to(device, false, true)};
+    const auto momentum = Momentum{GHMCData::get_momentum().to(device, false, true)};
+    const auto metric = identity_diagonal_metric_like(theta);
+
+    const auto assert_endpoints = [](const HamiltonianFlow &full, const HamiltonianFlow &endpoint) {
+        ASSERT_EQ(std::get<0>(endpoint).size(), 2);
+        ASSERT_EQ(std::get<1>(endpoint).size(), 2);
+        ASSERT_EQ(std::get<2>(endpoint).size(), 2);
+        ASSERT_TRUE(torch::allclose(std::get<0>(endpoint).front().at(0), std::get<0>(full).front().at(0)));
+        ASSERT_TRUE(torch::allclose(std::get<0>(endpoint).back().at(0), std::get<0>(full).back().at(0)));
+        ASSERT_TRUE(torch::allclose(std::get<1>(endpoint).back().at(0), std::get<1>(full).back().at(0)));
+        ASSERT_TRUE(torch::allclose(std::get<2>(endpoint).back(), std::get<2>(full).back()));
+        ASSERT_TRUE(std::get<0>(endpoint).back().at(0).device().type() == std::get<0>(full).back().at(0).device().type());
+    };
+
+    const auto full = euclidean_dynamics(log_funnel, metric, accept, conf)(theta, momentum);
+    ASSERT_EQ(std::get<0>(full).size(), 6);
+    assert_endpoints(full, euclidean_dynamics<EndpointFlow>(log_funnel, metric, accept, conf)(theta, momentum));
+    ASSERT_EQ(end_of_trajectory(full).size(), 2);
+
+    // endpoint dynamics carry their recording, checked against the trajectory sampling by the samplers
+    const auto endpoint_dynamics = euclidean_dynamics<flow_recording_t<EndOfTrajectory>>(
+            log_funnel, metric, accept, conf);
+    static_assert(std::is_same_v<recording_t<decltype(endpoint_dynamics)>, EndpointFlow>);
+    static_assert(std::is_same_v<recording_t<decltype(euclidean_dynamics(log_funnel, metric, accept, conf))>,
+                                 FullFlow>);
+    ASSERT_EQ(sampler(endpoint_dynamics, end_of_trajectory, conf)(theta, 2).size(), 3);
+
+    assert_endpoints(
+            riemannian_dynamics(log_funnel, softabs_metric(conf), accept, conf)(theta, momentum),
+            riemannian_dynamics<flow_recording_t<EndOfTrajectory>>(
+                    log_funnel, softabs_metric(conf), accept, conf)(theta, momentum));
+
+    // deferred checks keep the last valid point
+    const auto deferred_conf = Configuration<float>{conf}.set_host_sync(false);
+    const auto breaking_funnel = []() {
+        auto evaluations = std::make_shared<uint32_t>(0);
+        return [evaluations](const Parameters &params) {
+            const auto[log_prob, graph_params] = log_funnel(params);
+            return LogProbabilityGraph{++*evaluations > 3 ? log_prob * NAN : log_prob, graph_params};
+        };
+    };
+    const auto deferred_full = euclidean_dynamics(
+            breaking_funnel(), metric, accept, deferred_conf)(theta, momentum);
+    ASSERT_EQ(std::get<0>(deferred_full).size(), 3);
+    assert_endpoints(deferred_full, euclidean_dynamics<EndpointFlow>(
+            breaking_funnel(), metric, accept, deferred_conf)(theta, momentum));
+}
+
+inline void test_mixed_precision(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(5)
+            .set_step_size(0.05f)
+            .set_verbosity(false);
+    const auto mixed_conf = Configuration<float>{conf}.set_mixed_precision(true);
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto momentum = GHMCData::get_momentum().to(device, false, true);
+
+    const auto assert_close_to_double = [](const HamiltonianFlow &mixed, const HamiltonianFlow &reference) {
+        const auto &mixed_energy = std::get<2>(mixed);
+        const auto &reference_energy = std::get<2>(reference);
+        ASSERT_EQ(mixed_energy.size(), reference_energy.size());
+        for (uint32_t i = 0; i < mixed_energy.size(); i++) {
+            ASSERT_TRUE(mixed_energy.at(i).dtype() == torch::kFloat64);
+            ASSERT_NEAR(mixed_energy.at(i).item<double>(), reference_energy.at(i).item<double>(), 1e-3);
+        }
+        ASSERT_TRUE(std::get<0>(mixed).back().at(0).dtype() == torch::kFloat32);
+        ASSERT_TRUE(torch::allclose(std::get<0>(mixed).back().at(0).to(torch::kFloat64),
+                                    std::get<0>(reference).back().at(0), 1e-3, 1e-3));
+    };
+
+    const auto metric = identity_diagonal_metric_like(Parameters{theta});
+    const auto reference_metric = identity_diagonal_metric_like(Parameters{theta.to(torch::kFloat64)});
+    assert_close_to_double(
+            euclidean_dynamics(log_funnel, metric, accept, mixed_conf)(Parameters{theta}, Momentum{momentum}),
+            euclidean_dynamics(log_funnel, reference_metric, accept, conf)(
+                    Parameters{theta.to(torch::kFloat64)}, Momentum{momentum.to(torch::kFloat64)}));
+    assert_close_to_double(
+            riemannian_dynamics(log_funnel, softabs_metric(mixed_conf), accept, mixed_conf)(
+                    Parameters{theta}, Momentum{momentum}),
+            riemannian_dynamics(log_funnel, softabs_metric(conf), accept, conf)(
+                    Parameters{theta.to(torch::kFloat64)}, Momentum{momentum.to(torch::kFloat64)}));
+
+    // the kinetic energy of a large block is reduced in float64, closer to the exact value than in float32
+    const auto nvar = 1000000;
+    const auto zeros = torch::zeros(nvar, theta.options());
+    const auto large_momentum = 1 + torch::rand(nvar, theta.options());
+    const auto log_normal = [](const Parameters &theta_) {
+        const auto param = theta_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{-param.pow(2).sum() / 2, {param}};
+    };
+    const auto initial_energy = [&](const Configuration<float> &conf_, const DiagonalMetric &metric_) {
+        const auto initial_conf = Configuration<float>{conf_}.set_max_flow_steps(0);
+        const auto flow = euclidean_dynamics(log_normal, metric_, accept, initial_conf)(
+                Parameters{zeros}, Momentum{large_momentum});
+        return std::get<2>(flow).front().item<double>();
+    };
+    const auto large_metric = identity_diagonal_metric_like(Parameters{zeros});
+    const auto exact = (large_momentum.to(torch::kFloat64).pow(2).sum() / 2).item<double>();
+    const auto float32_error = std::abs(initial_energy(conf, large_metric) - exact);
+    const auto mixed_error = std::abs(initial_energy(mixed_conf, large_metric) - exact);
+    ASSERT_TRUE(mixed_error < float32_error);
+    ASSERT_NEAR(mixed_error, 0., 1e-6 * exact);
+
+    // the Metropolis arithmetic runs on float64 energies
+    const auto samples = sampler(euclidean_dynamics(
+            log_funnel, metric, metropolis_criterion, mixed_conf), full_trajectory, mixed_conf)(Parameters{theta}, 5);
+    ASSERT_TRUE(samples.size() > 1);
+    ASSERT_TRUE(samples.back().at(0).dtype() == torch::kFloat32);
+}
+
+inline void test_replica_exchange(torch::DeviceType device = torch::kCPU) {
+    // well separated modes at -4 and 4
+    const auto log_bimodal = [](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        const auto log_prob = torch::logsumexp(
+                torch::stack({-(theta - 4).pow(2).sum() / 2, -(theta + 4).pow(2).sum() / 2}), 0);
+        return LogProbabilityGraph{log_prob, {theta}};
+    };
+    const auto conf = Configuration<float>{}
+            .set_max_flow_steps(5)
+            .set_step_size(0.3f);
+    const auto initial = Parameters{torch::full({1}, 4.f, torch::dtype(torch::kFloat32).device(device))};
+    const auto make_dynamics = [&conf, &initial](const auto &tempered_log_prob) {
+        return euclidean_dynamics(tempered_log_prob, identity_diagonal_metric_like(initial), metropolis_criterion, conf);
+    };
+    const auto inverse_temperatures = geometric_inverse_temperatures(5, 50.);
+    ASSERT_EQ(inverse_temperatures.front(), 1.);
+    ASSERT_NEAR(inverse_temperatures.back(), 0.02, 1e-12);
+
+    auto samples = Samples{};
+    const auto state = replica_exchange_sink_sampler(
+            make_dynamics, log_bimodal, full_trajectory, inverse_temperatures,
+            TemperingConfiguration{}.set_swap_interval(2),
+            ParallelConfiguration{}.set_num_threads(3))(initial, 400, [&samples](const Parameters &sample) {
+        samples.push_back(sample);
+        return true;
+    });
+    ASSERT_EQ(state.replicas.size(), 5);
+    ASSERT_EQ(state.swaps_accepted.size(), 4);
+    for (uint32_t k = 0; k < 4; k++) {
+        ASSERT_TRUE(state.swaps_attempted.at(k) > 0);
+        ASSERT_TRUE(state.swaps_accepted.at(k) > 0);
+    }
+
+    // the cold chain visits both modes
+    const auto cold = stack(samples);
+    ASSERT_TRUE(cold.device().type() == device);
+    const auto lower_mode = (cold < 0).to(torch::kFloat64).mean().item<double>();
+    ASSERT_TRUE(lower_mode > 0.2);
+    ASSERT_TRUE(lower_mode < 0.8);
+
+    // samples do not depend on the number of threads
+    const auto serial = stack(replica_exchange_sampler(
+            make_dynamics, log_bimodal, full_trajectory, inverse_temperatures,
+            TemperingConfiguration{}.set_swap_interval(2),
+            ParallelConfiguration{}.set_num_threads(1))(initial, 400));
+    ASSERT_TRUE(torch::equal(serial, cold));
+}
+
+inline void test_fisher_metric(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto options = torch::dtype(torch::kFloat64).device(device);
+    const auto x = torch::randn({2, 5}, options);
+    const auto y = torch::randn({2}, options);
+    const auto per_sample = [x, y](const Parameters &w) {
+        return LogProbabilityGraph{-(y - x.mv(w.at(0))).pow(2) / 2, w};
+    };
+    const auto log_prob = [per_sample](const Parameters &w_) {
+        const auto w = w_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{std::get<0>(per_sample({w})).sum() - w.pow(2).sum() / 2, {w}};
+    };
+
+    const auto conf = Configuration<double>{}
+            .set_max_flow_steps(3)
+            .set_step_size(0.05)
+            .set_binding_const(10.)
+            .set_fisher_damping(1.);
+    const auto low_rank_conf = Configuration<double>{conf}.set_metric_rank(2);
+
+    const auto w = torch::randn(5, options);
+    const auto graph = log_prob({w});
+    const auto residual = (y - x.mv(w)).unsqueeze(1);
+    const auto expected = (residual * x).t().mm(residual * x) + torch::eye(5, options);
+
+    const auto full = fisher_metric(per_sample, conf)(graph);
+    ASSERT_TRUE(full.has_value());
+    const auto &full_spectrum = std::get<0>(full.value()).at(0);
+    const auto &full_rotation = std::get<1>(full.value()).at(0);
+    ASSERT_TRUE(full_spectrum.device().type() == device);
+    ASSERT_TRUE(torch::allclose(full_rotation.mm(torch::diag(full_spectrum)).mm(full_rotation.t()), expected, 1e-5, 1e-5));
+
+    const auto low_rank = fisher_metric(per_sample, low_rank_conf)(graph);
+    ASSERT_TRUE(low_rank.has_value());
+    const auto &spectrum = std::get<0>(low_rank.value()).at(0);
+    const auto &rotation = std::get<1>(low_rank.value()).at(0);
+    ASSERT_TRUE(low_rank_block(rotation));
+    ASSERT_EQ(rotation.size(1), 2);
+    ASSERT_EQ(spectrum.numel(), 3);
+    ASSERT_TRUE(torch::allclose(inverse_metric(spectrum, rotation), torch::inverse(expected)));
+    ASSERT_NEAR(metric_log_determinant(spectrum, rotation).item<double>(), torch::logdet(expected).item<double>(), 1e-8);
+
+    // more data points than parameters: the leading directions of the per-sample gradients
+    const auto many_x = torch::randn({8, 5}, options);
+    const auto many_y = torch::randn({8}, options);
+    const auto many_per_sample = [many_x, many_y](const Parameters &w_) {
+        return LogProbabilityGraph{-(many_y - many_x.mv(w_.at(0))).pow(2) / 2, w_};
+    };
+    const auto many_residual = (many_y - many_x.mv(w)).unsqueeze(1);
+    const auto many_outer = (many_residual * many_x).t().mm(many_residual * many_x);
+    const auto many_eigs = std::get<0>(torch::linalg::eigh(many_outer, "L"));
+    const auto many = fisher_metric(many_per_sample, low_rank_conf)(graph);
+    ASSERT_TRUE(many.has_value());
+    const auto &many_spectrum = std::get<0>(many.value()).at(0);
+    const auto &many_rotation = std::get<1>(many.value()).at(0);
+    ASSERT_EQ(many_rotation.size(1), 2);
+    ASSERT_TRUE(torch::allclose(many_rotation.t().mm(many_rotation), torch::eye(2, options), 1e-6, 1e-6));
+    ASSERT_TRUE(torch::allclose(many_spectrum.slice(0, 0, 2), many_eigs.slice(0, 3) + 1., 1e-6, 1e-6));
+    ASSERT_TRUE(torch::allclose(many_outer.mm(many_rotation), many_rotation * many_eigs.slice(0, 3), 1e-6, 1e-6));
+
+    // the exact low rank metric gives the same Riemannian flow
+    const auto momentum = Momentum{torch::randn(5, options)};
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+    const auto full_flow = riemannian_dynamics(log_prob, fisher_metric(per_sample, conf), accept, conf)(
+            Parameters{w}, momentum);
+    const auto low_rank_flow = riemannian_dynamics(
+            log_prob, fisher_metric(per_sample, low_rank_conf), accept, low_rank_conf)(Parameters{w}, momentum);
+    ASSERT_EQ(std::get<0>(full_flow).size(), 4);
+    ASSERT_EQ(std::get<0>(low_rank_flow).size(), 4);
+    ASSERT_TRUE(torch::allclose(std::get<0>(full_flow).back().at(0), std::get<0>(low_rank_flow).back().at(0), 1e-4, 1e-4));
+    ASSERT_NEAR(std::get<2>(full_flow).back().item<double>(), std::get<2>(low_rank_flow).back().item<double>(), 1e-4);
+}
+
+inline void test_lanczos_softabs_metric(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto options = torch::dtype(torch::kFloat64).device(device);
+    const int64_t n = 20;
+    const auto Q = std::get<0>(torch::linalg::qr(torch::randn({n, n}, options)));
+    const auto eigs = torch::cat({torch::tensor({100., 50., 20.}, options), torch::linspace(0.5, 2., n - 3, options)});
+    const auto A = Q.mm(torch::diag(eigs)).mm(Q.t());
+    const auto log_gaussian = [A](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{-theta.dot(A.mv(theta)) / 2, {theta}};
+    };
+
+    const auto conf = Configuration<double>{}
+            .set_metric_rank(3)
+            .set_metric_floor(1.);
+    const auto metric = lanczos_softabs_metric(conf)(log_gaussian({torch::randn(n, options)}));
+    ASSERT_TRUE(metric.has_value());
+    const auto &spectrum = std::get<0>(metric.value()).at(0);
+    const auto &rotation = std::get<1>(metric.value()).at(0);
+    ASSERT_TRUE(spectrum.device().type() == device);
+    ASSERT_TRUE(low_rank_block(rotation));
+    ASSERT_EQ(rotation.size(1), 3);
+    ASSERT_TRUE(torch::allclose(spectrum, torch::tensor({100., 50., 20., 1.}, options), 1e-6, 1e-6));
+    // the leading eigenvectors are recovered up to sign
+    ASSERT_TRUE(torch::allclose(rotation.t().mm(Q.slice(1, 0, 3)).abs(), torch::eye(3, options), 1e-6, 1e-6));
+
+    const auto v = torch::randn(n, options);
+    const auto top = Q.slice(1, 0, 3);
+    const auto expected = v + top.mv((1 / eigs.slice(0, 0, 3) - 1) * top.t().mv(v));
+    ASSERT_TRUE(torch::allclose(inverse_metric_mv(spectrum, rotation, utils::Tensor{}, v), expected, 1e-6, 1e-6));
+
+    // with full rank the Lanczos metric is the SoftAbs metric, here on a density with a varying Hessian
+    const auto log_quartic = [A](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{-theta.dot(A.mv(theta)) / 2 - theta.dot(theta).pow(2) / 40, {theta}};
+    };
+    const auto flow_conf = Configuration<double>{conf}
+            .set_max_flow_steps(3)
+            .set_step_size(0.01)
+            .set_binding_const(10.)
+            .set_jitter(1e-9)
+            .set_metric_rank(n);
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+    const auto theta = Parameters{torch::randn(n, options) / 4};
+    const auto momentum = Momentum{torch::randn(n, options)};
+    const auto softabs_flow = riemannian_dynamics(log_quartic, softabs_metric(flow_conf), accept, flow_conf)(
+            theta, momentum);
+    const auto lanczos_flow = riemannian_dynamics(
+            log_quartic, lanczos_softabs_metric(flow_conf), accept, flow_conf)(theta, momentum);
+    ASSERT_EQ(std::get<0>(lanczos_flow).size(), 4);
+    ASSERT_TRUE(torch::allclose(std::get<0>(lanczos_flow).back().at(0), std::get<0>(softabs_flow).back().at(0), 1e-6, 1e-6));
+    ASSERT_NEAR(std::get<2>(lanczos_flow).back().item<double>(), std::get<2>(softabs_flow).back().item<double>(), 1e-6);
+
+    const auto low_rank_conf = Configuration<double>{flow_conf}.set_metric_rank(3);
+    const auto low_rank_flow = riemannian_dynamics(
+            log_quartic, lanczos_softabs_metric(low_rank_conf), accept, low_rank_conf)(theta, momentum);
+    ASSERT_EQ(std::get<2>(low_rank_flow).size(), 4);
+    for (const auto &energy : std::get<2>(low_rank_flow))
+        ASSERT_TRUE(torch::isfinite(energy).item<bool>());
+
+    // with a truncated rank the metric is still a function of the position
+    const auto low_rank_metric = lanczos_softabs_metric(low_rank_conf);
+    const auto first = low_rank_metric(log_quartic(theta));
+    torch::randn(n, options);
+    const auto second = low_rank_metric(log_quartic(theta));
+    ASSERT_TRUE(first.has_value() && second.has_value());
+    ASSERT_TRUE(torch::equal(std::get<0>(first.value()).at(0), std::get<0>(second.value()).at(0)));
+    ASSERT_TRUE(torch::equal(std::get<1>(first.value()).at(0), std::get<1>(second.value()).at(0)));
+
+    // repeated eigenvalues: the start vector spans only two directions of the Krylov space
+    const auto repeated = torch::diag(torch::cat({torch::full({3}, 10., options), torch::ones(n - 3, options)}));
+    const auto log_repeated = [repeated](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{-theta.dot(repeated.mv(theta)) / 2, {theta}};
+    };
+    const auto repeated_metric = lanczos_softabs_metric(Configuration<double>{conf}.set_metric_rank(4))(
+            log_repeated({torch::randn(n, options)}));
+    ASSERT_TRUE(repeated_metric.has_value());
+    const auto &repeated_spectrum = std::get<0>(repeated_metric.value()).at(0);
+    const auto &repeated_rotation = std::get<1>(repeated_metric.value()).at(0);
+    ASSERT_EQ(repeated_rotation.size(1), 4);
+    ASSERT_TRUE(torch::allclose(repeated_rotation.t().mm(repeated_rotation), torch::eye(4, options), 1e-6, 1e-6));
+    ASSERT_TRUE(torch::allclose(repeated_spectrum, torch::tensor({10., 10., 10., 1., 1.}, options), 1e-6, 1e-6));
+    // the three leading directions span the eigenspace of 10
+    const auto leading = repeated_rotation.slice(1, 0, 3);
+    ASSERT_NEAR(leading.slice(0, 3).abs().max().item<double>(), 0., 1e-6);
+}
+
+inline void test_fixed_size_sampler() {
+    constexpr std::size_t N = 10;
+    const auto dual_funnel = [](const auto &theta) {
+        auto squares = theta[1] * theta[1];
+        for (std::size_t i = 2; i < N; i++)
+            squares = squares + theta[i] * theta[i];
+        return -(exp(theta[0]) * squares + theta[0] * theta[0] / 9 - (N - 1.) * theta[0]) / 2;
+    };
+    const auto theta_tensor = GHMCData::get_theta().to(torch::kFloat64);
+    ASSERT_EQ(theta_tensor.numel(), N);
+    auto theta = FixedVector<double, N>{};
+    std::copy(theta_tensor.data_ptr<double>(), theta_tensor.data_ptr<double>() + N, theta.begin());
+
+    const auto dual_log_prob = dual_log_probability<double, N>(dual_funnel)(theta);
+    const auto torch_log_prob = torch_log_probability<double, N>(log_funnel)(theta);
+    ASSERT_TRUE(dual_log_prob.has_value());
+    ASSERT_TRUE(torch_log_prob.has_value());
+    ASSERT_NEAR(dual_log_prob.value().log_prob, torch_log_prob.value().log_prob, 1e-10);
+    for (std::size_t i = 0; i < N; i++)
+        ASSERT_NEAR(dual_log_prob.value().gradient[i], torch_log_prob.value().gradient[i], 1e-10);
+
+    // the fixed flow follows euclidean_dynamics
+    const auto conf = Configuration<double>{}
+            .set_max_flow_steps(5)
+            .set_step_size(0.05);
+    const auto accept = [](const auto &...) { return true; };
+    const auto momentum_tensor = GHMCData::get_momentum().to(torch::kFloat64);
+    auto momentum = FixedVector<double, N>{};
+    std::copy(momentum_tensor.data_ptr<double>(), momentum_tensor.data_ptr<double>() + N, momentum.begin());
+    auto unit = FixedVector<double, N>{};
+    unit.fill(1.);
+
+    auto generator = FixedGenerator{utils::SEED};
+    const auto fixed_flow = fixed_euclidean_dynamics(
+            dual_log_probability<double, N>(dual_funnel), unit, accept, conf)(theta, generator, momentum);
+    const auto flow = euclidean_dynamics(log_funnel, identity_diagonal_metric_like(Parameters{theta_tensor}), accept, conf)(
+            Parameters{theta_tensor}, Momentum{momentum_tensor});
+    ASSERT_EQ(fixed_flow.params.size(), 6);
+    for (std::size_t step = 0; step < fixed_flow.params.size(); step++) {
+        const auto expected = std::get<0>(flow).at(step).at(0);
+        for (std::size_t i = 0; i < N; i++)
+            ASSERT_NEAR(fixed_flow.params.at(step)[i], expected[i].item<double>(), 1e-10);
+        ASSERT_NEAR(fixed_flow.energy.at(step), std::get<2>(flow).at(step).item<double>(), 1e-10);
+    }
+
+    // standard normal in two dimensions
+    const auto dual_normal = [](const auto &x) { return -(x[0] * x[0] + x[1] * x[1]) / 2.; };
+    const auto normal_conf = Configuration<double>{}
+            .set_max_flow_steps(5)
+            .set_step_size(0.3);
+    const auto normal_sampler = fixed_sampler(fixed_euclidean_dynamics(
+            dual_log_probability<double, 2>(dual_normal), FixedVector<double, 2>{1., 1.},
+            fixed_metropolis_criterion, normal_conf));
+    const auto samples = normal_sampler(FixedVector<double, 2>{0., 0.}, 1000);
+    ASSERT_TRUE(samples.size() > 1000);
+    const auto samples_tensor = fixed_samples_tensor(samples);
+    ASSERT_EQ(samples_tensor.size(1), 2);
+    ASSERT_TRUE(samples_tensor.mean(0).abs().max().item<double>() < 0.15);
+    ASSERT_TRUE((samples_tensor.var(0) - 1).abs().max().item<double>() < 0.2);
+}
+
+inline void test_sampler_statistics(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto statistics = sampler_statistics();
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(5)
+            .set_step_size(0.05f)
+            .set_verbosity(false)
+            .set_statistics(statistics);
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+    const auto reject = [](const HamiltonianFlow &) { return false; };
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto momentum = GHMCData::get_momentum().to(device, false, true);
+
+    // one log probability and gradient per leapfrog step on top of the initial point
+    const auto metric = identity_diagonal_metric_like(Parameters{theta});
+    euclidean_dynamics(log_funnel, metric, accept, conf)(Parameters{theta}, Momentum{momentum});
+    ASSERT_EQ(statistics->trajectories.load(), 1);
+    ASSERT_EQ(statistics->completed.load(), 1);
+    ASSERT_EQ(statistics->log_prob_evaluations.load(), 6);
+    ASSERT_EQ(statistics->gradient_evaluations.load(), 6);
+    ASSERT_EQ(statistics->hessian_evaluations.load(), 0);
+
+    euclidean_dynamics(log_funnel, metric, reject, conf)(Parameters{theta}, Momentum{momentum});
+    ASSERT_EQ(statistics->trajectories.load(), 2);
+    ASSERT_EQ(statistics->rejected.load(), 1);
+
+    // a failing log probability stops the trajectory
+    const auto log_nan = [](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        return LogProbabilityGraph{theta.sum() * NAN, Parameters{theta}};
+    };
+    euclidean_dynamics(log_nan, metric, accept, conf)(Parameters{theta}, Momentum{momentum});
+    ASSERT_EQ(statistics->trajectories.load(), 3);
+    ASSERT_EQ(statistics->early_stopped.load(), 1);
+    ASSERT_EQ(statistics->log_prob_failures.load(), 1);
+
+    // every Riemannian evaluation of the log probability comes with its metric
+    const auto log_prob_evaluations = statistics->log_prob_evaluations.load();
+    riemannian_dynamics(log_funnel, softabs_metric(conf), accept, conf)(Parameters{theta}, Momentum{momentum});
+    ASSERT_EQ(statistics->trajectories.load(), 4);
+    ASSERT_EQ(statistics->completed.load(), 2);
+    ASSERT_EQ(statistics->metric_evaluations.load(), statistics->log_prob_evaluations.load() - log_prob_evaluations);
+    ASSERT_EQ(statistics->hessian_evaluations.load(), statistics->metric_evaluations.load());
+    ASSERT_EQ(statistics->metric_failures.load(), 0);
+
+    ASSERT_TRUE(statistics->integrator_nanoseconds.load() >= statistics->metric_nanoseconds.load());
+    ASSERT_TRUE(statistics->metric_nanoseconds.load() > 0);
+    ASSERT_TRUE(statistics->log_prob_nanoseconds.load() > 0);
+
+    // deferred checks set the outcome once the flow is truncated
+    const auto deferred_statistics = sampler_statistics();
+    const auto deferred_conf = Configuration<float>{conf}
+            .set_host_sync(false)
+            .set_statistics(deferred_statistics);
+    euclidean_dynamics(log_funnel, metric, accept, deferred_conf)(Parameters{theta}, Momentum{momentum});
+    euclidean_dynamics(log_funnel, metric, reject, deferred_conf)(Parameters{theta}, Momentum{momentum});
+    euclidean_dynamics(log_nan, metric, accept, deferred_conf)(Parameters{theta}, Momentum{momentum});
+    ASSERT_EQ(deferred_statistics->trajectories.load(), 3);
+    ASSERT_EQ(deferred_statistics->completed.load(), 1);
+    ASSERT_EQ(deferred_statistics->rejected.load(), 1);
+    ASSERT_EQ(deferred_statistics->early_stopped.load(), 1);
+
+    // every parallel chain collects its own statistics
+    const auto num_iterations = 4;
+    const auto chains_sampler = parallel_statistics_sampler(
+            [&conf, &metric](const SamplerStatisticsPtr &chain_statistics) {
+                const auto chain_conf = Configuration<float>{conf}.set_statistics(chain_statistics);
+                return sampler(euclidean_dynamics(log_funnel, metric, metropolis_criterion, chain_conf),
+                               full_trajectory, chain_conf);
+            },
+            ParallelConfiguration{}.set_num_threads(3));
+    const auto chains = chains_sampler(ChainsParameters(3, Parameters{theta}), num_iterations);
+    ASSERT_EQ(chains.samples.size(), 3);
+    ASSERT_EQ(chains.statistics.size(), 3);
+    for (const auto &chain_statistics : chains.statistics) {
+        ASSERT_EQ(chain_statistics->trajectories.load(), num_iterations);
+        ASSERT_EQ(chain_statistics->completed.load() + chain_statistics->rejected.load() +
+                  chain_statistics->early_stopped.load(), num_iterations);
+    }
+    ASSERT_NE(chains.statistics.at(0), chains.statistics.at(1));
+}
+
+inline void test_checkpoint_resume(torch::DeviceType device = torch::kCPU) {
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(5)
+            .set_step_size(0.05f)
+            .set_verbosity(false);
+    const auto make_dynamics = [](const Configuration<float> &conf_, const DiagonalMetric &metric) {
+        return euclidean_dynamics(log_funnel, metric, metropolis_criterion, conf_);
+    };
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto start = initial_checkpoint(Parameters{theta}, identity_diagonal_metric_like(Parameters{theta}), 0.05);
+    ASSERT_EQ(start.iteration, 0);
+
+    const auto checkpoint_path = std::filesystem::temp_directory_path() / "noa-ghmc-checkpoint.pt";
+    std::filesystem::remove(checkpoint_path);
+    const auto checkpoint_conf = CheckpointConfiguration{}.set_path(checkpoint_path).set_interval(2);
+
+    const auto expected = stack(checkpoint_sampler(
+            make_dynamics, full_trajectory, conf, CheckpointConfiguration{})(start, 6));
+    ASSERT_TRUE(expected.size(0) > 6);
+
+    // the job stops after three trajectories
+    const auto interrupted = checkpoint_sampler(
+            make_dynamics, full_trajectory, conf, checkpoint_conf)(start, 3);
+    ASSERT_TRUE(torch::equal(stack(interrupted), expected.slice(0, 0, static_cast<int64_t>(interrupted.size()))));
+    const auto checkpoint = load_checkpoint(checkpoint_path);
+    ASSERT_TRUE(checkpoint.has_value());
+    ASSERT_EQ(checkpoint.value().iteration, 3);
+    ASSERT_TRUE(checkpoint.value().parameters.at(0).device().type() == device);
+    ASSERT_TRUE(torch::equal(checkpoint.value().metric.diagonal.at(0), start.metric.diagonal.at(0)));
+    ASSERT_EQ(checkpoint.value().step_size, 0.05);
+
+    const auto resumed = stack(checkpoint_sampler(
+            make_dynamics, full_trajectory, conf, checkpoint_conf)(checkpoint.value(), 6));
+    ASSERT_TRUE(torch::equal(resumed, expected.slice(0, expected.size(0) - resumed.size(0))));
+    ASSERT_TRUE(torch::equal(stack(Samples{checkpoint.value().parameters}),
+                             expected.slice(0, expected.size(0) - resumed.size(0) - 1,
+                                            expected.size(0) - resumed.size(0))));
+
+    const auto finished = load_checkpoint(checkpoint_path);
+    ASSERT_TRUE(finished.has_value());
+    ASSERT_EQ(finished.value().iteration, 6);
+    std::filesystem::remove(checkpoint_path);
+}
+
+inline void test_variational_warm_start(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto options = torch::dtype(torch::kFloat64).device(device);
+    const auto location = torch::tensor({1., -2.}, options);
+    const auto covariance = torch::tensor({{1., 0.5}, {0.5, 1.}}, options);
+    const auto precision = torch::inverse(covariance);
+    const auto log_normal = [location, precision](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        const auto centered = theta - location;
+        return LogProbabilityGraph{-centered.dot(precision.mv(centered)) / 2, {theta}};
+    };
+    const auto conf = Configuration<double>{}
+            .set_max_flow_steps(10)
+            .set_step_size(0.3);
+    const auto initial = Parameters{torch::zeros(2, options)};
+
+    const auto mean_field = variational_warm_start(log_normal, initial, conf, VariationalConfiguration{}
+            .set_num_iterations(2000)
+            .set_num_draws(4)
+            .set_learning_rate(0.02));
+    ASSERT_TRUE(torch::allclose(mean_field.mean.at(0), location, 0., 0.1));
+    // mean-field variances match the conditional variances 1 / precision_ii
+    const auto mean_field_variance = mean_field.scale_factor.at(0).diagonal().square();
+    ASSERT_TRUE(torch::allclose(mean_field_variance, 1 / precision.diagonal(), 0.2, 0.));
+
+    const auto full_rank = variational_warm_start(log_normal, initial, conf, VariationalConfiguration{}
+            .set_num_iterations(2000)
+            .set_num_draws(4)
+            .set_learning_rate(0.02)
+            .set_full_rank(true));
+    ASSERT_TRUE(torch::allclose(full_rank.mean.at(0), location, 0., 0.1));
+    const auto &scale_factor = full_rank.scale_factor.at(0);
+    ASSERT_TRUE(torch::allclose(scale_factor.mm(scale_factor.t()), covariance, 0., 0.15));
+    ASSERT_TRUE(std::isfinite(full_rank.elbo));
+
+    // the fitted metric is the precision of the target
+    const auto metric = variational_metric(full_rank);
+    const auto &[spectrum, rotation] = metric;
+    const auto fitted_precision = rotation.at(0).mm(torch::diag(spectrum.at(0))).mm(rotation.at(0).t());
+    ASSERT_TRUE(torch::allclose(fitted_precision, precision, 0.3, 0.));
+
+    const auto starts = variational_draws(full_rank, 4);
+    ASSERT_EQ(starts.size(), 4);
+    const auto samples = sampler(euclidean_dynamics(log_normal, metric, metropolis_criterion, conf),
+                                 full_trajectory, conf)(starts.front(), 100);
+    ASSERT_TRUE(samples.size() > 100);
+    ASSERT_TRUE(torch::allclose(stack(samples).mean(0), location, 0., 0.3));
+}
+
+inline void test_speculative_sampler(torch::DeviceType device = torch::kCPU) {
+    const auto conf = Configuration<float>{conf_funnel}
+            .set_max_flow_steps(5)
+            .set_step_size(0.05f)
+            .set_verbosity(false);
+    const auto theta = GHMCData::get_theta().to(device, false, true);
+    const auto metric = identity_diagonal_metric_like(Parameters{theta});
+    const auto whole_trajectory = [](const HamiltonianFlow &) { return true; };
+    const auto ham_dym = euclidean_dynamics<EndpointFlow>(log_funnel, metric, whole_trajectory, conf);
+    const auto parallel_conf = ParallelConfiguration{}.set_num_threads(3);
+
+    // the trajectories run all the leapfrog steps
+    torch::manual_seed(utils::SEED);
+    const auto full_flow = euclidean_dynamics(log_funnel, metric, whole_trajectory, conf)(Parameters{theta});
+    ASSERT_EQ(std::get<0>(full_flow).size(), conf.max_flow_steps + 1);
+    ASSERT_EQ(std::get<0>(ham_dym(Parameters{theta})).size(), 2);
+
+    const auto sequential = speculative_sampler(
+            ham_dym, SpeculativeConfiguration{}.set_depth(1), parallel_conf)(Parameters{theta}, 20);
+    ASSERT_EQ(sequential.size(), 21);
+    const auto sequential_samples = stack(sequential);
+    ASSERT_TRUE(torch::equal(sequential_samples[0], theta));
+
+    // rejections repeat the current state
+    const auto num_moves = (sequential_samples.slice(0, 1) != sequential_samples.slice(0, 0, -1))
+            .any(1).sum().item<int64_t>();
+    ASSERT_TRUE(num_moves > 0);
+
+    for (const auto depth : {2u, 3u, 8u}) {
+        const auto speculative = speculative_sampler(
+                ham_dym, SpeculativeConfiguration{}.set_depth(depth), parallel_conf)(Parameters{theta}, 20);
+        ASSERT_TRUE(torch::equal(stack(speculative), sequential_samples));
+    }
+}
+
+inline void test_sparse_hessian(torch::DeviceType device = torch::kCPU) {
+    torch::manual_seed(utils::SEED);
+    const auto options = torch::dtype(torch::kFloat64).device(device);
+    constexpr int64_t num_blocks = 4;
+    constexpr int64_t block_size = 3;
+    const int64_t n = num_blocks * block_size;
+    // independent groups with correlated parameters inside each group
+    const auto log_grouped = [=](const Parameters &theta_) {
+        const auto theta = theta_.at(0).detach().requires_grad_(true);
+        const auto groups = theta.view({num_blocks, block_size});
+        const auto log_prob = -(groups.pow(2).sum() / 2 + (groups.select(1, 0) * groups.select(1, 1)).pow(2).sum() +
+                                groups.select(1, 2).pow(4).sum() / 4 + (groups.select(1, 0) * groups.select(1, 2)).sum() / 2);
+        return LogProbabilityGraph{log_prob, {theta}};
+    };
+    const auto theta = Parameters{torch::randn(n, options)};
+
+    const auto colouring = numerics::hessian_colouring(
+            numerics::block_diagonal_pattern(std::vector<int64_t>(num_blocks, block_size)), n);
+    ASSERT_EQ(colouring.num_colours, block_size);
+    ASSERT_EQ(colouring.indices.size(1), num_blocks * block_size * block_size);
+
+    const auto dense = numerics::hessian(log_grouped(theta));
+    ASSERT_TRUE(dense.has_value());
+    for (const uint32_t chunk_size : {1, 2, 0}) {
+        const auto sparse = numerics::sparse_hessian(log_grouped(theta), {colouring}, chunk_size);
+        ASSERT_TRUE(sparse.has_value());
+        ASSERT_TRUE(sparse.value().at(0).is_sparse());
+        ASSERT_TRUE(torch::allclose(sparse.value().at(0).to_dense(), dense.value().at(0), 1e-10, 1e-10));
+    }
+
+    // a detected pattern is at most as dense as the structural one
+    const auto detected = numerics::detect_hessian_pattern(log_grouped(theta));
+    ASSERT_TRUE(detected.has_value());
+    const auto detected_colouring = numerics::hessian_colouring(detected.value().at(0), n);
+    ASSERT_TRUE(detected_colouring.num_colours <= block_size);
+    const auto detected_sparse = numerics::sparse_hessian(log_grouped(theta), {detected_colouring});
+    ASSERT_TRUE(detected_sparse.has_value());
+    ASSERT_TRUE(torch::allclose(detected_sparse.value().at(0).to_dense(), dense.value().at(0), 1e-10, 1e-10));
+
+    const auto conf = Configuration<double>{}
+            .set_max_flow_steps(3)
+            .set_step_size(0.01)
+            .set_binding_const(10.)
+            .set_jitter(1e-9);
+    const auto sparse_metric = softabs_metric(conf, {colouring})(log_grouped(theta));
+    const auto dense_metric = softabs_metric(conf)(log_grouped(theta));
+    ASSERT_TRUE(sparse_metric.has_value());
+    ASSERT_TRUE(dense_metric.has_value());
+    const auto metric_matrix = [](const MetricDecomposition &metric) {
+        const auto &rotation = std::get<1>(metric).at(0);
+        return rotation.mm(torch::diag(std::get<0>(metric).at(0))).mm(rotation.t());
+    };
+    ASSERT_TRUE(torch::allclose(metric_matrix(sparse_metric.value()), metric_matrix(dense_metric.value()), 1e-6, 1e-6));
+
+    const auto accept = [](const HamiltonianFlow &) { return true; };
+    const auto momentum = Momentum{torch::randn(n, options)};
+    const auto sparse_flow = riemannian_dynamics(log_grouped, softabs_metric(conf, {colouring}), accept, conf)(
+            theta, momentum);
+    const auto dense_flow = riemannian_dynamics(log_grouped, softabs_metric(conf), accept, conf)(theta, momentum);
+    ASSERT_EQ(std::get<0>(sparse_flow).size(), 4);
+    ASSERT_TRUE(torch::allclose(std::get<0>(sparse_flow).back().at(0), std::get<0>(dense_flow).back().at(0), 1e-6, 1e-6));
+    ASSERT_NEAR(std::get<2>(sparse_flow).back().item<double>(), std::get<2>(dense_flow).back().item<double>(), 1e-6);
+}